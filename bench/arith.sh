@@ -0,0 +1,46 @@
+#!/bin/sh
+# Time of integer arithmetic that never leaves fixnums, to check that the
+# overflow checks of the numeric tower cost nothing noticeable. Give a
+# baseline lispy, such as one built from before the numeric tower, to
+# compare against it.
+#
+#   $ bench/arith.sh [path to lispy] [path to baseline lispy] [runs]
+#
+# Run from the root of the repository, where prelude.lspy is.
+LISPY=${1:-./lispy}
+BASE=$2
+RUNS=${3:-5}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+cat > "$TMP/arith.lspy" <<'LSPY'
+(load "prelude.lspy")
+(fun {loop n acc} {
+  if (== n 0)
+    {acc}
+    {loop (- n 1) (% (+ (* acc 31) (/ n 3) (- n 7)) 1000003)}
+})
+(print (loop 300000 1))
+LSPY
+
+# best wall time of the runs of the given command, in milliseconds
+run() {
+    best=
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        "$@" > /dev/null
+        t=$(( ($(date +%s%N) - start) / 1000000 ))
+        if [ -z "$best" ] || [ "$t" -lt "$best" ]; then best=$t; fi
+        i=$((i + 1))
+    done
+    echo "$best"
+}
+
+echo "result:            $("$LISPY" "$TMP/arith.lspy")"
+echo "lispy:             $(run "$LISPY" "$TMP/arith.lspy")ms"
+if [ -n "$BASE" ]; then
+    echo "baseline result:   $("$BASE" "$TMP/arith.lspy")"
+    echo "baseline:          $(run "$BASE" "$TMP/arith.lspy")ms"
+fi
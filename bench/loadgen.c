@@ -0,0 +1,192 @@
+/**
+ * Load generator for lispy --serve. Each connection is a thread sending
+ * one request at a time and waiting for its reply, and the throughput and
+ * latency over all of them are reported. With -r every request is sent on
+ * a new connection, which measures setting one up, as under --isolate.
+ *
+ *   $ cc -std=c11 -O2 -pthread bench/loadgen.c -o loadgen
+ *   $ ./loadgen [-r] <socket> [connections] [requests each] [expression]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef struct {
+    const char* path;
+    const char* expr;
+    int requests;
+    int reconnect;
+    long* latency; // of each request, in nanoseconds
+    int errors;
+    int failed;    // the connection broke before every request was done
+} lclient;
+
+static long lnow(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static int lsend_all(int fd, const char* p, size_t n) {
+    while (n) {
+        ssize_t k = write(fd, p, n);
+        if (k <= 0) { return 0; }
+        p += k;
+        n -= k;
+    }
+    return 1;
+}
+
+static int lrecv_all(int fd, char* p, size_t n) {
+    while (n) {
+        ssize_t k = read(fd, p, n);
+        if (k <= 0) { return 0; }
+        p += k;
+        n -= k;
+    }
+    return 1;
+}
+
+static int lconnect(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static void* lclient_run(void* p) {
+    lclient* c = p;
+    int fd = c->reconnect ? -1 : lconnect(c->path);
+    if (!c->reconnect && fd < 0) {
+        c->failed = 1;
+        return NULL;
+    }
+
+    // every request is the same frame
+    size_t len = strlen(c->expr);
+    char* frame = malloc(len + 4);
+    frame[0] = len >> 24;
+    frame[1] = len >> 16;
+    frame[2] = len >> 8;
+    frame[3] = len;
+    memcpy(frame + 4, c->expr, len);
+
+    char* reply = NULL;
+    size_t cap = 0;
+    for (int i = 0; i < c->requests; i++) {
+        long start = lnow();
+        if (c->reconnect && (fd = lconnect(c->path)) < 0) {
+            c->failed = 1;
+            break;
+        }
+        unsigned char head[4];
+        if (!lsend_all(fd, frame, len + 4) ||
+            !lrecv_all(fd, (char*)head, 4)) {
+            c->failed = 1;
+            break;
+        }
+        size_t n = (uint32_t)head[0] << 24 | (uint32_t)head[1] << 16 |
+                   (uint32_t)head[2] << 8 | head[3];
+        if (n > cap) {
+            cap = n;
+            reply = realloc(reply, cap);
+        }
+        if (n == 0 || !lrecv_all(fd, reply, n)) {
+            c->failed = 1;
+            break;
+        }
+        if (c->reconnect) {
+            close(fd);
+            fd = -1;
+        }
+        c->latency[i] = lnow() - start;
+        if (reply[0] != 0) {
+            if (c->errors++ == 0) {
+                fprintf(stderr, "error: %.*s\n", (int)n - 1, reply + 1);
+            }
+        }
+    }
+    free(reply);
+    free(frame);
+    if (fd >= 0) { close(fd); }
+    return NULL;
+}
+
+static int lcmp_long(const void* a, const void* b) {
+    long x = *(const long*)a;
+    long y = *(const long*)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[]) {
+    int reconnect = argc > 1 && strcmp(argv[1], "-r") == 0;
+    if (reconnect) {
+        argv++;
+        argc--;
+    }
+    if (argc < 2) {
+        fprintf(stderr, "usage: loadgen [-r] <socket> [connections] "
+                        "[requests each] [expression]\n");
+        return 1;
+    }
+    int conns = argc > 2 ? atoi(argv[2]) : 4;
+    int requests = argc > 3 ? atoi(argv[3]) : 1000;
+    const char* expr = argc > 4 ? argv[4] : "(+ 1 2 3)";
+    if (conns < 1 || requests < 1) {
+        fputs("connections and requests must be at least 1\n", stderr);
+        return 1;
+    }
+
+    long* latency = calloc((size_t)conns * requests, sizeof(long));
+    lclient* clients = calloc(conns, sizeof(lclient));
+    pthread_t* threads = calloc(conns, sizeof(pthread_t));
+
+    long start = lnow();
+    for (int i = 0; i < conns; i++) {
+        clients[i] = (lclient){ argv[1], expr, requests, reconnect,
+                                latency + (size_t)i * requests, 0, 0 };
+        pthread_create(&threads[i], NULL, lclient_run, &clients[i]);
+    }
+    int errors = 0;
+    int failed = 0;
+    for (int i = 0; i < conns; i++) {
+        pthread_join(threads[i], NULL);
+        errors += clients[i].errors;
+        failed += clients[i].failed;
+    }
+    double secs = (lnow() - start) / 1e9;
+
+    // requests that never completed are left at 0 and not counted
+    size_t total = (size_t)conns * requests;
+    qsort(latency, total, sizeof(long), lcmp_long);
+    size_t skip = 0;
+    while (skip < total && latency[skip] == 0) { skip++; }
+    size_t done = total - skip;
+    long* l = latency + skip;
+
+    printf("requests:    %zu in %.3fs, %.0f/s\n", done, secs, done / secs);
+    if (done) {
+        printf("latency:     p50 %.1fus, p99 %.1fus, max %.1fus\n",
+               l[done / 2] / 1e3, l[done * 99 / 100] / 1e3,
+               l[done - 1] / 1e3);
+    }
+    if (errors) { printf("errors:      %i\n", errors); }
+    if (failed) { printf("failed:      %i connections\n", failed); }
+
+    free(threads);
+    free(clients);
+    free(latency);
+    return failed ? 1 : 0;
+}
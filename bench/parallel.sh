@@ -0,0 +1,48 @@
+#!/bin/sh
+# Time of pmap over a list whose items each take a while, against map,
+# with the pool at each of the given sizes. On a machine with that many
+# cores pmap should take close to the time of map divided by the size.
+#
+#   $ bench/parallel.sh [path to lispy] [pool sizes] [runs]
+#
+# Run from the root of the repository, where prelude.lspy is.
+LISPY=${1:-./lispy}
+SIZES=${2:-"1 2 4 8"}
+RUNS=${3:-3}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# 64 items of around the same work each
+ITEMS=$(i=0; while [ $i -lt 64 ]; do printf '%s ' $((17 + i % 4)); i=$((i + 1)); done)
+
+cat > "$TMP/map.lspy" <<LSPY
+(load "prelude.lspy")
+(print (sum (map fib {$ITEMS})))
+LSPY
+
+cat > "$TMP/pmap.lspy" <<LSPY
+(load "prelude.lspy")
+(print (sum (pmap fib {$ITEMS})))
+LSPY
+
+# best wall time of the runs of the given command, in milliseconds
+run() {
+    best=
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        "$@" > /dev/null
+        t=$(( ($(date +%s%N) - start) / 1000000 ))
+        if [ -z "$best" ] || [ "$t" -lt "$best" ]; then best=$t; fi
+        i=$((i + 1))
+    done
+    echo "$best"
+}
+
+echo "result:            $("$LISPY" "$TMP/map.lspy")"
+echo "map:               $(run "$LISPY" "$TMP/map.lspy")ms"
+for n in $SIZES; do
+    printf "pmap, %-2s threads: %sms\n" "$n" \
+        "$(LISPY_THREADS=$n run "$LISPY" "$TMP/pmap.lspy")"
+done
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Throughput and latency of lispy --serve with the prelude loaded, under
+# the given numbers of concurrent connections, against starting lispy and
+# loading the prelude for every job. Last comes a server under --isolate,
+# with a new connection, and so a clean environment, for every request.
+#
+#   $ bench/serve.sh [path to lispy] [connections] [requests each]
+#
+# Run from the root of the repository, where prelude.lspy is.
+LISPY=${1:-./lispy}
+CONNS=${2:-"1 4 16"}
+REQUESTS=${3:-1000}
+EXPR='(fib 10)'
+
+TMP=$(mktemp -d)
+cc -std=c11 -O2 -pthread bench/loadgen.c -o "$TMP/loadgen" || exit 1
+
+"$LISPY" --serve "$TMP/lispy.sock" prelude.lspy > /dev/null &
+SERVER=$!
+ISOLATED=
+trap 'kill $SERVER $ISOLATED; rm -rf "$TMP"' EXIT
+while [ ! -S "$TMP/lispy.sock" ]; do sleep 0.01; done
+
+printf '(load "prelude.lspy")\n(print %s)\n' "$EXPR" > "$TMP/job.lspy"
+RUNS=100
+start=$(date +%s%N)
+i=0
+while [ $i -lt $RUNS ]; do
+    "$LISPY" "$TMP/job.lspy" > /dev/null
+    i=$((i + 1))
+done
+echo "process per job: $(( ($(date +%s%N) - start) / RUNS / 1000 ))us each"
+
+for n in $CONNS; do
+    echo "$n connections:"
+    "$TMP/loadgen" "$TMP/lispy.sock" "$n" "$REQUESTS" "$EXPR"
+done
+
+"$LISPY" --serve "$TMP/isolated.sock" --isolate prelude.lspy > /dev/null &
+ISOLATED=$!
+while [ ! -S "$TMP/isolated.sock" ]; do sleep 0.01; done
+echo "--isolate, connection per request:"
+"$TMP/loadgen" -r "$TMP/isolated.sock" 1 "$REQUESTS" "$EXPR"
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Startup time of lispy loading the prelude from source against restoring
+# it from an image, averaged over a number of runs.
+#
+#   $ bench/startup.sh [path to lispy] [runs]
+#
+# Run from the root of the repository, where prelude.lspy is.
+LISPY=${1:-./lispy}
+RUNS=${2:-500}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+echo '(print (+ 1 2 3))' > "$TMP/script.lspy"
+{ echo '(load "prelude.lspy")'; cat "$TMP/script.lspy"; } > "$TMP/cold.lspy"
+printf '(load "prelude.lspy")\n(dump "%s")\n' "$TMP/prelude.img" > "$TMP/dump.lspy"
+"$LISPY" "$TMP/dump.lspy" || exit 1
+
+# average wall time of a run of the given command, in microseconds
+run() {
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        "$@" > /dev/null
+        i=$((i + 1))
+    done
+    echo $(( ($(date +%s%N) - start) / RUNS / 1000 ))
+}
+
+base=$(run "$LISPY" "$TMP/script.lspy")
+cold=$(run "$LISPY" "$TMP/cold.lspy")
+image=$(run "$LISPY" --image "$TMP/prelude.img" "$TMP/script.lspy")
+
+echo "runs:              $RUNS"
+echo "image size:        $(wc -c < "$TMP/prelude.img") bytes"
+echo "no prelude:        ${base}us"
+echo "prelude source:    ${cold}us"
+echo "prelude image:     ${image}us"
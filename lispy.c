@@ -1,26 +1,37 @@
 /**
  * # Build and run
- * cc -std=c99 -Wall lispy.c mpc/mpc.c -ledit -lm -o bin/lispy && ./bin/lispy
+ * cc -std=c11 -Wall -pthread lispy.c mpc/mpc.c -ledit -lm -o bin/lispy && ./bin/lispy
  */
+// for mmap, madvise and the other calls used when loading files
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+// macOS only declares ucontext for XSI, which hides its own extensions
+#ifdef __APPLE__
+#define _XOPEN_SOURCE 700
+#define _DARWIN_C_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 #include "mpc/mpc.h"
+#include "lispy.h"
 
 // readline and history are default in windows cmdline
 #ifdef _WIN32
 #include <string.h>
 
-// Declare buffer for user input of size 2048
-static char buffer[2048];
-
-// fake readline function
+// fake readline function, returning a line the caller frees or NULL at EOF
 char* readline(char* prompt) {
     fputs(prompt, stdout);
-    fgets(buffer, 2048, stdin);
-    char* cpy = malloc(strlen(buffer) + 1);
-    strcpy(cpy, buffer);
-    cpy(strlen(cpy) - 1, '\0');
-    return cpy;
+    char* line = malloc(2048);
+    if (!fgets(line, 2048, stdin)) { free(line); return NULL; }
+    line[strcspn(line, "\r\n")] = '\0';
+    return line;
 }
 
 // automatically done in windows cmdline
@@ -30,27 +41,70 @@ void add_history(char* unused) {}
 #include <editline/readline.h>
 #endif
 
+// scripts are memory mapped where possible
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// the evaluation server waits on its sockets with epoll
+#ifdef __linux__
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+// tasks switch between stacks of their own where ucontext is available
+#ifndef _WIN32
+#include <ucontext.h>
+#endif
+
 // forward declarations
 struct lval;
 struct lenv;
+struct lcode;
+struct lmemo;
+struct ltask;
+struct lchan;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lmemo lmemo;
+typedef struct ltask ltask;
+typedef struct lchan lchan;
+
+// an interpreter: its global environment, the mpc grammar it reads with
+// once --mpc asks for it, and the message of its last failed evaluation
+struct lispy_vm {
+    lenv* env;
+    mpc_parser_t* Number;
+    mpc_parser_t* Symbol;
+    mpc_parser_t* String;
+    mpc_parser_t* Comment;
+    mpc_parser_t* Sexpr;
+    mpc_parser_t* Qexpr;
+    mpc_parser_t* Expr;
+    mpc_parser_t* Lispy;
+    char* error;
+};
 
-mpc_parser_t* Number;
-mpc_parser_t* Symbol;
-mpc_parser_t* String;
-mpc_parser_t* Comment;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Qexpr;
-mpc_parser_t* Expr;
-mpc_parser_t* Lispy;
+// the interpreter evaluating on this thread
+static _Thread_local lispy_vm* lispy_cur = NULL;
+mpc_parser_t* lispy_grammar(lispy_vm* vm);
 
 /**
  * lval definitions
  */
 // lval types
 enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_STR,
-       LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+       LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_VEC, LVAL_MAP, LVAL_NODE,
+       LVAL_DBL, LVAL_BIG, LVAL_MEMO, LVAL_FUTURE, LVAL_CHAN };
+
+// type tag of lenvs, which share slab walking with lvals in the collector
+#define LENV_TYPE 0xFE
 
 char* ltype_name(int t) {
     switch (t) {
@@ -61,6 +115,12 @@ char* ltype_name(int t) {
         case LVAL_FUN:   return "Function";
         case LVAL_SEXPR: return "S-Expression";
         case LVAL_QEXPR: return "Q-Expression";
+        case LVAL_VEC:   return "Vector";
+        case LVAL_MAP:   return "Map";
+        case LVAL_DBL:   return "Float";
+        case LVAL_BIG:   return "Bignum";
+        case LVAL_FUTURE: return "Future";
+        case LVAL_CHAN:  return "Channel";
         default:         return "Unknown";
     }
 }
@@ -85,17 +145,43 @@ typedef lval*(*lbuiltin)(lenv*, lval*);
     }
 
 #define LASSERT_ARG_TYPE(func_name, args, arg_num, arg_type) \
-    if (args->cell[arg_num]->type != arg_type) { \
+    if (lval_type(args->cell[arg_num]) != arg_type) { \
         lval* err = lval_err("Function '%s' passed incorrect type for " \
                              "argument %i. Got %s, expected %s.", \
                              func_name, \
                              arg_num, \
-                             ltype_name(args->cell[arg_num]->type), \
+                             ltype_name(lval_type(args->cell[arg_num])), \
                              ltype_name(arg_type)); \
         lval_del(args); \
         return err; \
     }
 
+#define LASSERT_ARG_TYPE2(func_name, args, arg_num, type1, type2) \
+    if (lval_type(args->cell[arg_num]) != type1 && \
+        lval_type(args->cell[arg_num]) != type2) { \
+        lval* err = lval_err("Function '%s' passed incorrect type for " \
+                             "argument %i. Got %s, expected %s or %s.", \
+                             func_name, \
+                             arg_num, \
+                             ltype_name(lval_type(args->cell[arg_num])), \
+                             ltype_name(type1), \
+                             ltype_name(type2)); \
+        lval_del(args); \
+        return err; \
+    }
+
+#define LASSERT_ARG_NUMBER(func_name, args, arg_num) \
+    if (!lval_is_number(args->cell[arg_num])) { \
+        lval* err = lval_err("Function '%s' passed incorrect type for " \
+                             "argument %i. Got %s, expected %s.", \
+                             func_name, \
+                             arg_num, \
+                             ltype_name(lval_type(args->cell[arg_num])), \
+                             ltype_name(LVAL_NUM)); \
+        lval_del(args); \
+        return err; \
+    }
+
 #define LASSERT_NOT_EMPTY(func_name, args, arg_num) \
     if (args->cell[arg_num]->count == 0) { \
         lval* err = lval_err("Function '%s' passed {} for argument %i", \
@@ -104,189 +190,930 @@ typedef lval*(*lbuiltin)(lenv*, lval*);
         return err; \
     }
 
-// new lval struct. The result of an eval.
+// new lval struct. The result of an eval. Only one member of the union is
+// in use at a time, selected by type.
 struct lval {
-    int type;
+    unsigned char type;
+    unsigned char mark; // reachable during a collection
+    int refs;           // number of owners sharing this value
+
+    union {
+        // basic
+        long num;     // for numbers too wide to be a fixnum
+        double dbl;   // for floats
+        char* err;    // for error types
+        char* str;    // for strings
+
+        // bignum, for integers too wide for a long. The magnitude is in
+        // 32-bit limbs, least significant first, and the top limb is
+        // never zero
+        struct {
+            int limbs;
+            int sign;          // 1 or -1
+            uint32_t* digits;
+        };
+
+        // lambda function
+        struct {
+            lenv* env;
+            lval* formals;
+            lval* body;
+        };
+
+        // memoized function, wrapping another with a cache of its results
+        struct {
+            struct lval* fn;
+            lmemo* memo;
+        };
+
+        // future for the result of a task, or channel between tasks,
+        // shared by every copy of the handle
+        ltask* task;
+        lchan* chan;
+
+        // expression. A slice shares the cells of another list, its base,
+        // rather than having cells of its own
+        struct {
+            int count;
+            int cap;            // cells allocated, or -1 for a slice
+            struct lval** cell; // list of lvals
+            union {
+                lcode* code;       // compiled form when used as a function body
+                struct lval* base; // list a slice shares the cells of
+            };
+        };
+
+        // vector or map, a trie of nodes shared with other versions of it
+        struct {
+            int size;          // number of items or entries
+            int shift;         // bits of an index below the root of a vector
+            struct lval* root; // NULL when empty
+        };
+
+        // node of a vector or map trie
+        struct {
+            int width;          // number of kids
+            uint32_t datamap;   // hash bits of the entries held by a map node
+            uint32_t nodemap;   // hash bits of the children of a map node
+            struct lval** kids; // items, or keys and values, then child nodes
+        };
+    };
+};
 
-    // basic
-    long num;     // for numeric values
-    char* err;    // for error types
-    char* sym;    // for symbols
-    char* str;    // for strings
+/**
+ * lval immediates
+ *
+ * An lval* is either a pointer to a heap lval or a tagged immediate. Heap
+ * lvals are at least 8-byte aligned so the low bits of a real pointer are
+ * always zero, and any set low bit marks an immediate:
+ *   xx1 - fixnum, a 63-bit integer stored in the upper bits
+ *   010 - builtin function, an index into lbuiltins
+ *   100 - symbol, an index into the interned names in lsym_pages
+ *   110 - symbol resolved to a slot of the frame it is evaluated in
+ * Immediates are never allocated, so copying or deleting them is free.
+ */
+#define LVAL_TAG_MASK    7
+#define LVAL_TAG_FIXNUM  1
+#define LVAL_TAG_BUILTIN 2
+#define LVAL_TAG_SYM     4
+#define LVAL_TAG_LOCAL   6
 
-    // function
-    lbuiltin builtin;
-    lenv* env;
-    lval* formals;
-    lval* body;
+#define LVAL_FIXNUM_MAX (LONG_MAX >> 1)
+#define LVAL_FIXNUM_MIN (LONG_MIN >> 1)
 
-    // expression
-    int count;
-    struct lval** cell; // list of lvals
+static inline int lval_is_imm(lval* v) {
+    return ((uintptr_t)v & LVAL_TAG_MASK) != 0;
+}
+
+static inline int lval_is_fixnum(lval* v) {
+    return ((uintptr_t)v & LVAL_TAG_FIXNUM) != 0;
+}
+
+static inline int lval_is_builtin(lval* v) {
+    return ((uintptr_t)v & LVAL_TAG_MASK) == LVAL_TAG_BUILTIN;
+}
+
+// true for both plain and resolved symbols, which differ only in bit 1
+static inline int lval_is_sym(lval* v) {
+    return ((uintptr_t)v & 5) == LVAL_TAG_SYM;
+}
+
+static inline int lval_is_local(lval* v) {
+    return ((uintptr_t)v & LVAL_TAG_MASK) == LVAL_TAG_LOCAL;
+}
+
+static inline int lval_type(lval* v) {
+    if (lval_is_fixnum(v))  { return LVAL_NUM; }
+    if (lval_is_builtin(v)) { return LVAL_FUN; }
+    if (lval_is_sym(v))     { return LVAL_SYM; }
+    // memoized functions are called like any other
+    return v->type == LVAL_MEMO ? LVAL_FUN : v->type;
+}
+
+// value of a number, fixnum or boxed
+static inline long lval_as_num(lval* v) {
+    // arithmetic shift recovers the sign of negative fixnums
+    return lval_is_fixnum(v) ? (long)(intptr_t)v >> 1 : v->num;
+}
+
+// true for integers, whether fixnums, boxed or bignums, and floats
+static inline int lval_is_number(lval* v) {
+    int t = lval_type(v);
+    return t == LVAL_NUM || t == LVAL_DBL || t == LVAL_BIG;
+}
+
+// table of builtin functions, indexed by builtin immediates, and the
+// names they are added to the environment under. It is shared by every
+// interpreter, so entries never move once added and are only added under
+// lbuiltin_lock.
+#define LBUILTIN_MAX 512
+static lbuiltin lbuiltins[LBUILTIN_MAX];
+static char* lbuiltin_names[LBUILTIN_MAX];
+static int lbuiltin_count = 0;
+static pthread_mutex_t lbuiltin_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// function pointer of a builtin, or NULL for lambdas
+static inline lbuiltin lval_as_builtin(lval* v) {
+    return lval_is_builtin(v) ? lbuiltins[(uintptr_t)v >> 3] : NULL;
+}
+
+/**
+ * Memory allocation
+ *
+ * lvals, lenvs, cell arrays and strings are carved out of 64KB slabs, one
+ * size class (16 to 4096 bytes) per slab, and recycled through per-class
+ * free lists. lvals and lenvs get slabs of their own so the collector can
+ * walk them. Larger blocks fall back to malloc with a small header.
+ *
+ * There are two heaps. The global heap holds anything reachable from the
+ * global environment. The arena heap holds everything else created while
+ * a top-level form is evaluated, and is reset in bulk once the form is
+ * done, reclaiming anything that was never freed.
+ *
+ * Heaps, like the collector and evaluator state below, are per thread.
+ * Interpreters made on one thread share its heaps, while interpreters on
+ * different threads never touch each other's objects and need no locks.
+ */
+#define LSLAB_SIZE 65536
+#define LALLOC_MIN_SHIFT 4
+#define LALLOC_CLASSES 9
+#define LALLOC_MAX (1 << (LALLOC_MIN_SHIFT + LALLOC_CLASSES - 1))
+
+// slab kinds beyond the size classes, holding a single type of object
+#define LKIND_LVAL LALLOC_CLASSES
+#define LKIND_LENV (LALLOC_CLASSES + 1)
+#define LALLOC_KINDS (LALLOC_CLASSES + 2)
+
+// first byte of a free slot, so the collector can tell it from an object
+#define LOBJ_FREE 0xFF
+
+typedef struct lheap lheap;
+
+// header at the start of every slab, found by masking an object address
+typedef struct lslab {
+    struct lslab* next;
+    lheap* heap;
+    int cls;
+} lslab;
+
+#define LSLAB_HEADER 32
+
+// header in front of blocks too large for a slab
+typedef struct lbig {
+    struct lbig* prev;
+    struct lbig* next;
+    lheap* heap;
+    size_t size;
+} lbig;
+
+// free slot, laid out so the first byte overlaps lval and lenv type tags
+typedef struct lfree_node {
+    unsigned char type;
+    struct lfree_node* next;
+} lfree_node;
+
+struct lheap {
+    lfree_node* free[LALLOC_KINDS];
+    lslab* slabs[LALLOC_KINDS];
+    char* bump[LALLOC_KINDS];
+    char* bump_end[LALLOC_KINDS];
+    lbig* big;
+    long live;
+    long bytes;
 };
 
+// allocation counters, reported by the alloc-stats builtin
+_Thread_local struct {
+    long allocs;
+    long frees;
+    long slabs;
+    long big;
+    long resets;
+    long reclaimed;
+} lalloc_stats;
+
+static _Thread_local lheap lheap_global;
+static _Thread_local lheap lheap_arena;
+// set to &lheap_global by lalloc_init, as a thread local can not start
+// out pointing at another
+static _Thread_local lheap* lheap_cur = NULL;
+static _Thread_local int lheap_arena_depth = 0;
+// set while a task runs. Tasks allocate from the global heap only, as the
+// form owning the arena may end while they wait
+static _Thread_local int lheap_arena_off = 0;
+
+// slabs released by an arena reset, ready to be reused by either heap
+static _Thread_local lslab* lslab_pool = NULL;
+
+static int lalloc_class(size_t size) {
+    int cls = 0;
+    while (((size_t)1 << (cls + LALLOC_MIN_SHIFT)) < size) { cls++; }
+    return cls;
+}
+
+// slot size for objects of a given size, keeping 16-byte alignment
+static size_t lalloc_slot_size(size_t size) {
+    return (size + 15) & ~(size_t)15;
+}
+
+static lslab* lslab_new(lheap* h, int cls) {
+    lslab* s = lslab_pool;
+    if (s) {
+        lslab_pool = s->next;
+    } else {
+        s = aligned_alloc(LSLAB_SIZE, LSLAB_SIZE);
+        lalloc_stats.slabs++;
+    }
+    s->heap = h;
+    s->cls = cls;
+    s->next = h->slabs[cls];
+    h->slabs[cls] = s;
+    h->bump[cls] = (char*)s + LSLAB_HEADER;
+    h->bump_end[cls] = (char*)s + LSLAB_SIZE;
+    return s;
+}
+
+static void* lalloc_slot(lheap* h, int cls, size_t csize) {
+    lalloc_stats.allocs++;
+    h->live++;
+
+    // reuse a freed slot before carving a new one out of the slab
+    if (h->free[cls]) {
+        lfree_node* n = h->free[cls];
+        h->free[cls] = n->next;
+        return n;
+    }
+    if (h->bump[cls] + csize > h->bump_end[cls]) { lslab_new(h, cls); }
+    void* p = h->bump[cls];
+    h->bump[cls] += csize;
+    return p;
+}
+
+static void lfree_slot(void* p, size_t size) {
+    lslab* s = (lslab*)((uintptr_t)p & ~(uintptr_t)(LSLAB_SIZE - 1));
+    lfree_node* n = p;
+    n->type = LOBJ_FREE;
+    n->next = s->heap->free[s->cls];
+    s->heap->free[s->cls] = n;
+    s->heap->live--;
+    s->heap->bytes -= size;
+    lalloc_stats.frees++;
+}
+
+void* lalloc_in(lheap* h, size_t size) {
+    if (size == 0) { return NULL; }
+
+    if (size > LALLOC_MAX) {
+        lbig* b = malloc(sizeof(lbig) + size);
+        b->heap = h;
+        b->size = size;
+        b->prev = NULL;
+        b->next = h->big;
+        if (h->big) { h->big->prev = b; }
+        h->big = b;
+        h->live++;
+        h->bytes += size;
+        lalloc_stats.allocs++;
+        lalloc_stats.big++;
+        return b + 1;
+    }
+
+    int cls = lalloc_class(size);
+    h->bytes += size;
+    return lalloc_slot(h, cls, (size_t)1 << (cls + LALLOC_MIN_SHIFT));
+}
+
+void* lalloc(size_t size) {
+    return lalloc_in(lheap_cur, size);
+}
+
+// allocate an object of a slab kind of its own (LKIND_LVAL or LKIND_LENV)
+void* lalloc_obj(int kind, size_t size) {
+    lheap_cur->bytes += size;
+    return lalloc_slot(lheap_cur, kind, lalloc_slot_size(size));
+}
+
+void lfree_obj(void* p, size_t size) {
+    lfree_slot(p, size);
+}
+
+static lheap* lalloc_heap_of(void* p, size_t size) {
+    if (size > LALLOC_MAX) { return ((lbig*)p - 1)->heap; }
+    return ((lslab*)((uintptr_t)p & ~(uintptr_t)(LSLAB_SIZE - 1)))->heap;
+}
+
+// heap of an object from lalloc_obj, which is always in a slab
+static lheap* lalloc_obj_heap(void* p) {
+    return ((lslab*)((uintptr_t)p & ~(uintptr_t)(LSLAB_SIZE - 1)))->heap;
+}
+
+void lfree(void* p, size_t size) {
+    if (!p) { return; }
+
+    if (size > LALLOC_MAX) {
+        lbig* b = (lbig*)p - 1;
+        b->heap->live--;
+        b->heap->bytes -= size;
+        if (b->prev) { b->prev->next = b->next; } else { b->heap->big = b->next; }
+        if (b->next) { b->next->prev = b->prev; }
+        free(b);
+        lalloc_stats.frees++;
+        return;
+    }
+
+    lfree_slot(p, size);
+}
+
+// resize a block, keeping it in the heap it was allocated from
+void* lrealloc(void* p, size_t old_size, size_t new_size) {
+    if (!p) { return new_size ? lalloc(new_size) : NULL; }
+    if (new_size == 0) {
+        lfree(p, old_size);
+        return NULL;
+    }
+
+    // blocks within the same size class can stay where they are
+    if (old_size <= LALLOC_MAX && new_size <= LALLOC_MAX &&
+        lalloc_class(old_size) == lalloc_class(new_size)) {
+        lalloc_heap_of(p, old_size)->bytes += (long)new_size - (long)old_size;
+        return p;
+    }
+
+    // large blocks are resized by malloc, which can often do so in place
+    if (old_size > LALLOC_MAX && new_size > LALLOC_MAX) {
+        lbig* b = realloc((lbig*)p - 1, sizeof(lbig) + new_size);
+        if (b->prev) { b->prev->next = b; } else { b->heap->big = b; }
+        if (b->next) { b->next->prev = b; }
+        b->heap->bytes += (long)new_size - (long)old_size;
+        b->size = new_size;
+        return b + 1;
+    }
+
+    void* n = lalloc_in(lalloc_heap_of(p, old_size), new_size);
+    memcpy(n, p, old_size < new_size ? old_size : new_size);
+    lfree(p, old_size);
+    return n;
+}
+
+char* lstrdup(char* s) {
+    char* c = lalloc(strlen(s) + 1);
+    strcpy(c, s);
+    return c;
+}
+
+void lstrfree(char* s) {
+    lfree(s, strlen(s) + 1);
+}
+
+// make h the heap for new allocations, returning the previous one
+lheap* lalloc_switch(lheap* h) {
+    lheap* prev = lheap_cur;
+    lheap_cur = h;
+    return prev;
+}
+
+// start allocating from the arena until the matching lalloc_arena_end
+void lalloc_arena_begin(void) {
+    if (lheap_arena_off) { return; }
+    lheap_arena_depth++;
+    lheap_cur = &lheap_arena;
+}
+
+// leaving the outermost arena frees everything still allocated in it
+void lgc_release_arena(void);
+void lalloc_arena_end(void) {
+    if (lheap_arena_off || --lheap_arena_depth > 0) { return; }
+    lheap* h = &lheap_arena;
+
+    // leaked objects may still hold references into the global heap
+    if (h->live > 0) { lgc_release_arena(); }
+
+    for (int cls = 0; cls < LALLOC_KINDS; cls++) {
+        while (h->slabs[cls]) {
+            lslab* s = h->slabs[cls];
+            h->slabs[cls] = s->next;
+            s->next = lslab_pool;
+            lslab_pool = s;
+        }
+        h->free[cls] = NULL;
+        h->bump[cls] = h->bump_end[cls] = NULL;
+    }
+    while (h->big) {
+        lbig* b = h->big;
+        h->big = b->next;
+        free(b);
+    }
+
+    lalloc_stats.resets++;
+    lalloc_stats.reclaimed += h->live;
+    lalloc_stats.frees += h->live;
+    h->live = 0;
+    h->bytes = 0;
+    lheap_cur = &lheap_global;
+}
+
+// ready this thread's heaps for allocation
+void lalloc_init(void) {
+    if (!lheap_cur) { lheap_cur = &lheap_global; }
+}
+
+// give back every slab and block of this thread's heaps, once nothing
+// allocated from them is in use any more
+void lalloc_release(void) {
+    lheap* heaps[] = { &lheap_global, &lheap_arena };
+    for (int j = 0; j < 2; j++) {
+        lheap* h = heaps[j];
+        for (int cls = 0; cls < LALLOC_KINDS; cls++) {
+            while (h->slabs[cls]) {
+                lslab* s = h->slabs[cls];
+                h->slabs[cls] = s->next;
+                free(s);
+            }
+        }
+        while (h->big) {
+            lbig* b = h->big;
+            h->big = b->next;
+            free(b);
+        }
+        memset(h, 0, sizeof(lheap));
+    }
+    while (lslab_pool) {
+        lslab* s = lslab_pool;
+        lslab_pool = s->next;
+        free(s);
+    }
+    lheap_cur = NULL;
+}
+
+/**
+ * Symbols
+ *
+ * Symbol names are interned once in a global table, and symbols are
+ * immediates holding the index of their name. Comparing or hashing two
+ * symbols never has to look at their characters.
+ *
+ * The table is shared by every interpreter. Interning takes lsym_lock,
+ * while names are kept in pages that never move so that looking one up
+ * needs no lock.
+ *
+ * Nothing counts references to an immediate, so names are never freed.
+ * The table is bounded instead, and interning fails once it is full.
+ */
+#define LSYM_PAGE_BITS 10
+#define LSYM_PAGE_SIZE (1 << LSYM_PAGE_BITS)
+// up to 2^28 symbols. Pages of the directory are only committed once used
+#define LSYM_PAGES (1 << 18)
+static char** lsym_pages[LSYM_PAGES];
+static int lsym_count = 0;
+static pthread_mutex_t lsym_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t lsym_once = PTHREAD_ONCE_INIT;
+
+// flags kept for each symbol, by each thread for its own interpreters
+static _Thread_local unsigned char* lsym_flags = NULL;
+static _Thread_local int lsym_flags_cap = 0;
+
+// the symbol has been bound outside the global env. Lookups of any other
+// symbol can only find the global binding
+#define LSYM_SHADOWED 1
+// some function was optimized relying on the symbol's global binding
+#define LSYM_FOLDED   2
+
+// open addressing table from name to index + 1, zero marking empty slots
+static int* lsym_table = NULL;
+static int lsym_cap = 0;
+
+// symbols the evaluator checks for by identity
+static lval* lsym_rest;
+static lval* lsym_if;
+
+static unsigned long lsym_hash_str(const char* s, int len) {
+    // FNV-1a
+    unsigned long h = 2166136261UL;
+    for (int i = 0; i < len; i++) { h = (h ^ (unsigned char)s[i]) * 16777619UL; }
+    return h;
+}
+
+/*
+ * A resolved symbol also records the slot its name was given in the
+ * lambda it appears in, as (id << LSYM_SLOT_BITS + 3) | (slot << 3) | 110.
+ * It prints and compares as the plain symbol and only differs in how
+ * lval_eval looks it up.
+ */
+#define LSYM_SLOT_BITS 8
+#define LSYM_SLOT_MAX  ((1 << LSYM_SLOT_BITS) - 1)
+
+static inline int lsym_id(lval* v) {
+    if (lval_is_local(v)) { return (int)((uintptr_t)v >> (LSYM_SLOT_BITS + 3)); }
+    return (int)((uintptr_t)v >> 3);
+}
+
+static inline int lsym_slot(lval* v) {
+    return (int)(((uintptr_t)v >> 3) & LSYM_SLOT_MAX);
+}
+
+// plain symbol for v, whether or not it was resolved
+static inline lval* lsym_plain(lval* v) {
+    return (lval*)(((uintptr_t)lsym_id(v) << 3) | LVAL_TAG_SYM);
+}
+
+static inline lval* lsym_local(lval* v, int slot) {
+    return (lval*)(((uintptr_t)lsym_id(v) << (LSYM_SLOT_BITS + 3)) |
+                   ((uintptr_t)slot << 3) | LVAL_TAG_LOCAL);
+}
+
+static inline char* lsym_name_of(int id) {
+    return lsym_pages[id >> LSYM_PAGE_BITS][id & (LSYM_PAGE_SIZE - 1)];
+}
+
+static inline char* lsym_name(lval* v) {
+    return lsym_name_of(lsym_id(v));
+}
+
+// flags of symbol k, making room for them on first use
+static inline unsigned char* lsym_flags_of(lval* k) {
+    int id = lsym_id(k);
+    if (id >= lsym_flags_cap) {
+        int cap = lsym_flags_cap ? lsym_flags_cap : 256;
+        while (cap <= id) { cap *= 2; }
+        lsym_flags = realloc(lsym_flags, cap);
+        memset(lsym_flags + lsym_flags_cap, 0, cap - lsym_flags_cap);
+        lsym_flags_cap = cap;
+    }
+    return &lsym_flags[id];
+}
+
+// hash of a symbol for env tables. Multiplying by an odd constant keeps
+// the low bits of consecutive ids distinct.
+static inline unsigned long lsym_hash(lval* v) {
+    return (unsigned long)lsym_id(v) * 2654435761UL;
+}
+
+// double the table, returning 0 if out of memory
+static int lsym_grow(void) {
+    int cap = lsym_cap ? lsym_cap * 2 : 256;
+    int* table = calloc(cap, sizeof(int));
+    if (!table) { return 0; }
+    for (int id = 0; id < lsym_count; id++) {
+        char* name = lsym_name_of(id);
+        unsigned long i = lsym_hash_str(name, strlen(name)) & (cap - 1);
+        while (table[i]) { i = (i + 1) & (cap - 1); }
+        table[i] = id + 1;
+    }
+    free(lsym_table);
+    lsym_table = table;
+    lsym_cap = cap;
+    return 1;
+}
+
+// construct symbol immediate for the len characters at s, interning
+// them if they are new, or NULL if there is no room for another symbol
+lval* lval_sym_n(const char* s, int len) {
+    pthread_mutex_lock(&lsym_lock);
+    // keep the table at most half full
+    if ((lsym_count + 1) * 2 > lsym_cap && !lsym_grow()) {
+        pthread_mutex_unlock(&lsym_lock);
+        return NULL;
+    }
+
+    unsigned long i = lsym_hash_str(s, len) & (lsym_cap - 1);
+    while (lsym_table[i]) {
+        int id = lsym_table[i] - 1;
+        char* name = lsym_name_of(id);
+        if (strncmp(name, s, len) == 0 && name[len] == '\0') {
+            pthread_mutex_unlock(&lsym_lock);
+            return (lval*)(((uintptr_t)id << 3) | LVAL_TAG_SYM);
+        }
+        i = (i + 1) & (lsym_cap - 1);
+    }
+
+    int id = lsym_count;
+    char** page = id < LSYM_PAGES * LSYM_PAGE_SIZE
+        ? lsym_pages[id >> LSYM_PAGE_BITS] : NULL;
+    if (!page && id < LSYM_PAGES * LSYM_PAGE_SIZE) {
+        page = malloc(sizeof(char*) * LSYM_PAGE_SIZE);
+        lsym_pages[id >> LSYM_PAGE_BITS] = page;
+    }
+    char* name = page ? malloc(len + 1) : NULL;
+    if (!name) {
+        pthread_mutex_unlock(&lsym_lock);
+        return NULL;
+    }
+    memcpy(name, s, len);
+    name[len] = '\0';
+    page[id & (LSYM_PAGE_SIZE - 1)] = name;
+    lsym_table[i] = id + 1;
+    lsym_count++;
+    pthread_mutex_unlock(&lsym_lock);
+    return (lval*)(((uintptr_t)id << 3) | LVAL_TAG_SYM);
+}
+
+// construct symbol immediate, interning s if it is new, or NULL if there
+// is no room for another symbol
+lval* lval_sym(char* s) {
+    return lval_sym_n(s, strlen(s));
+}
+
+static void lsym_init_once(void) {
+    lsym_rest = lval_sym("&");
+    lsym_if = lval_sym("if");
+}
+
+void lsym_init(void) {
+    pthread_once(&lsym_once, lsym_init_once);
+}
+
 /**
  * lval constructor
  */
+// allocate a heap lval with a single owner
+lval* lval_new(int type) {
+    lval* v = lalloc_obj(LKIND_LVAL, sizeof(lval));
+    v->type = type;
+    v->mark = 0;
+    v->refs = 1;
+    return v;
+}
+
 // construct pointer to new number lval
 lval* lval_num(long x) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
+    // small numbers are immediates and need no allocation
+    if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX) {
+        return (lval*)(((uintptr_t)x << 1) | LVAL_TAG_FIXNUM);
+    }
+    lval* v = lval_new(LVAL_NUM);
     v->num = x;
     return v;
 }
 // construct pointer to new error lval
 lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
+    lval* v = lval_new(LVAL_ERR);
 
     // create a va_list and initialize it
     va_list va;
     va_start(va, fmt);
 
-    // allocate 512 bytes of space (hopefully the error message is shorter!)
-    v->err = malloc(512);
-
     // printf the error string with a maximum of 511 characters
-    vsnprintf(v->err, 511, fmt, va);
-    v->err = realloc(v->err, strlen(v->err) + 1); // realloc to actual length
+    char buf[512];
+    vsnprintf(buf, 511, fmt, va);
+    v->err = lstrdup(buf); // copy at actual length
 
     // cleanup the va list
     va_end(va);
 
     return v;
 }
-// construct pointer to new symbol lval
-lval* lval_sym(char* s) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
-    return v;
-}
 // construct pointer to new string lval
 lval* lval_str(char* s) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_STR;
-    v->str = malloc(strlen(s) + 1);
-    strcpy(v->str, s);
+    lval* v = lval_new(LVAL_STR);
+    v->str = lstrdup(s);
     return v;
 }
-// construct pointer to new function lval
+// construct builtin function immediate, registering func under name if it
+// is new. A NULL name leaves the name it has.
+lval* lval_fun_named(lbuiltin func, char* name) {
+    pthread_mutex_lock(&lbuiltin_lock);
+    int i = 0;
+    while (i < lbuiltin_count && lbuiltins[i] != func) { i++; }
+    if (i == lbuiltin_count) {
+        if (i == LBUILTIN_MAX) {
+            fputs("Too many builtins!\n", stderr);
+            abort();
+        }
+        lbuiltins[i] = func;
+        lbuiltin_names[i] = NULL;
+        lbuiltin_count++;
+    }
+    if (name) { lbuiltin_names[i] = name; }
+    pthread_mutex_unlock(&lbuiltin_lock);
+    return (lval*)(((uintptr_t)i << 3) | LVAL_TAG_BUILTIN);
+}
+
+// construct builtin function immediate, registering func if it is new
 lval* lval_fun(lbuiltin func) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
-    v->builtin = func;
-    return v;
+    return lval_fun_named(func, NULL);
 }
 // construct pointer to new lambda function lval
 lenv* lenv_new(void);
+lenv* lenv_frame(int n);
 lval* lval_lambda(lval* formals, lval* body) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+    lval* v = lval_new(LVAL_FUN);
 
-    v->builtin = NULL;
-    v->env = lenv_new();
+    // each formal gets a slot, apart from '&'
+    v->env = lenv_frame(formals->count);
     v->formals = formals;
     v->body = body;
     return v;
 }
 // construct pointer to new sexpression lval
 lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
+    lval* v = lval_new(LVAL_SEXPR);
     v->count = 0;
+    v->cap = 0;
     v->cell = NULL;
+    v->code = NULL;
     return v;
 }
 // construct pointer to new qexpression lval
 lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_QEXPR;
+    lval* v = lval_new(LVAL_QEXPR);
     v->count = 0;
+    v->cap = 0;
     v->cell = NULL;
+    v->code = NULL;
+    return v;
+}
+// construct pointer to new qexpression lval of n items, each zero until
+// it is filled in
+lval* lval_qexpr_n(int n) {
+    lval* v = lval_qexpr();
+    v->count = n;
+    v->cap = n;
+    v->cell = lalloc(sizeof(lval*) * n);
+    for (int i = 0; i < n; i++) { v->cell[i] = lval_num(0); }
     return v;
 }
 
+static inline int lval_is_slice(lval* v) {
+    return (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->cap < 0;
+}
+
+// construct pointer to new qexpression lval of the n items of list v from
+// i. It is a slice sharing v's cells, so takes no time to make
+lval* lval_ref(lval* v);
+lval* lval_slice(lval* v, int i, int n) {
+    if (n == 0) { return lval_qexpr(); }
+    lval* x = lval_new(LVAL_QEXPR);
+    x->count = n;
+    x->cap = -1;
+    x->cell = v->cell + i;
+    x->base = lval_ref(lval_is_slice(v) ? v->base : v);
+    return x;
+}
+
 /**
  * lval utility
  */
 void lenv_del(lenv* e);
+void lcode_del(lcode* c);
+void lmemo_del(lmemo* m);
+void ltask_unref(ltask* t);
+void lchan_unref(lchan* c);
+// release a reference to v, freeing it once the last owner is gone
 void lval_del(lval* v) {
+    // immediates own no memory
+    if (lval_is_imm(v) || --v->refs > 0) { return; }
+
     switch(v->type) {
         // do nothing special for num
         case LVAL_NUM: break;
 
         // free string data for error or sym
-        case LVAL_ERR: free(v->err); break;
-        case LVAL_SYM: free(v->sym); break;
-        case LVAL_STR: free(v->str); break;
+        case LVAL_ERR: lstrfree(v->err); break;
+        case LVAL_STR: lstrfree(v->str); break;
+        case LVAL_BIG: lfree(v->digits, sizeof(uint32_t) * v->limbs); break;
 
-        // free env and data if not builtin
+        // free env and data, builtins are always immediates
         case LVAL_FUN:
-            if (!v->builtin) {
-                lenv_del(v->env);
-                lval_del(v->formals);
-                lval_del(v->body);
-            }
+            lenv_del(v->env);
+            lval_del(v->formals);
+            lval_del(v->body);
             break;
+        case LVAL_MEMO:
+            lval_del(v->fn);
+            lmemo_del(v->memo);
+            break;
+        case LVAL_FUTURE: ltask_unref(v->task); break;
+        case LVAL_CHAN:   lchan_unref(v->chan); break;
 
         // recursively free all elements inside sexpr/qexpr
         case LVAL_SEXPR:
         case LVAL_QEXPR:
+           // the elements of a slice belong to its base
+           if (lval_is_slice(v)) {
+               lval_del(v->base);
+               break;
+           }
            for (int i = 0; i < v->count; i++) {
                lval_del(v->cell[i]);
            }
            // also free memory for pointers
-           free(v->cell);
+           lfree(v->cell, sizeof(lval*) * v->cap);
+           lcode_del(v->code);
+           break;
+
+        // free the trie, whose nodes may be shared with other versions
+        case LVAL_VEC:
+        case LVAL_MAP:
+           if (v->root) { lval_del(v->root); }
+           break;
+        case LVAL_NODE:
+           for (int i = 0; i < v->width; i++) {
+               lval_del(v->kids[i]);
+           }
+           lfree(v->kids, sizeof(lval*) * v->width);
            break;
     }
     // free memory for lval struct itself
-    free(v);
+    lfree_obj(v, sizeof(lval));
+}
+
+// take another reference to v, sharing it instead of copying
+lval* lval_ref(lval* v) {
+    if (!lval_is_imm(v)) { v->refs++; }
+    return v;
 }
 
+// copy the top node of v. Elements, formals and bodies are shared.
 lenv* lenv_copy(lenv* e);
+lmemo* lmemo_copy(lmemo* m);
+ltask* ltask_ref(ltask* t);
+lchan* lchan_ref(lchan* c);
 lval* lval_copy(lval* v) {
-    lval* x = malloc(sizeof(lval));
-    x->type = v->type;
+    // immediates are copied by value
+    if (lval_is_imm(v)) { return v; }
+
+    lval* x = lval_new(v->type);
 
     switch(v->type) {
-        // copy numbers and functions directly
+        // copy boxed numbers directly
         case LVAL_NUM:
             x->num = v->num;
             break;
-        case LVAL_FUN:
-            if (v->builtin) {
-                x->builtin = v->builtin;
-            } else {
-                x->builtin = NULL;
-                x->env = lenv_copy(v->env);
-                x->formals = lval_copy(v->formals);
-                x->body = lval_copy(v->body);
-            }
+        case LVAL_DBL:
+            x->dbl = v->dbl;
             break;
-
-        // copy strings for err, sym, and str
-        case LVAL_ERR:
-            x->err = malloc(strlen(v->err) + 1);
-            strcpy(x->err, v->err);
+        case LVAL_BIG:
+            x->limbs = v->limbs;
+            x->sign = v->sign;
+            x->digits = lalloc(sizeof(uint32_t) * v->limbs);
+            memcpy(x->digits, v->digits, sizeof(uint32_t) * v->limbs);
             break;
-        case LVAL_SYM:
-            x->sym = malloc(strlen(v->sym) + 1);
-            strcpy(x->sym, v->sym);
+        case LVAL_FUN:
+            x->env = lenv_copy(v->env);
+            x->formals = lval_ref(v->formals);
+            x->body = lval_ref(v->body);
             break;
-        case LVAL_STR:
-            x->str = malloc(strlen(v->str) + 1);
-            strcpy(x->str, v->str);
+        // a memoized function's cache is copied along with it
+        case LVAL_MEMO:
+            x->fn = lval_ref(v->fn);
+            x->memo = lmemo_copy(v->memo);
             break;
+        // a copy of a handle refers to the same task or channel
+        case LVAL_FUTURE: x->task = ltask_ref(v->task); break;
+        case LVAL_CHAN:   x->chan = lchan_ref(v->chan); break;
+
+        // copy strings for err, sym, and str
+        case LVAL_ERR: x->err = lstrdup(v->err); break;
+        case LVAL_STR: x->str = lstrdup(v->str); break;
 
-        // copy lists by recursively copying each sub expression
+        // copy lists by sharing each sub expression. The copy of a slice
+        // has cells of its own
         case LVAL_SEXPR:
         case LVAL_QEXPR:
             x->count = v->count;
-            x->cell = malloc(sizeof(lval*) * v->count);
+            x->cap = v->count;
+            x->cell = lalloc(sizeof(lval*) * v->count);
             for (int i = 0; i < v->count; i++) {
-                x->cell[i] = lval_copy(v->cell[i]);
+                x->cell[i] = lval_ref(v->cell[i]);
+            }
+            x->code = NULL;
+            break;
+
+        // copy vectors and maps by sharing their trie, and nodes by
+        // sharing each kid
+        case LVAL_VEC:
+        case LVAL_MAP:
+            x->size = v->size;
+            x->shift = v->shift;
+            x->root = v->root ? lval_ref(v->root) : NULL;
+            break;
+        case LVAL_NODE:
+            x->width = v->width;
+            x->datamap = v->datamap;
+            x->nodemap = v->nodemap;
+            x->kids = lalloc(sizeof(lval*) * v->width);
+            for (int i = 0; i < v->width; i++) {
+                x->kids[i] = lval_ref(v->kids[i]);
             }
             break;
     }
@@ -294,97 +1121,217 @@ lval* lval_copy(lval* v) {
     return x;
 }
 
-void lval_print_str(lval* v) {
+// get sole ownership of v before changing it, copying it if it is shared.
+// Slices are copied too, as their cells are shared with the base
+lval* lval_own(lval* v) {
+    if (lval_is_imm(v)) { return v; }
+    if (v->refs == 1 && !lval_is_slice(v)) {
+        // compiled code refers into the list, so is out of date once the
+        // list changes
+        if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->code) {
+            lcode_del(v->code);
+            v->code = NULL;
+        }
+        return v;
+    }
+    lval* x = lval_copy(v);
+    lval_del(v);
+    return x;
+}
+
+// make v safe to store in heap h, replacing any part of it allocated
+// elsewhere with an equal copy allocated in h
+void lenv_promote(lenv* e, lheap* h);
+void lmemo_promote(lmemo* m, lheap* h);
+lval* lval_promote(lval* v, lheap* h) {
+    if (lval_is_imm(v)) { return v; }
+
+    // tries are never changed once made, so a node already in h can only
+    // hold nodes and values that were promoted along with it
+    if ((v->type == LVAL_VEC || v->type == LVAL_MAP ||
+         v->type == LVAL_NODE) && lalloc_obj_heap(v) == h) {
+        return v;
+    }
+
+    // slices are replaced with a copy too, rather than promoting their base
+    if (lalloc_obj_heap(v) != h || lval_is_slice(v)) {
+        lheap* prev = lalloc_switch(h);
+        lval* x = lval_copy(v);
+        lalloc_switch(prev);
+        lval_del(v);
+        v = x;
+    }
+
+    // swapping a part for an equal copy is invisible to other owners
+    switch (v->type) {
+        case LVAL_FUN:
+            lenv_promote(v->env, h);
+            v->formals = lval_promote(v->formals, h);
+            v->body = lval_promote(v->body, h);
+            break;
+        case LVAL_MEMO:
+            v->fn = lval_promote(v->fn, h);
+            lmemo_promote(v->memo, h);
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            // parts may be swapped for copies, which compiled code would
+            // not see
+            lcode_del(v->code);
+            v->code = NULL;
+            if (v->cap &&
+                lalloc_heap_of(v->cell, sizeof(lval*) * v->cap) != h) {
+                lval** cell = lalloc_in(h, sizeof(lval*) * v->cap);
+                memcpy(cell, v->cell, sizeof(lval*) * v->count);
+                lfree(v->cell, sizeof(lval*) * v->cap);
+                v->cell = cell;
+            }
+            for (int i = 0; i < v->count; i++) {
+                v->cell[i] = lval_promote(v->cell[i], h);
+            }
+            break;
+        case LVAL_VEC:
+        case LVAL_MAP:
+            if (v->root) { v->root = lval_promote(v->root, h); }
+            break;
+        case LVAL_NODE:
+            for (int i = 0; i < v->width; i++) {
+                v->kids[i] = lval_promote(v->kids[i], h);
+            }
+            break;
+    }
+    return v;
+}
+
+void lval_print_str(FILE* f, lval* v) {
     // make copy of string
     char* escaped = malloc(strlen(v->str) + 1);
     strcpy(escaped, v->str);
     // pass it through the escape function
     escaped = mpcf_escape(escaped);
-    printf("\"%s\"", escaped);
+    fprintf(f, "\"%s\"", escaped);
     free(escaped);
 }
 
-void lval_print(lval* v); // used in lval_expr_print
-void lval_expr_print(lval* v, char open, char close) {
-    putchar(open);
+void lval_fprint(FILE* f, lval* v); // used in lval_expr_print
+void lval_expr_print(FILE* f, lval* v, char open, char close) {
+    putc(open, f);
     for (int i = 0; i < v->count; i++) {
         // print value in cell
-        lval_print(v->cell[i]);
+        lval_fprint(f, v->cell[i]);
         if (i < v->count - 1) {
-            putchar(' ');
+            putc(' ', f);
         }
     }
-    putchar(close);
+    putc(close, f);
 }
 
-void lval_print(lval* v) {
-    switch(v->type) {
-        case LVAL_NUM:   printf("%li", v->num);         break;
-        case LVAL_ERR:   printf("Error: %s\n", v->err); break;
-        case LVAL_SYM:   printf("%s", v->sym);          break;
-        case LVAL_STR:   lval_print_str(v);             break;
+void lvector_print(FILE* f, lval* v);
+void lmap_print(FILE* f, lval* v);
+void lval_print_float(FILE* f, double x);
+void lbig_print(FILE* f, lval* v);
+void lval_fprint(FILE* f, lval* v) {
+    switch(lval_type(v)) {
+        case LVAL_NUM:   fprintf(f, "%li", lval_as_num(v)); break;
+        case LVAL_DBL:   lval_print_float(f, v->dbl);       break;
+        case LVAL_BIG:   lbig_print(f, v);                  break;
+        case LVAL_ERR:   fprintf(f, "Error: %s\n", v->err); break;
+        case LVAL_SYM:   fputs(lsym_name(v), f);            break;
+        case LVAL_STR:   lval_print_str(f, v);              break;
         case LVAL_FUN:
-                         if (v->builtin) {
-                             printf("<builtin>");
+                         if (lval_is_builtin(v)) {
+                             fputs("<builtin>", f);
+                         } else if (v->type == LVAL_MEMO) {
+                             fputs("<memo ", f); lval_fprint(f, v->fn);
+                             putc('>', f);
                          } else {
-                             printf("\\"); lval_print(v->formals);
-                             putchar(' '); lval_print(v->body); putchar(')');
+                             fputs("\\", f); lval_fprint(f, v->formals);
+                             putc(' ', f); lval_fprint(f, v->body);
+                             putc(')', f);
                          }
                          break;
-        case LVAL_SEXPR: lval_expr_print(v, '(', ')');  break;
-        case LVAL_QEXPR: lval_expr_print(v, '{', '}');  break;
+        case LVAL_SEXPR: lval_expr_print(f, v, '(', ')');   break;
+        case LVAL_QEXPR: lval_expr_print(f, v, '{', '}');   break;
+        case LVAL_VEC:   lvector_print(f, v);               break;
+        case LVAL_MAP:   lmap_print(f, v);                  break;
+        case LVAL_FUTURE: fputs("<future>", f);             break;
+        case LVAL_CHAN:  fputs("<channel>", f);             break;
     }
 }
 
+void lval_print(lval* v) {
+    lval_fprint(stdout, v);
+}
+
 void lval_println(lval* v) {
     lval_print(v);
     putchar('\n');
 }
 
+// make room in list v for at least n cells, growing it geometrically so
+// that adding items one at a time takes amortized constant time
+void lval_reserve(lval* v, int n) {
+    if (n <= v->cap) { return; }
+    int cap = v->cap ? v->cap : 4;
+    while (cap < n) { cap *= 2; }
+    v->cell = lrealloc(v->cell, sizeof(lval*) * v->cap, sizeof(lval*) * cap);
+    v->cap = cap;
+}
+
 lval* lval_add(lval* v, lval* x) {
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    v->cell[v->count - 1] = x;
+    if (v->count == v->cap) { lval_reserve(v, v->count + 1); }
+    v->cell[v->count++] = x;
     return v;
 }
 
+// remove item i from v, which must not be shared
 lval* lval_pop(lval* v, int i) {
     // find item at i (Note: v->cell is array of pointers to lvals)
     lval* x = v->cell[i];
 
-    // shift memory after item "i" back
+    // shift memory after item "i" back, keeping the room for later adds
     memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
     v->count--;
 
-    // reallocate memory used
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-
     return x;
 }
 
 lval* lval_take(lval* v, int i) {
-    lval* x = lval_pop(v, i);
+    lval* x = lval_ref(v->cell[i]);
     lval_del(v);
     return x;
 }
 
+int lvector_eq(lval* x, lval* y);
+int lmap_eq(lval* x, lval* y);
+int lenv_eq(lenv* x, lenv* y);
 int lval_eq(lval* x, lval* y) {
-    if (x->type != y-> type) { return 0; }
+    if (lval_type(x) != lval_type(y)) { return 0; }
 
     // compare based on type
-    switch(x->type) {
-        case LVAL_NUM: return (x->num == y->num);
+    switch(lval_type(x)) {
+        case LVAL_NUM: return (lval_as_num(x) == lval_as_num(y));
+        case LVAL_DBL: return (x->dbl == y->dbl);
+        case LVAL_BIG:
+            return x->sign == y->sign && x->limbs == y->limbs &&
+                   memcmp(x->digits, y->digits,
+                          sizeof(uint32_t) * x->limbs) == 0;
         case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-        case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
+        case LVAL_SYM: return (lsym_id(x) == lsym_id(y));
         case LVAL_STR: return (strcmp(x->str, y->str) == 0);
-        // if builtin then compare, otherwise compare formals and body
+        // if builtin then compare, otherwise compare formals, body and the
+        // arguments already bound by partial application
         case LVAL_FUN:
-            if (x->builtin || y->builtin) {
-                return (x->builtin == y->builtin);
+            if (lval_is_builtin(x) || lval_is_builtin(y)) {
+                return (x == y);
+            } else if (x->type == LVAL_MEMO || y->type == LVAL_MEMO) {
+                // memos of equal functions give the same results
+                return x->type == y->type && lval_eq(x->fn, y->fn);
             } else {
                 return (
                     lval_eq(x->formals, y->formals) &&
-                    lval_eq(x->body, y->body)
+                    lval_eq(x->body, y->body) &&
+                    lenv_eq(x->env, y->env)
                 );
             }
         // lists should compare every element
@@ -396,35 +1343,878 @@ int lval_eq(lval* x, lval* y) {
             }
             return 1;
         break;
+        case LVAL_VEC: return lvector_eq(x, y);
+        case LVAL_MAP: return lmap_eq(x, y);
+        // handles are equal when they refer to the same task or channel
+        case LVAL_FUTURE: return x->task == y->task;
+        case LVAL_CHAN: return x->chan == y->chan;
     }
     return 0;
 }
 
 /**
- * Read lvals
+ * Vectors and maps
+ *
+ * Vectors and maps are persistent. Changing one makes a new version that
+ * shares all but the path to the change with the old, which is left as it
+ * was. Both are tries of nodes up to 32 wide, so lookups and updates take
+ * O(log32 n) steps.
+ *
+ * A vector is a radix trie, where item i is found by taking 5 bits of i
+ * at a time from the top. Only the rightmost path of nodes may be short.
+ *
+ * A map is a hash array mapped trie, taking 5 bits of a key's hash at a
+ * time from the bottom. Each node has a bitmap of the entries held in it
+ * and another of its child nodes, and keeps the keys and values of its
+ * entries ahead of the children in kids. Removing an entry folds a child
+ * left with just one back into its parent, so equal maps have the same
+ * shape. Once all of a hash is used, keys with equal hashes share a
+ * collision node which is searched in order.
+ *
+ * Nodes are lvals themselves, so are shared by counting references and
+ * the collector walks them like any other value.
  */
-lval* lval_read_num(mpc_ast_t* t) {
-    errno = 0;
-    long x = strtol(t->contents, NULL, 10);
-    return errno != ERANGE
-        ? lval_num(x)
-        : lval_err("Invalid number '%s'.", t->contents);
-}
+#define LTRIE_BITS  5
+#define LTRIE_WIDTH (1 << LTRIE_BITS)
+#define LTRIE_MASK  (LTRIE_WIDTH - 1)
 
-lval* lval_read_str(mpc_ast_t* t) {
-    // cut off the final quote character
-    t->contents[strlen(t->contents) - 1] = '\0';
-    // copy string removing first quote character
-    char* unescaped = malloc(strlen(t->contents + 1) + 1);
-    strcpy(unescaped, t->contents + 1);
-    // pass through unescape function
-    unescaped = mpcf_unescape(unescaped);
-    lval* str = lval_str(unescaped);
-    free(unescaped);
-    return str;
-}
+// map nodes this deep have used up the hash, and are collision nodes
+#define LTRIE_HASH_BITS 32
 
-lval* lval_read(mpc_ast_t* t) {
+// number of set bits in x
+static inline int lbits(uint32_t x) {
+#ifdef __GNUC__
+    return __builtin_popcount(x);
+#else
+    int n = 0;
+    while (x) { x &= x - 1; n++; }
+    return n;
+#endif
+}
+
+// mix the bits of x so that each bit of the result depends on all of them
+static inline uint32_t lhash_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return (uint32_t)x;
+}
+
+// construct pointer to new empty vector lval
+lval* lval_vec(void) {
+    lval* v = lval_new(LVAL_VEC);
+    v->size = 0;
+    v->shift = 0;
+    v->root = NULL;
+    return v;
+}
+// construct pointer to new empty map lval
+lval* lval_map(void) {
+    lval* v = lval_new(LVAL_MAP);
+    v->size = 0;
+    v->shift = 0;
+    v->root = NULL;
+    return v;
+}
+
+// construct trie node with the kids of n, except that the del kids at at
+// are replaced by ins kids, each zero until filled in. n may be NULL
+static lval* lnode_splice(lval* n, int at, int del, int ins) {
+    int width = n ? n->width : 0;
+    lval* x = lval_new(LVAL_NODE);
+    x->width = width - del + ins;
+    x->datamap = n ? n->datamap : 0;
+    x->nodemap = n ? n->nodemap : 0;
+    x->kids = lalloc(sizeof(lval*) * x->width);
+    for (int i = 0; i < at; i++) {
+        x->kids[i] = lval_ref(n->kids[i]);
+    }
+    for (int i = 0; i < ins; i++) {
+        x->kids[at + i] = lval_num(0);
+    }
+    for (int i = at + del; i < width; i++) {
+        x->kids[i - del + ins] = lval_ref(n->kids[i]);
+    }
+    return x;
+}
+
+// call fn with each key and value under map node n at shift, stopping
+// early and returning 0 as soon as fn does
+static int lnode_each(lval* n, int shift,
+                      int (*fn)(lval*, lval*, void*), void* ctx) {
+    int pairs = shift >= LTRIE_HASH_BITS ? n->width / 2 : lbits(n->datamap);
+    for (int i = 0; i < pairs; i++) {
+        if (!fn(n->kids[i * 2], n->kids[i * 2 + 1], ctx)) { return 0; }
+    }
+    for (int i = pairs * 2; i < n->width; i++) {
+        if (!lnode_each(n->kids[i], shift + LTRIE_BITS, fn, ctx)) { return 0; }
+    }
+    return 1;
+}
+
+// item i of vector v, which must be in range
+lval* lvector_nth(lval* v, int i) {
+    lval* n = v->root;
+    for (int shift = v->shift; shift > 0; shift -= LTRIE_BITS) {
+        n = n->kids[(i >> shift) & LTRIE_MASK];
+    }
+    return n->kids[i & LTRIE_MASK];
+}
+
+// copy of the path to item i under vector node n at shift, with x in
+// place of the item. i may be one past the end, in which case n may be
+// NULL for a path that is not there yet. Takes ownership of x
+static lval* lnode_set(lval* n, int shift, int i, lval* x) {
+    int j = (i >> shift) & LTRIE_MASK;
+    int has = n && j < n->width;
+    lval* y = has ? lnode_splice(n, 0, 0, 0)
+                  : lnode_splice(n, n ? n->width : 0, 0, 1);
+    lval_del(y->kids[j]);
+    y->kids[j] = shift == 0 ? x : lnode_set(has ? n->kids[j] : NULL,
+                                            shift - LTRIE_BITS, i, x);
+    return y;
+}
+
+// vector v with item i set to x, or with x added to the end when i is
+// the size of v. Takes ownership of x
+lval* lvector_assoc(lval* v, int i, lval* x) {
+    lval* r = lval_vec();
+    r->size = v->size + (i == v->size);
+    r->shift = v->shift;
+    if (!v->root) {
+        r->root = lnode_set(NULL, 0, i, x);
+    } else if (i == v->size && v->size == (long)LTRIE_WIDTH << v->shift) {
+        // the trie is full, so grows a level with the old one on its left
+        lval* top = lnode_splice(NULL, 0, 0, 1);
+        top->kids[0] = lval_ref(v->root);
+        r->shift += LTRIE_BITS;
+        r->root = lnode_set(top, r->shift, i, x);
+        lval_del(top);
+    } else {
+        r->root = lnode_set(v->root, v->shift, i, x);
+    }
+    return r;
+}
+
+// construct vector of the n items at items, building the trie a level at
+// a time rather than a path at a time
+lval* lvector_from(lval** items, int n) {
+    lval* v = lval_vec();
+    if (n == 0) { return v; }
+
+    // each level's nodes are kept in place of the level below
+    int count = (n + LTRIE_MASK) >> LTRIE_BITS;
+    lval** level = malloc(sizeof(lval*) * count);
+    for (int i = 0; i < count; i++) {
+        int w = n - i * LTRIE_WIDTH < LTRIE_WIDTH ? n - i * LTRIE_WIDTH : LTRIE_WIDTH;
+        level[i] = lnode_splice(NULL, 0, 0, w);
+        for (int j = 0; j < w; j++) {
+            level[i]->kids[j] = lval_ref(items[i * LTRIE_WIDTH + j]);
+        }
+    }
+    while (count > 1) {
+        int up = (count + LTRIE_MASK) >> LTRIE_BITS;
+        for (int i = 0; i < up; i++) {
+            int w = count - i * LTRIE_WIDTH < LTRIE_WIDTH
+                ? count - i * LTRIE_WIDTH : LTRIE_WIDTH;
+            lval* node = lnode_splice(NULL, 0, 0, w);
+            for (int j = 0; j < w; j++) {
+                node->kids[j] = level[i * LTRIE_WIDTH + j];
+            }
+            level[i] = node;
+        }
+        count = up;
+        v->shift += LTRIE_BITS;
+    }
+    v->size = n;
+    v->root = level[0];
+    free(level);
+    return v;
+}
+
+int lvector_eq(lval* x, lval* y) {
+    if (x->size != y->size) { return 0; }
+    for (int i = 0; i < x->size; i++) {
+        if (!lval_eq(lvector_nth(x, i), lvector_nth(y, i))) { return 0; }
+    }
+    return 1;
+}
+
+void lvector_print(FILE* f, lval* v) {
+    putc('[', f);
+    for (int i = 0; i < v->size; i++) {
+        if (i) { putc(' ', f); }
+        lval_fprint(f, lvector_nth(v, i));
+    }
+    putc(']', f);
+}
+
+static int lmap_hash_entry(lval* k, lval* x, void* h);
+uint32_t lenv_hash(lenv* e);
+
+// hash of v, equal for values that are lval_eq
+uint32_t lval_hash(lval* v) {
+    uint64_t h = lval_type(v);
+    switch (lval_type(v)) {
+        case LVAL_NUM: h = (uint64_t)lval_as_num(v); break;
+        // 0.0 and -0.0 are equal but differ in their bits
+        case LVAL_DBL: if (v->dbl != 0) { memcpy(&h, &v->dbl, sizeof(h)); } break;
+        case LVAL_BIG:
+            for (int i = 0; i < v->limbs; i++) { h = h * 31 + v->digits[i]; }
+            h = h * 31 + (v->sign < 0);
+            break;
+        case LVAL_SYM: h = lsym_hash(v); break;
+        case LVAL_ERR: h = lsym_hash_str(v->err, strlen(v->err)); break;
+        case LVAL_STR: h = lsym_hash_str(v->str, strlen(v->str)); break;
+        case LVAL_FUN:
+            if (lval_is_builtin(v)) {
+                h = (uintptr_t)v;
+            } else if (v->type == LVAL_MEMO) {
+                h = lval_hash(v->fn) * 31 + LVAL_MEMO;
+            } else {
+                h = lval_hash(v->formals) * 31 + lval_hash(v->body);
+                h = h * 31 + lenv_hash(v->env);
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count; i++) {
+                h = h * 31 + lval_hash(v->cell[i]);
+            }
+            break;
+        case LVAL_VEC:
+            for (int i = 0; i < v->size; i++) {
+                h = h * 31 + lval_hash(lvector_nth(v, i));
+            }
+            break;
+        // entries are summed, as collision nodes keep them in the order
+        // they were added
+        case LVAL_MAP:
+            if (v->root) { lnode_each(v->root, 0, lmap_hash_entry, &h); }
+            break;
+        case LVAL_FUTURE: h = (uintptr_t)v->task; break;
+        case LVAL_CHAN:   h = (uintptr_t)v->chan; break;
+    }
+    return lhash_mix(h);
+}
+
+static int lmap_hash_entry(lval* k, lval* x, void* h) {
+    *(uint64_t*)h += lhash_mix(((uint64_t)lval_hash(k) << 32) | lval_hash(x));
+    return 1;
+}
+
+// value of key k in map m, or NULL if it has none
+lval* lmap_get(lval* m, lval* k) {
+    uint32_t h = lval_hash(k);
+    lval* n = m->root;
+    for (int shift = 0; n; shift += LTRIE_BITS) {
+        if (shift >= LTRIE_HASH_BITS) {
+            for (int i = 0; i < n->width; i += 2) {
+                if (lval_eq(n->kids[i], k)) { return n->kids[i + 1]; }
+            }
+            return NULL;
+        }
+        uint32_t bit = 1u << ((h >> shift) & LTRIE_MASK);
+        if (n->datamap & bit) {
+            int i = lbits(n->datamap & (bit - 1)) * 2;
+            return lval_eq(n->kids[i], k) ? n->kids[i + 1] : NULL;
+        }
+        if (!(n->nodemap & bit)) { return NULL; }
+        n = n->kids[lbits(n->datamap) * 2 + lbits(n->nodemap & (bit - 1))];
+    }
+    return NULL;
+}
+
+// construct map node at shift holding the entries k1 x1 and k2 x2, whose
+// keys hash to h1 and h2. Takes ownership of the keys and values
+static lval* lnode_pair(int shift, lval* k1, lval* x1, uint32_t h1,
+                        lval* k2, lval* x2, uint32_t h2) {
+    if (shift >= LTRIE_HASH_BITS) {
+        lval* n = lnode_splice(NULL, 0, 0, 4);
+        n->kids[0] = k1; n->kids[1] = x1;
+        n->kids[2] = k2; n->kids[3] = x2;
+        return n;
+    }
+    uint32_t b1 = (h1 >> shift) & LTRIE_MASK;
+    uint32_t b2 = (h2 >> shift) & LTRIE_MASK;
+    if (b1 == b2) {
+        lval* n = lnode_splice(NULL, 0, 0, 1);
+        n->nodemap = 1u << b1;
+        n->kids[0] = lnode_pair(shift + LTRIE_BITS, k1, x1, h1, k2, x2, h2);
+        return n;
+    }
+    // entries are kept in the order of their bits
+    lval* n = lnode_splice(NULL, 0, 0, 4);
+    n->datamap = (1u << b1) | (1u << b2);
+    int i = b1 < b2 ? 0 : 2;
+    n->kids[i] = k1; n->kids[i + 1] = x1;
+    n->kids[2 - i] = k2; n->kids[3 - i] = x2;
+    return n;
+}
+
+// copy of the path to key k, which hashes to h, under map node n at
+// shift, with k mapped to x. Sets *added if k is new. Takes ownership of
+// k and x
+static lval* lnode_put(lval* n, int shift, uint32_t h, lval* k, lval* x,
+                       int* added) {
+    if (shift >= LTRIE_HASH_BITS) {
+        for (int i = 0; i < n->width; i += 2) {
+            if (lval_eq(n->kids[i], k)) {
+                lval* y = lnode_splice(n, i + 1, 1, 1);
+                y->kids[i + 1] = x;
+                lval_del(k);
+                return y;
+            }
+        }
+        lval* y = lnode_splice(n, n->width, 0, 2);
+        y->kids[n->width] = k;
+        y->kids[n->width + 1] = x;
+        *added = 1;
+        return y;
+    }
+
+    uint32_t bit = 1u << ((h >> shift) & LTRIE_MASK);
+    int pairs = lbits(n->datamap);
+    int i = lbits(n->datamap & (bit - 1)) * 2;
+    int j = pairs * 2 + lbits(n->nodemap & (bit - 1));
+    lval* y;
+    if (n->datamap & bit) {
+        if (lval_eq(n->kids[i], k)) {
+            y = lnode_splice(n, i + 1, 1, 1);
+            y->kids[i + 1] = x;
+            lval_del(k);
+            return y;
+        }
+        // two keys share these bits of their hashes, so move both into a
+        // child node, which goes where the entry leaves a gap
+        lval* kid = lnode_pair(shift + LTRIE_BITS,
+                               lval_ref(n->kids[i]), lval_ref(n->kids[i + 1]),
+                               lval_hash(n->kids[i]), k, x, h);
+        lval* z = lnode_splice(n, i, 2, 0);
+        y = lnode_splice(z, j - 2, 0, 1);
+        lval_del(z);
+        y->kids[j - 2] = kid;
+        y->datamap ^= bit;
+        y->nodemap |= bit;
+    } else if (n->nodemap & bit) {
+        y = lnode_splice(n, j, 1, 1);
+        y->kids[j] = lnode_put(n->kids[j], shift + LTRIE_BITS, h, k, x, added);
+        return y;
+    } else {
+        y = lnode_splice(n, i, 0, 2);
+        y->kids[i] = k;
+        y->kids[i + 1] = x;
+        y->datamap |= bit;
+    }
+    *added = 1;
+    return y;
+}
+
+// copy of the path to key k, which hashes to h, under map node n at
+// shift, without k, or NULL if nothing would be left. n itself is
+// returned, with another reference, if it does not hold k
+static lval* lnode_remove(lval* n, int shift, uint32_t h, lval* k) {
+    if (shift >= LTRIE_HASH_BITS) {
+        for (int i = 0; i < n->width; i += 2) {
+            if (lval_eq(n->kids[i], k)) {
+                return n->width == 2 ? NULL : lnode_splice(n, i, 2, 0);
+            }
+        }
+        return lval_ref(n);
+    }
+
+    uint32_t bit = 1u << ((h >> shift) & LTRIE_MASK);
+    int i = lbits(n->datamap & (bit - 1)) * 2;
+    int j = lbits(n->datamap) * 2 + lbits(n->nodemap & (bit - 1));
+    if (n->datamap & bit) {
+        if (!lval_eq(n->kids[i], k)) { return lval_ref(n); }
+        if (n->width == 2) { return NULL; }
+        lval* y = lnode_splice(n, i, 2, 0);
+        y->datamap ^= bit;
+        return y;
+    }
+    if (!(n->nodemap & bit)) { return lval_ref(n); }
+
+    lval* kid = lnode_remove(n->kids[j], shift + LTRIE_BITS, h, k);
+    if (kid == n->kids[j]) {
+        lval_del(kid);
+        return lval_ref(n);
+    }
+    // a child left with a single entry is folded into this node in its
+    // place. Children always hold two or more, so kid is never NULL
+    if (kid->width == 2 && kid->nodemap == 0) {
+        lval* z = lnode_splice(n, j, 1, 0);
+        lval* y = lnode_splice(z, i, 0, 2);
+        lval_del(z);
+        y->kids[i] = lval_ref(kid->kids[0]);
+        y->kids[i + 1] = lval_ref(kid->kids[1]);
+        y->datamap |= bit;
+        y->nodemap ^= bit;
+        lval_del(kid);
+        return y;
+    }
+    lval* y = lnode_splice(n, j, 1, 1);
+    y->kids[j] = kid;
+    return y;
+}
+
+// map m with key k mapped to x. Takes ownership of k and x
+lval* lmap_assoc(lval* m, lval* k, lval* x) {
+    lval* root = m->root ? lval_ref(m->root) : lnode_splice(NULL, 0, 0, 0);
+    int added = 0;
+    lval* r = lval_map();
+    r->root = lnode_put(root, 0, lval_hash(k), k, x, &added);
+    r->size = m->size + added;
+    lval_del(root);
+    return r;
+}
+
+// map m without key k
+lval* lmap_dissoc(lval* m, lval* k) {
+    if (!m->root) { return lval_ref(m); }
+    lval* root = lnode_remove(m->root, 0, lval_hash(k), k);
+    if (root == m->root) {
+        lval_del(root);
+        return lval_ref(m);
+    }
+    lval* r = lval_map();
+    r->size = m->size - 1;
+    r->root = root;
+    return r;
+}
+
+static int lmap_has_entry(lval* k, lval* x, void* m) {
+    lval* y = lmap_get(m, k);
+    return y && lval_eq(x, y);
+}
+
+int lmap_eq(lval* x, lval* y) {
+    if (x->size != y->size) { return 0; }
+    return !x->root || lnode_each(x->root, 0, lmap_has_entry, y);
+}
+
+// where lmap_print_entry prints to, and whether no entry has been yet
+typedef struct {
+    FILE* f;
+    int first;
+} lmap_printer;
+
+static int lmap_print_entry(lval* k, lval* x, void* p) {
+    lmap_printer* pr = p;
+    if (!pr->first) { fputs(", ", pr->f); }
+    pr->first = 0;
+    lval_fprint(pr->f, k);
+    putc(' ', pr->f);
+    lval_fprint(pr->f, x);
+    return 1;
+}
+
+void lmap_print(FILE* f, lval* v) {
+    lmap_printer pr = { f, 1 };
+    fputs("#{", f);
+    if (v->root) { lnode_each(v->root, 0, lmap_print_entry, &pr); }
+    putc('}', f);
+}
+
+// what lval_items lists of a map
+enum { LITEMS_KEYS, LITEMS_VALS, LITEMS_PAIRS };
+
+typedef struct {
+    lval* list;
+    int what;
+} litems;
+
+static int lmap_add_entry(lval* k, lval* x, void* ctx) {
+    litems* it = ctx;
+    switch (it->what) {
+        case LITEMS_KEYS: lval_add(it->list, lval_ref(k)); break;
+        case LITEMS_VALS: lval_add(it->list, lval_ref(x)); break;
+        case LITEMS_PAIRS:
+            lval_add(it->list, lval_add(lval_add(lval_qexpr(), lval_ref(k)),
+                                        lval_ref(x)));
+            break;
+    }
+    return 1;
+}
+
+// construct Q-Expression of the items of vector v, or of the keys, values
+// or key and value pairs of map v
+lval* lval_items(lval* v, int what) {
+    litems it = { lval_qexpr(), what };
+    lval_reserve(it.list, v->size);
+    if (v->type == LVAL_VEC) {
+        for (int i = 0; i < v->size; i++) {
+            lval_add(it.list, lval_ref(lvector_nth(v, i)));
+        }
+    } else if (v->root) {
+        lnode_each(v->root, 0, lmap_add_entry, &it);
+    }
+    return it.list;
+}
+
+/**
+ * Numbers
+ *
+ * Integers are fixnums or boxed longs while they fit in a long, and
+ * bignums only once they do not, so each integer has just one form.
+ * Arithmetic is done on machine integers until an operation overflows,
+ * and that operation is then redone on bignums. Floats are doubles, and
+ * a float among the arguments of an operation makes it a float operation.
+ */
+// construct pointer to new float lval
+lval* lval_float(double x) {
+    lval* v = lval_new(LVAL_DBL);
+    v->dbl = x;
+    return v;
+}
+
+// magnitude and sign of an integer. Zero has no limbs
+typedef struct {
+    const uint32_t* d;
+    int n;
+    int sign;
+} lbig_view;
+
+// view of integer v, putting the limbs of a long in buf
+static lbig_view lbig_of(lval* v, uint32_t buf[2]) {
+    if (lval_type(v) == LVAL_BIG) {
+        return (lbig_view){ v->digits, v->limbs, v->sign };
+    }
+    long x = lval_as_num(v);
+    uint64_t m = x < 0 ? -(uint64_t)x : (uint64_t)x;
+    buf[0] = (uint32_t)m;
+    buf[1] = (uint32_t)(m >> 32);
+    return (lbig_view){ buf, buf[1] ? 2 : buf[0] ? 1 : 0, x < 0 ? -1 : 1 };
+}
+
+// construct integer of the n limbs at d with sign, which is a number if
+// it fits in a long and a bignum if not
+static lval* lbig_make(const uint32_t* d, int n, int sign) {
+    while (n && !d[n - 1]) { n--; }
+    if (n <= 2) {
+        uint64_t m = n == 0 ? 0 : n == 1 ? d[0] : (uint64_t)d[1] << 32 | d[0];
+        if (m <= LONG_MAX) { return lval_num(sign < 0 ? -(long)m : (long)m); }
+        if (sign < 0 && m == (uint64_t)LONG_MAX + 1) { return lval_num(LONG_MIN); }
+    }
+    lval* v = lval_new(LVAL_BIG);
+    v->limbs = n;
+    v->sign = sign;
+    v->digits = lalloc(sizeof(uint32_t) * n);
+    memcpy(v->digits, d, sizeof(uint32_t) * n);
+    return v;
+}
+
+static int lbig_cmp_mag(lbig_view a, lbig_view b) {
+    if (a.n != b.n) { return a.n < b.n ? -1 : 1; }
+    for (int i = a.n - 1; i >= 0; i--) {
+        if (a.d[i] != b.d[i]) { return a.d[i] < b.d[i] ? -1 : 1; }
+    }
+    return 0;
+}
+
+// add the magnitudes of a and b into out, which has room for one limb
+// more than the longer of them, returning the number of limbs
+static int lbig_add_mag(lbig_view a, lbig_view b, uint32_t* out) {
+    if (a.n < b.n) { lbig_view t = a; a = b; b = t; }
+    uint64_t carry = 0;
+    for (int i = 0; i < a.n; i++) {
+        carry += (uint64_t)a.d[i] + (i < b.n ? b.d[i] : 0);
+        out[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    out[a.n] = (uint32_t)carry;
+    return a.n + 1;
+}
+
+// subtract the magnitude of b from the larger one of a into out, which
+// may be a's own limbs, returning the number of limbs
+static int lbig_sub_mag(lbig_view a, lbig_view b, uint32_t* out) {
+    int64_t borrow = 0;
+    for (int i = 0; i < a.n; i++) {
+        int64_t d = (int64_t)a.d[i] - (i < b.n ? b.d[i] : 0) - borrow;
+        borrow = d < 0;
+        out[i] = (uint32_t)(d + (borrow ? (int64_t)1 << 32 : 0));
+    }
+    return a.n;
+}
+
+// x + y, or x - y if neg is set, for integers x and y
+static lval* lint_add(lval* x, lval* y, int neg) {
+    uint32_t bx[2], by[2];
+    lbig_view a = lbig_of(x, bx);
+    lbig_view b = lbig_of(y, by);
+    if (neg) { b.sign = -b.sign; }
+
+    uint32_t* out = malloc(sizeof(uint32_t) * ((a.n > b.n ? a.n : b.n) + 1));
+    int n, sign;
+    if (a.sign == b.sign) {
+        n = lbig_add_mag(a, b, out);
+        sign = a.sign;
+    } else if (lbig_cmp_mag(a, b) >= 0) {
+        n = lbig_sub_mag(a, b, out);
+        sign = a.sign;
+    } else {
+        n = lbig_sub_mag(b, a, out);
+        sign = b.sign;
+    }
+    lval* r = lbig_make(out, n, sign);
+    free(out);
+    return r;
+}
+
+static lval* lint_mul(lval* x, lval* y) {
+    uint32_t bx[2], by[2];
+    lbig_view a = lbig_of(x, bx);
+    lbig_view b = lbig_of(y, by);
+
+    int n = a.n + b.n;
+    uint32_t* out = calloc(n ? n : 1, sizeof(uint32_t));
+    for (int i = 0; i < a.n; i++) {
+        uint64_t carry = 0;
+        for (int j = 0; j < b.n; j++) {
+            carry += (uint64_t)a.d[i] * b.d[j] + out[i + j];
+            out[i + j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        out[i + b.n] = (uint32_t)carry;
+    }
+    lval* r = lbig_make(out, n, a.sign * b.sign);
+    free(out);
+    return r;
+}
+
+// quotient of integers x and y, or the remainder if rem is set. Both
+// truncate towards zero as C does. y must not be zero
+static lval* lint_div(lval* x, lval* y, int rem) {
+    uint32_t bx[2], by[2];
+    lbig_view a = lbig_of(x, bx);
+    lbig_view b = lbig_of(y, by);
+
+    uint32_t* q = calloc(a.n ? a.n : 1, sizeof(uint32_t));
+    uint32_t* r = calloc(b.n + 1, sizeof(uint32_t));
+    if (b.n == 1) {
+        // a single limb divisor divides a limb at a time
+        uint64_t rr = 0;
+        for (int i = a.n - 1; i >= 0; i--) {
+            rr = rr << 32 | a.d[i];
+            q[i] = (uint32_t)(rr / b.d[0]);
+            rr %= b.d[0];
+        }
+        r[0] = (uint32_t)rr;
+    } else {
+        // otherwise long division a bit at a time, bringing each bit of a
+        // down into r
+        for (int i = a.n * 32 - 1; i >= 0; i--) {
+            uint32_t bit = (a.d[i / 32] >> (i % 32)) & 1;
+            for (int j = 0; j <= b.n; j++) {
+                uint32_t top = r[j] >> 31;
+                r[j] = r[j] << 1 | bit;
+                bit = top;
+            }
+            lbig_view rv = { r, b.n + 1, 1 };
+            while (rv.n && !r[rv.n - 1]) { rv.n--; }
+            if (lbig_cmp_mag(rv, b) >= 0) {
+                lbig_sub_mag(rv, b, r);
+                q[i / 32] |= 1u << (i % 32);
+            }
+        }
+    }
+    lval* res = rem ? lbig_make(r, b.n + 1, a.sign)
+                    : lbig_make(q, a.n, a.sign * b.sign);
+    free(q);
+    free(r);
+    return res;
+}
+
+// -1, 0 or 1 as integer x is less than, equal to or greater than y
+static int lint_cmp(lval* x, lval* y) {
+    if (lval_type(x) == LVAL_NUM && lval_type(y) == LVAL_NUM) {
+        long a = lval_as_num(x), b = lval_as_num(y);
+        return (a > b) - (a < b);
+    }
+    uint32_t bx[2], by[2];
+    lbig_view a = lbig_of(x, bx);
+    lbig_view b = lbig_of(y, by);
+    // zero has no limbs and a positive sign
+    if (a.sign != b.sign) { return a.sign < b.sign ? -1 : 1; }
+    int c = lbig_cmp_mag(a, b);
+    return a.sign < 0 ? -c : c;
+}
+
+// integer of the len decimal digits at s, negated if neg is set
+lval* lint_read(const char* s, int len, int neg) {
+    uint32_t* d = calloc(len / 9 + 2, sizeof(uint32_t));
+    int n = 0;
+    for (int i = 0; i < len; i++) {
+        uint64_t carry = s[i] - '0';
+        for (int j = 0; j < n; j++) {
+            carry += (uint64_t)d[j] * 10;
+            d[j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        if (carry) { d[n++] = (uint32_t)carry; }
+    }
+    lval* r = lbig_make(d, n, neg ? -1 : 1);
+    free(d);
+    return r;
+}
+
+// integer of the whole part of x, which must be finite
+lval* lint_from_double(double x) {
+    double t = trunc(x);
+    if (t >= (double)LONG_MIN && t < -(double)LONG_MIN) {
+        return lval_num((long)t);
+    }
+    // a double has at most 1024 bits before its point
+    uint32_t d[33];
+    int n = 0;
+    for (double m = fabs(t); m >= 1; m = floor(m / 4294967296.0)) {
+        d[n++] = (uint32_t)fmod(m, 4294967296.0);
+    }
+    return lbig_make(d, n, t < 0 ? -1 : 1);
+}
+
+double lnum_to_double(lval* v) {
+    switch (lval_type(v)) {
+        case LVAL_DBL: return v->dbl;
+        case LVAL_BIG: {
+            double r = 0;
+            for (int i = v->limbs - 1; i >= 0; i--) {
+                r = r * 4294967296.0 + v->digits[i];
+            }
+            return v->sign * r;
+        }
+        default: return (double)lval_as_num(v);
+    }
+}
+
+// arithmetic operators and orderings, named as their builtins are
+enum { LNUM_ADD, LNUM_SUB, LNUM_MUL, LNUM_DIV, LNUM_MOD };
+enum { LNUM_GT, LNUM_LT, LNUM_GE, LNUM_LE };
+static char* lnum_op_names[] = { "+", "-", "*", "/", "%" };
+static char* lnum_ord_names[] = { ">", "<", ">=", "<=" };
+
+// op on longs x and y into *r. Returns 0 if the result does not fit in a
+// long or divides by zero, for lnum_op to deal with
+static inline int lnum_op_long(int op, long x, long y, long* r) {
+    switch (op) {
+        case LNUM_ADD: return !__builtin_add_overflow(x, y, r);
+        case LNUM_SUB: return !__builtin_sub_overflow(x, y, r);
+        case LNUM_MUL: return !__builtin_mul_overflow(x, y, r);
+        case LNUM_DIV:
+            if (y == 0 || (y == -1 && x == LONG_MIN)) { return 0; }
+            *r = x / y;
+            return 1;
+        case LNUM_MOD:
+            if (y == 0) { return 0; }
+            *r = y == -1 ? 0 : x % y;
+            return 1;
+    }
+    return 0;
+}
+
+// result of op on numbers x and y. Integers that overflow a long become
+// bignums. Division of integers by zero gives NULL
+lval* lnum_op(lval* x, lval* y, int op) {
+    if (lval_type(x) == LVAL_DBL || lval_type(y) == LVAL_DBL) {
+        double a = lnum_to_double(x), b = lnum_to_double(y);
+        switch (op) {
+            case LNUM_ADD: return lval_float(a + b);
+            case LNUM_SUB: return lval_float(a - b);
+            case LNUM_MUL: return lval_float(a * b);
+            case LNUM_DIV: return lval_float(a / b);
+            case LNUM_MOD: return lval_float(fmod(a, b));
+        }
+        return NULL;
+    }
+    switch (op) {
+        case LNUM_ADD: return lint_add(x, y, 0);
+        case LNUM_SUB: return lint_add(x, y, 1);
+        case LNUM_MUL: return lint_mul(x, y);
+    }
+    if (lval_type(y) == LVAL_NUM && lval_as_num(y) == 0) { return NULL; }
+    return lint_div(x, y, op == LNUM_MOD);
+}
+
+// whether the ordering op holds between x and y
+static inline int lnum_ord(int op, double x, double y) {
+    switch (op) {
+        case LNUM_GT: return x > y;
+        case LNUM_LT: return x < y;
+        case LNUM_GE: return x >= y;
+        case LNUM_LE: return x <= y;
+    }
+    return 0;
+}
+
+// print x in as few digits as read back as the same double, always with
+// a point or exponent so that it is not taken for an integer
+void lval_print_float(FILE* f, double x) {
+    char buf[32];
+    for (int digits = 15; digits <= 17; digits++) {
+        snprintf(buf, sizeof(buf), "%.*g", digits, x);
+        if (strtod(buf, NULL) == x) { break; }
+    }
+    fprintf(f, strpbrk(buf, ".ein") ? "%s" : "%s.0", buf);
+}
+
+void lbig_print(FILE* f, lval* v) {
+    // split off nine decimal digits at a time from the bottom
+    int n = v->limbs;
+    uint32_t* d = malloc(sizeof(uint32_t) * n);
+    uint32_t* parts = malloc(sizeof(uint32_t) * (n * 2 + 1));
+    memcpy(d, v->digits, sizeof(uint32_t) * n);
+    int k = 0;
+    do {
+        uint64_t r = 0;
+        for (int i = n - 1; i >= 0; i--) {
+            r = r << 32 | d[i];
+            d[i] = (uint32_t)(r / 1000000000);
+            r %= 1000000000;
+        }
+        parts[k++] = (uint32_t)r;
+        while (n && !d[n - 1]) { n--; }
+    } while (n);
+    fprintf(f, "%s%u", v->sign < 0 ? "-" : "", parts[k - 1]);
+    for (int i = k - 2; i >= 0; i--) { fprintf(f, "%09u", parts[i]); }
+    free(d);
+    free(parts);
+}
+
+/**
+ * Read lvals
+ */
+lval* lval_read_num(mpc_ast_t* t) {
+    // a fraction or exponent makes a float
+    if (strpbrk(t->contents, ".eE")) {
+        return lval_float(strtod(t->contents, NULL));
+    }
+    errno = 0;
+    long x = strtol(t->contents, NULL, 10);
+    if (errno != ERANGE) { return lval_num(x); }
+
+    // too wide for a long
+    char* s = t->contents;
+    int neg = *s == '-';
+    return lint_read(s + neg, strlen(s + neg), neg);
+}
+
+lval* lval_read_str(mpc_ast_t* t) {
+    // cut off the final quote character
+    t->contents[strlen(t->contents) - 1] = '\0';
+    // copy string removing first quote character
+    char* unescaped = malloc(strlen(t->contents + 1) + 1);
+    strcpy(unescaped, t->contents + 1);
+    // pass through unescape function
+    unescaped = mpcf_unescape(unescaped);
+    lval* str = lval_str(unescaped);
+    free(unescaped);
+    return str;
+}
+
+lval* lval_read(mpc_ast_t* t) {
     // if symbol or number, create lval of that type
     if (strstr(t->tag, "number")) { return lval_read_num(t); }
     if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
@@ -449,645 +2239,5313 @@ lval* lval_read(mpc_ast_t* t) {
     return x;
 }
 
-/**
- * lisp environment
- */
+/*
+ * Source is read in a single pass straight into lvals, without building
+ * a parse tree. It accepts the same language as the mpc grammar in main,
+ * which can still be used instead with the --mpc flag.
+ *
+ * Scripts are read one top-level expression at a time, each evaluated
+ * and freed before the next is read. A reader over a stream holds only
+ * part of its input, and stops with more set when an expression runs
+ * past what it holds, to be read again once it has been refilled.
+ */
+static int lread_use_mpc = 0;
+
+typedef struct {
+    const char* name; // file name, for errors
+    const char* src;
+    const char* s;    // next character to read
+    const char* end;
+    int eof;          // true if the input ends at end
+    int more;         // stopped at end before the input ended
+    int mapped;       // src is a page of a mapped file
+    long line;        // lines and columns read before src
+    long col;
+    lval** items;     // elements of the lists being read, innermost last
+    int count;
+    int cap;
+    int failed;
+    char err[512];
+} lreader;
+
+// error at the current position, in the same form as mpc's errors
+static lval* lread_err(lreader* r, char* msg) {
+    long line = r->line + 1;
+    long col = r->col;
+    const char* bol = r->src;
+    for (const char* c = r->src; c < r->s; c++) {
+        if (*c == '\n') { line++; bol = c + 1; col = 0; }
+    }
+    snprintf(r->err, sizeof(r->err), "%s:%li:%li: error: %s\n", r->name,
+             line, col + (long)(r->s - bol) + 1, msg);
+    r->failed = 1;
+    return NULL;
+}
+
+// reached the end of what the reader holds, which is an error only if
+// the input really ends there
+static lval* lread_end(lreader* r, char* msg) {
+    if (r->eof) { return lread_err(r, msg); }
+    r->more = 1;
+    return NULL;
+}
+
+static int lread_is_sym(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') ||
+           (c && strchr("_+-*/%\\=<>!&", c) != NULL);
+}
+
+static int lread_is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// skip whitespace and comments
+static void lread_skip(lreader* r) {
+    while (r->s < r->end) {
+        char c = *r->s;
+        if (c == ';') {
+            while (r->s < r->end && *r->s != '\r' && *r->s != '\n') { r->s++; }
+        } else if (c == ' ' || c == '\t' || c == '\n' ||
+                   c == '\r' || c == '\v' || c == '\f') {
+            r->s++;
+        } else {
+            return;
+        }
+    }
+}
+
+// the character an escape sequence stands for, or -1 if it stands for
+// itself, as in mpcf_unescape
+static int lread_escape(char c) {
+    switch (c) {
+        case 'a':  return '\a';
+        case 'b':  return '\b';
+        case 'f':  return '\f';
+        case 'n':  return '\n';
+        case 'r':  return '\r';
+        case 't':  return '\t';
+        case 'v':  return '\v';
+        case '\\': return '\\';
+        case '\'': return '\'';
+        case '"':  return '"';
+        case '0':  return '\0';
+    }
+    return -1;
+}
+
+// unescape the characters from s to end into out, as mpcf_unescape does,
+// returning the length. With out NULL, only the length is found
+static int lread_unescape(const char* s, const char* end, char* out) {
+    int len = 0;
+    while (s < end) {
+        int c = *s == '\\' && s + 1 < end ? lread_escape(s[1]) : -1;
+        if (c == '\0') { break; }
+        if (out) { out[len] = c < 0 ? *s : c; }
+        len++;
+        s += c < 0 ? 1 : 2;
+    }
+    return len;
+}
+
+static lval* lread_str(lreader* r) {
+    // find the closing quote, with a backslash escaping any character
+    const char* start = ++r->s;
+    // a backslash ending the input escapes nothing, and is not skipped
+    // past the end, as a mapped file has nothing after it
+    while (r->s < r->end && *r->s != '"') {
+        r->s += *r->s == '\\' && r->s + 1 < r->end ? 2 : 1;
+    }
+    if (r->s >= r->end) {
+        r->s = r->end;
+        return lread_end(r, "unterminated string");
+    }
+    const char* end = r->s++;
+
+    // unescape straight into the new string
+    lval* v = lval_new(LVAL_STR);
+    int len = lread_unescape(start, end, NULL);
+    v->str = lalloc(len + 1);
+    lread_unescape(start, end, v->str);
+    v->str[len] = '\0';
+    return v;
+}
+
+// float of the len characters at s, copied out first as strtod could
+// read past the end of a mapped file
+static lval* lread_float(const char* s, int len) {
+    char buf[64];
+    char* str = len < (int)sizeof(buf) ? buf : malloc(len + 1);
+    memcpy(str, s, len);
+    str[len] = '\0';
+    lval* v = lval_float(strtod(str, NULL));
+    if (str != buf) { free(str); }
+    return v;
+}
+
+static lval* lread_atom(lreader* r) {
+    const char* start = r->s;
+
+    // an atom running to the end may continue past it. A point may be
+    // part of a float
+    const char* c = start;
+    while (c < r->end && (lread_is_sym(*c) || *c == '.')) { c++; }
+    if (c == r->end && !r->eof) { return lread_end(r, NULL); }
+
+    // a number is tried first, so "-1" is a number but "-" a symbol.
+    // Digits are converted here rather than by strtol, which could read
+    // past the end of a mapped file
+    c = start;
+    int neg = *c == '-';
+    if (neg) { c++; }
+    if (c < r->end && lread_is_digit(*c)) {
+        const char* digits = c;
+        unsigned long limit = neg ? (unsigned long)LONG_MAX + 1 : LONG_MAX;
+        unsigned long x = 0;
+        int range = 0;
+        for (; c < r->end && lread_is_digit(*c); c++) {
+            unsigned long d = *c - '0';
+            if (x > (limit - d) / 10) { range = 1; }
+            x = x * 10 + d;
+        }
+
+        // a fraction or exponent makes a float
+        const char* f = c;
+        if (f + 1 < r->end && *f == '.' && lread_is_digit(f[1])) {
+            for (f += 2; f < r->end && lread_is_digit(*f); f++) {}
+        }
+        if (f < r->end && (*f == 'e' || *f == 'E')) {
+            const char* p = f + 1;
+            if (p < r->end && (*p == '+' || *p == '-')) { p++; }
+            if (p < r->end && lread_is_digit(*p)) {
+                for (f = p; f < r->end && lread_is_digit(*f); f++) {}
+            }
+        }
+        if (f != c) {
+            r->s = f;
+            return lread_float(start, f - start);
+        }
+
+        r->s = c;
+        if (range) { return lint_read(digits, c - digits, neg); }
+        return lval_num(neg ? -(long)(x - 1) - 1 : (long)x);
+    }
+
+    while (r->s < r->end && lread_is_sym(*r->s)) { r->s++; }
+    if (r->s == start) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "unexpected '%c'", *r->s);
+        return lread_err(r, msg);
+    }
+    lval* v = lval_sym_n(start, r->s - start);
+    return v ? v : lread_err(r, "too many symbols");
+}
+
+static lval* lread_expr(lreader* r);
+lval* lval_eval(lenv* e, lval* v);
+
+// read elements up to close into a new list of the given type. The top
+// level is read as a list closed by the end of the input
+static lval* lread_list(lreader* r, int type, char close) {
+    int base = r->count;
+    while (1) {
+        lread_skip(r);
+        if (r->s >= r->end) {
+            if (!close) { break; }
+            return lread_end(r, close == ')' ? "expected ')' at end of input"
+                                             : "expected '}' at end of input");
+        }
+        if (*r->s == close) { r->s++; break; }
+
+        lval* x = lread_expr(r);
+        if (!x) { return NULL; }
+        if (r->count == r->cap) {
+            r->cap = r->cap ? r->cap * 2 : 64;
+            r->items = realloc(r->items, sizeof(lval*) * r->cap);
+        }
+        r->items[r->count++] = x;
+    }
+
+    // move the elements into a list of exactly the right size
+    lval* v = type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+    v->count = r->count - base;
+    v->cap = v->count;
+    v->cell = lalloc(sizeof(lval*) * v->count);
+    if (v->count) { memcpy(v->cell, &r->items[base], sizeof(lval*) * v->count); }
+    r->count = base;
+    return v;
+}
+
+static lval* lread_expr(lreader* r) {
+    switch (*r->s) {
+        case '(': r->s++; return lread_list(r, LVAL_SEXPR, ')');
+        case '{': r->s++; return lread_list(r, LVAL_QEXPR, '}');
+        case '"': return lread_str(r);
+        case ')':
+        case '}': return lread_err(r, "unexpected closing bracket");
+    }
+    return lread_atom(r);
+}
+
+// read the next top-level expression, or return NULL at the end, on error
+// or if more input is needed
+static lval* lread_next(lreader* r) {
+    lread_skip(r);
+    if (r->s >= r->end) { return r->eof ? NULL : lread_end(r, NULL); }
+    return lread_expr(r);
+}
+
+// drop whatever was read of an unfinished expression
+static void lread_drop(lreader* r) {
+    for (int i = 0; i < r->count; i++) { lval_del(r->items[i]); }
+    r->count = 0;
+}
+
+// read every expression in the len characters at src into an S-Expression,
+// or return an error if they cannot be read
+lval* lval_read_src(const char* name, const char* src, long len) {
+    lreader r = { name, src, src, src + len, 1 };
+    lval* x = lread_list(&r, LVAL_SEXPR, '\0');
+    if (!x) {
+        lread_drop(&r);
+        x = lval_err("%s", r.err);
+    }
+    free(r.items);
+    return x;
+}
+
+// keep count of the lines and columns passed over from src to s, for
+// errors, and move src up to s
+static void lread_advance(lreader* r, const char* s) {
+    for (const char* c = r->src; c < s; c++) {
+        if (*c == '\n') { r->line++; r->col = 0; } else { r->col++; }
+    }
+    r->src = s;
+}
+
+// move the unread input held by r to the start of buf and fill the rest
+// from f, growing buf if most of it is still unread
+static void lread_refill(lreader* r, FILE* f, char** buf, size_t* cap) {
+    lread_advance(r, r->s);
+
+    size_t keep = r->end - r->s;
+    if (keep * 2 >= *cap) {
+        // the unread part may be in the old buffer, so move it over first
+        char* n = malloc(*cap ? *cap * 2 : 65536);
+        memcpy(n, r->s, keep);
+        free(*buf);
+        *buf = n;
+        *cap = *cap ? *cap * 2 : 65536;
+    } else {
+        memmove(*buf, r->s, keep);
+    }
+
+    size_t n = fread(*buf + keep, 1, *cap - keep, f);
+    if (n == 0) { r->eof = 1; }
+    r->src = r->s = *buf;
+    r->end = *buf + keep + n;
+}
+
+// pages of a mapped file are given back once this much has been read past
+// them, so that reading a file doesn't hold all of it in memory
+#define LREAD_RELEASE (16 << 20)
+
+static void lread_release(lreader* r) {
+#ifndef _WIN32
+    if (!r->mapped || r->s - r->src < LREAD_RELEASE) { return; }
+    long page = sysconf(_SC_PAGESIZE);
+    const char* to = r->src + (r->s - r->src) / page * page;
+    const char* from = r->src;
+    lread_advance(r, to);
+    madvise((void*)from, to - from, MADV_DONTNEED);
+#endif
+}
+
+// read and evaluate each expression held by r in turn, refilling r from
+// f if it is not NULL. Returns an error if the input can't be read
+static lval* lread_eval_each(lenv* e, lreader* r, FILE* f) {
+    char* buf = NULL;
+    size_t cap = 0;
+    lval* err = NULL;
+
+    while (1) {
+        // eval each form in the arena, reclaiming its garbage in bulk
+        const char* start = r->s;
+        lalloc_arena_begin();
+        lval* form = lread_next(r);
+        if (form) {
+            lval* x = lval_eval(e, form);
+            if (lval_type(x) == LVAL_ERR) { lval_println(x); }
+            lval_del(x);
+        } else {
+            lread_drop(r);
+        }
+        lalloc_arena_end();
+
+        if (form) {
+            lread_release(r);
+            continue;
+        }
+        if (r->failed) { err = lval_err("%s", r->err); }
+        if (!r->more) { break; }
+
+        // read the unfinished expression again with more input
+        r->s = start;
+        r->more = 0;
+        lread_refill(r, f, &buf, &cap);
+        if (ferror(f)) {
+            err = lval_err("%s: error: Unable to read file!\n", r->name);
+            break;
+        }
+    }
+
+    free(buf);
+    free(r->items);
+    return err;
+}
+
+lval* lval_load_stream(lenv* e, const char* name);
+static lval* lval_load_from(lenv* e, const char* name, FILE* f);
+
+// load the file called name, returning an error if it could not be read
+lval* lval_load_file(lenv* e, const char* name) {
+#ifndef _WIN32
+    // regular files are mapped rather than read
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0 && S_ISREG(st.st_mode)) {
+        lreader r = { name, NULL, NULL, NULL, 1 };
+        lval* err = NULL;
+        if (st.st_size > 0) {
+            char* src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (src != MAP_FAILED) {
+                close(fd);
+                posix_madvise(src, st.st_size, POSIX_MADV_SEQUENTIAL);
+                r.src = r.s = src;
+                r.end = src + st.st_size;
+                r.mapped = 1;
+                err = lread_eval_each(e, &r, NULL);
+                munmap(src, st.st_size);
+                return err;
+            }
+        } else {
+            close(fd);
+            return NULL;
+        }
+    }
+    // a directory opens as a stream, but reading it fails
+    if (fd >= 0 && S_ISDIR(st.st_mode)) {
+        close(fd);
+        return lval_err("%s: error: Unable to open file!\n", name);
+    }
+    // pipes are read from the descriptor already open, as opening one
+    // again would wait for another writer
+    FILE* f = fd >= 0 ? fdopen(fd, "rb") : NULL;
+    if (f) {
+        lval* err = lval_load_from(e, name, f);
+        fclose(f);
+        return err;
+    }
+    if (fd >= 0) { close(fd); }
+#endif
+    return lval_load_stream(e, name);
+}
+
+// load the file called name as a stream, with "-" for stdin
+lval* lval_load_stream(lenv* e, const char* name) {
+    FILE* f = strcmp(name, "-") == 0 ? stdin : fopen(name, "rb");
+    if (!f) { return lval_err("%s: error: Unable to open file!\n", name); }
+
+    lval* err = lval_load_from(e, name, f);
+    if (f != stdin) { fclose(f); }
+    return err;
+}
+
+// load what stream f, the file called name, holds
+static lval* lval_load_from(lenv* e, const char* name, FILE* f) {
+    lreader r = { name, "", "", "", 0 };
+    return lread_eval_each(e, &r, f);
+}
+
+/**
+ * Resolve lvals
+ *
+ * When a lambda is created, symbols in its body naming one of its formals
+ * are replaced with resolved symbols recording the formal's slot in the
+ * call frame. Scoping is dynamic, so names bound further up the chain
+ * depend on the caller and are left to be looked up by name.
+ */
+
+// slot a call frame binds symbol k in, or -1 if k is not a formal
+static int lval_formal_slot(lval* formals, lval* k) {
+    int slot = 0;
+    for (int i = 0; i < formals->count; i++) {
+        lval* f = lsym_plain(formals->cell[i]);
+        if (f == lsym_rest) { continue; }
+        if (f == k) { return slot <= LSYM_SLOT_MAX ? slot : -1; }
+        slot++;
+    }
+    return -1;
+}
+
+// copy of v with formals resolved, or NULL if v has none to resolve.
+// Lists are only copied along the paths that change.
+lval* lval_resolve(lval* v, lval* formals) {
+    if (lval_type(v) == LVAL_SYM) {
+        int slot = lval_formal_slot(formals, lsym_plain(v));
+        if (slot < 0) { return NULL; }
+        lval* r = lsym_local(v, slot);
+        return r == v ? NULL : r;
+    }
+    if (lval_type(v) != LVAL_SEXPR && lval_type(v) != LVAL_QEXPR) {
+        return NULL;
+    }
+
+    lval* x = NULL;
+    for (int i = 0; i < v->count; i++) {
+        lval* r = lval_resolve(v->cell[i], formals);
+        if (!r) { continue; }
+        if (!x) { x = lval_copy(v); }
+        lval_del(x->cell[i]);
+        x->cell[i] = r;
+    }
+    return x;
+}
+
+/**
+ * lisp environment
+ */
+
+// new lenv struct. Bindings are kept in insertion order, so a function
+// frame holds its formals in the slots matching their positions. Small
+// frames are scanned directly, and larger envs such as the global one
+// also keep a hash index from symbol to slot.
+struct lenv {
+    unsigned char type; // always LENV_TYPE, distinguishing it from lvals
+    unsigned char mark;
+    unsigned char top;  // set on the global env
+    lenv* par;
+    lheap* heap; // heap holding this env and the values bound in it
+    int count;   // number of bindings
+    int cap;     // number of slots allocated in syms and vals
+    lval** syms;
+    lval** vals;
+    int icap;    // size of index, zero or a power of two
+    int* index;  // open addressing table of slot + 1, zero marking empty
+};
+
+// envs with more bindings than this get a hash index
+#define LENV_SCAN_MAX 8
+
+lenv* lenv_new(void) {
+    lenv* e = lalloc_obj(LKIND_LENV, sizeof(lenv));
+    e->type = LENV_TYPE;
+    e->mark = 0;
+    e->top = 0;
+    e->par = NULL;
+    e->heap = lheap_cur;
+    e->count = 0;
+    e->cap = 0;
+    e->syms = NULL;
+    e->vals = NULL;
+    e->icap = 0;
+    e->index = NULL;
+    return e;
+}
+
+// new lenv with room for n bindings, used as a function's frame
+lenv* lenv_frame(int n) {
+    lenv* e = lenv_new();
+    if (n > 0) {
+        e->cap = n;
+        e->syms = lalloc(sizeof(lval*) * n);
+        e->vals = lalloc(sizeof(lval*) * n);
+    }
+    return e;
+}
+
+void lenv_del(lenv* e) {
+    for (int i = 0; i < e->count; i++) { lval_del(e->vals[i]); }
+    lfree(e->syms, sizeof(lval*) * e->cap);
+    lfree(e->vals, sizeof(lval*) * e->cap);
+    lfree(e->index, sizeof(int) * e->icap);
+    lfree_obj(e, sizeof(lenv));
+}
+
+// whether x and y bind the same symbols, in the same order, to equal
+// values, as the frames of lambdas given equal arguments do
+int lenv_eq(lenv* x, lenv* y) {
+    if (x->count != y->count) { return 0; }
+    for (int i = 0; i < x->count; i++) {
+        if (x->syms[i] != y->syms[i] || !lval_eq(x->vals[i], y->vals[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// hash of e's bindings, equal for envs that are lenv_eq
+uint32_t lenv_hash(lenv* e) {
+    uint64_t h = e->count;
+    for (int i = 0; i < e->count; i++) {
+        h = h * 31 + lval_hash(e->syms[i]);
+        h = h * 31 + lval_hash(e->vals[i]);
+    }
+    return lhash_mix(h);
+}
+
+lenv* lenv_copy(lenv* e) {
+    lenv* n = lenv_frame(e->cap);
+    n->par = e->par;
+    n->count = e->count;
+    for (int i = 0; i < e->count; i++) {
+        n->syms[i] = e->syms[i];
+        n->vals[i] = lval_ref(e->vals[i]);
+    }
+    if (e->index) {
+        n->icap = e->icap;
+        n->index = lalloc(sizeof(int) * n->icap);
+        memcpy(n->index, e->index, sizeof(int) * n->icap);
+    }
+    return n;
+}
+
+void lenv_promote(lenv* e, lheap* h) {
+    for (int i = 0; i < e->count; i++) {
+        e->vals[i] = lval_promote(e->vals[i], h);
+    }
+}
+
+// index position holding symbol k, or the empty one where it would go
+static int lenv_index_pos(lenv* e, lval* k) {
+    int mask = e->icap - 1;
+    int i = lsym_hash(k) & mask;
+    while (e->index[i] && e->syms[e->index[i] - 1] != k) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// rebuild the index of e with n positions
+static void lenv_reindex(lenv* e, int n) {
+    lfree(e->index, sizeof(int) * e->icap);
+    e->icap = n;
+    e->index = lalloc(sizeof(int) * n);
+    memset(e->index, 0, sizeof(int) * n);
+    for (int i = 0; i < e->count; i++) {
+        e->index[lenv_index_pos(e, e->syms[i])] = i + 1;
+    }
+}
+
+// slot of symbol k in e alone, or -1 if e does not bind it
+static int lenv_slot(lenv* e, lval* k) {
+    if (e->index) {
+        int i = e->index[lenv_index_pos(e, k)];
+        return i - 1;
+    }
+    for (int i = 0; i < e->count; i++) {
+        if (e->syms[i] == k) { return i; }
+    }
+    return -1;
+}
+
+// env binding symbol k, looking in each env up the chain of parents from
+// e, with the slot holding k in *slot. NULL if no env binds k
+static lenv* lenv_find(lenv* e, lval* k, int* slot) {
+    for (; e; e = e->par) {
+        int i = lenv_slot(e, k);
+        if (i >= 0) {
+            *slot = i;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// get value for symbol of k in lenv
+lval* lenv_get(lenv* e, lval* k) {
+    k = lsym_plain(k);
+    // if a slot holds k, share the value
+    int i;
+    lenv* b = lenv_find(e, k, &i);
+    if (b) { return lval_ref(b->vals[i]); }
+    // if no symbol k in any lenv, error
+    return lval_err("Symbol '%s' not defined.", lsym_name(k));
+}
+
+/*
+ * Call sites cache where they found global symbols as the global env and
+ * a slot in it. Redefining a symbol reuses its slot, so a cached site
+ * sees the new value. What invalidates a cache is a frame binding the
+ * symbol, which may then shadow the global binding depending on the
+ * caller. That bumps lenv_version, and a cache only holds while the
+ * version it was made at is current.
+ */
+static _Thread_local unsigned lenv_version = 1;
+
+// version of the bindings function bodies were optimized with, changed
+// whenever a symbol a fold relied on is bound again
+static _Thread_local unsigned lopt_version = 1;
+
+// global env evaluation on this thread last entered. Clones of an env
+// share function bodies, whose cached call sites and folds only hold for
+// the env they were made in, so entering another one redoes both
+static _Thread_local lenv* lenv_top = NULL;
+
+void lenv_enter(lenv* e) {
+    if (e == lenv_top) { return; }
+    lenv_top = e;
+    if (++lenv_version == 0) { lenv_version = 1; }
+    if (++lopt_version == 0) { lopt_version = 1; }
+}
+
+// value for symbol k from e, recording the env and slot it was found in
+// into *env and *slot if it is a global binding no frame can shadow
+lval* lenv_get_cached(lenv* e, lval* k, unsigned* version, lenv** env,
+                      int* slot) {
+    k = lsym_plain(k);
+    int i;
+    lenv* b = lenv_find(e, k, &i);
+    if (!b) { return lval_err("Symbol '%s' not defined.", lsym_name(k)); }
+    if (b->top && !(*lsym_flags_of(k) & LSYM_SHADOWED)) {
+        *version = lenv_version;
+        *env = b;
+        *slot = i;
+    }
+    return lval_ref(b->vals[i]);
+}
+
+// put new value v for symbol k into lenv
+void lenv_put(lenv* e, lval* k, lval* v) {
+    k = lsym_plain(k);
+
+    // a symbol bound outside the global env may shadow the global binding
+    // for cached call sites
+    unsigned char* flags = lsym_flags_of(k);
+    if (!e->top && !(*flags & LSYM_SHADOWED)) {
+        *flags |= LSYM_SHADOWED;
+        if (++lenv_version == 0) { lenv_version = 1; }
+    }
+
+    // functions optimized with the old binding have to be optimized again
+    if (*flags & LSYM_FOLDED) {
+        *flags &= ~LSYM_FOLDED;
+        if (++lopt_version == 0) { lopt_version = 1; }
+    }
+
+    // bindings must live as long as the env, so allocate them from its heap
+    lheap* prev = lalloc_switch(e->heap);
+    v = lval_ref(v);
+    if (e->heap == &lheap_global && lheap_arena_depth > 0) {
+        v = lval_promote(v, e->heap);
+    }
+
+    // change value for symbol if it exists
+    int i = lenv_slot(e, k);
+    if (i >= 0) {
+        lval_del(e->vals[i]);
+        e->vals[i] = v;
+        lalloc_switch(prev);
+        return;
+    }
+
+    // if no existing entry, make sure there is room for a new variable
+    if (e->count == e->cap) {
+        int cap = e->cap ? e->cap * 2 : 4;
+        e->syms = lrealloc(e->syms, sizeof(lval*) * e->cap, sizeof(lval*) * cap);
+        e->vals = lrealloc(e->vals, sizeof(lval*) * e->cap, sizeof(lval*) * cap);
+        e->cap = cap;
+    }
+
+    i = e->count++;
+    e->syms[i] = k;
+    e->vals[i] = v;
+
+    // keep the index at most half full once the env is too big to scan
+    if (e->index && e->count * 2 <= e->icap) {
+        e->index[lenv_index_pos(e, k)] = i + 1;
+    } else if (e->count > LENV_SCAN_MAX) {
+        lenv_reindex(e, e->icap ? e->icap * 2 : 32);
+    }
+    lalloc_switch(prev);
+}
+
+// put new value in global scope
+void lenv_def(lenv* e, lval* k, lval* v) {
+    // iterate until no parent
+    while (e->par) { e = e->par; }
+    lenv_put(e, k, v);
+}
+
+/**
+ * Memoization
+ *
+ * memo wraps a function with a cache of its results, keyed on the list of
+ * arguments of each call. Argument lists are found by lval_hash and told
+ * apart with lval_eq, so equal arguments hit however they were made. The
+ * cache keeps at most a given number of entries and of bytes, estimated
+ * as if nothing in them were shared, and evicts the least recently used
+ * entry to stay within both.
+ *
+ * Like the bindings of an env, the cache lives in the heap of the memo,
+ * so arguments and results are promoted into it when they are added.
+ */
+#define LMEMO_MAX_ENTRIES 4096
+#define LMEMO_MAX_BYTES   (16L << 20)
+
+typedef struct {
+    lval* args;   // argument list, or NULL if the entry is unused
+    lval* result;
+    uint32_t hash;
+    int chain;    // next entry in the same bucket, or next unused entry
+    int newer;    // neighbours in order of use, -1 past either end
+    int older;
+    long bytes;
+} lmemo_entry;
+
+struct lmemo {
+    int count;         // entries in use
+    int cap;           // entries allocated, and buckets, a power of two
+    int max;           // most entries kept
+    long max_bytes;    // most bytes kept
+    long bytes;
+    int newest;        // ends of the order of use, -1 when empty
+    int oldest;
+    int unused;        // first unused entry, or -1
+    int* buckets;      // first entry hashing to each, or -1
+    lmemo_entry* entries;
+    long hits;
+    long misses;
+    long evictions;
+};
+
+// estimate of the bytes v takes, counting shared parts as often as they
+// are reached
+static long lval_bytes(lval* v) {
+    if (lval_is_imm(v)) { return 0; }
+    long n = sizeof(lval);
+    switch (v->type) {
+        case LVAL_ERR: n += strlen(v->err) + 1; break;
+        case LVAL_STR: n += strlen(v->str) + 1; break;
+        case LVAL_BIG: n += sizeof(uint32_t) * v->limbs; break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            n += sizeof(lval*) * v->count;
+            for (int i = 0; i < v->count; i++) { n += lval_bytes(v->cell[i]); }
+            break;
+        case LVAL_VEC:
+        case LVAL_MAP:
+            if (v->root) { n += lval_bytes(v->root); }
+            break;
+        case LVAL_NODE:
+            n += sizeof(lval*) * v->width;
+            for (int i = 0; i < v->width; i++) { n += lval_bytes(v->kids[i]); }
+            break;
+    }
+    return n;
+}
+
+lmemo* lmemo_new(int max, long max_bytes) {
+    lmemo* m = lalloc(sizeof(lmemo));
+    m->count = 0;
+    m->cap = 0;
+    m->max = max;
+    m->max_bytes = max_bytes;
+    m->bytes = 0;
+    m->newest = m->oldest = -1;
+    m->unused = -1;
+    m->buckets = NULL;
+    m->entries = NULL;
+    m->hits = m->misses = m->evictions = 0;
+    return m;
+}
+
+// free m without releasing its entries, which the collector releases on
+// its own
+void lmemo_free(lmemo* m) {
+    lfree(m->buckets, sizeof(int) * m->cap);
+    lfree(m->entries, sizeof(lmemo_entry) * m->cap);
+    lfree(m, sizeof(lmemo));
+}
+
+void lmemo_del(lmemo* m) {
+    for (int i = 0; i < m->cap; i++) {
+        if (m->entries[i].args) {
+            lval_del(m->entries[i].args);
+            lval_del(m->entries[i].result);
+        }
+    }
+    lmemo_free(m);
+}
+
+// copy of m sharing its arguments and results, in the current heap
+lmemo* lmemo_copy(lmemo* m) {
+    lmemo* x = lalloc(sizeof(lmemo));
+    *x = *m;
+    if (m->cap) {
+        x->buckets = lalloc(sizeof(int) * m->cap);
+        x->entries = lalloc(sizeof(lmemo_entry) * m->cap);
+        memcpy(x->buckets, m->buckets, sizeof(int) * m->cap);
+        memcpy(x->entries, m->entries, sizeof(lmemo_entry) * m->cap);
+    }
+    for (int i = 0; i < x->cap; i++) {
+        if (x->entries[i].args) {
+            lval_ref(x->entries[i].args);
+            lval_ref(x->entries[i].result);
+        }
+    }
+    return x;
+}
+
+void lmemo_promote(lmemo* m, lheap* h) {
+    for (int i = 0; i < m->cap; i++) {
+        if (m->entries[i].args) {
+            m->entries[i].args = lval_promote(m->entries[i].args, h);
+            m->entries[i].result = lval_promote(m->entries[i].result, h);
+        }
+    }
+}
+
+// call visit with op on every argument list and result held by m
+void lmemo_children(lmemo* m, void (*visit)(lval*, int), int op) {
+    for (int i = 0; i < m->cap; i++) {
+        if (m->entries[i].args) {
+            visit(m->entries[i].args, op);
+            visit(m->entries[i].result, op);
+        }
+    }
+}
+
+int lmemo_max(lmemo* m) {
+    return m->max;
+}
+
+long lmemo_max_bytes(lmemo* m) {
+    return m->max_bytes;
+}
+
+// entry holding argument list a, which hashes to h, or -1
+static int lmemo_find(lmemo* m, lval* a, uint32_t h) {
+    if (!m->cap) { return -1; }
+    for (int i = m->buckets[h & (m->cap - 1)]; i >= 0; i = m->entries[i].chain) {
+        lmemo_entry* x = &m->entries[i];
+        if (x->hash == h && lval_eq(x->args, a)) { return i; }
+    }
+    return -1;
+}
+
+// take entry i out of the order of use
+static void lmemo_unlink(lmemo* m, int i) {
+    lmemo_entry* x = &m->entries[i];
+    if (x->newer >= 0) { m->entries[x->newer].older = x->older; } else { m->newest = x->older; }
+    if (x->older >= 0) { m->entries[x->older].newer = x->newer; } else { m->oldest = x->newer; }
+}
+
+// make entry i the most recently used
+static void lmemo_touch(lmemo* m, int i) {
+    lmemo_entry* x = &m->entries[i];
+    x->newer = -1;
+    x->older = m->newest;
+    if (m->newest >= 0) { m->entries[m->newest].newer = i; } else { m->oldest = i; }
+    m->newest = i;
+}
+
+// remove entry i, releasing its argument list and result
+static void lmemo_remove(lmemo* m, int i) {
+    lmemo_entry* x = &m->entries[i];
+    int* p = &m->buckets[x->hash & (m->cap - 1)];
+    while (*p != i) { p = &m->entries[*p].chain; }
+    *p = x->chain;
+    lmemo_unlink(m, i);
+
+    lval_del(x->args);
+    lval_del(x->result);
+    x->args = x->result = NULL;
+    x->chain = m->unused;
+    m->unused = i;
+    m->count--;
+    m->bytes -= x->bytes;
+}
+
+// double the entries and buckets of m, allocated from heap h
+static void lmemo_grow(lmemo* m, lheap* h) {
+    int cap = m->cap ? m->cap * 2 : 8;
+    lheap* prev = lalloc_switch(h);
+    m->entries = lrealloc(m->entries, sizeof(lmemo_entry) * m->cap,
+                          sizeof(lmemo_entry) * cap);
+    lfree(m->buckets, sizeof(int) * m->cap);
+    m->buckets = lalloc(sizeof(int) * cap);
+    lalloc_switch(prev);
+
+    for (int i = 0; i < cap; i++) { m->buckets[i] = -1; }
+    for (int i = 0; i < m->cap; i++) {
+        lmemo_entry* x = &m->entries[i];
+        if (!x->args) { continue; }
+        x->chain = m->buckets[x->hash & (cap - 1)];
+        m->buckets[x->hash & (cap - 1)] = i;
+    }
+    for (int i = cap - 1; i >= m->cap; i--) {
+        m->entries[i].args = m->entries[i].result = NULL;
+        m->entries[i].chain = m->unused;
+        m->unused = i;
+    }
+    m->cap = cap;
+}
+
+// cache result x of calling memo f with argument list a, which hashes to
+// h, evicting the least recently used entries to stay within its bounds.
+// Takes ownership of a
+static void lmemo_put(lval* f, lval* a, uint32_t h, lval* x) {
+    lmemo* m = f->memo;
+    long bytes = lval_bytes(a) + lval_bytes(x);
+    if (bytes > m->max_bytes) {
+        lval_del(a);
+        return;
+    }
+
+    // a call made while x was worked out may have added it already
+    int i = lmemo_find(m, a, h);
+    if (i >= 0) { lmemo_remove(m, i); }
+
+    while (m->count && (m->count >= m->max || m->bytes + bytes > m->max_bytes)) {
+        lmemo_remove(m, m->oldest);
+        m->evictions++;
+    }
+
+    // entries must live as long as the memo, so go in its heap
+    lheap* heap = lalloc_obj_heap(f);
+    if (m->unused < 0) { lmemo_grow(m, heap); }
+    x = lval_ref(x);
+    if (heap == &lheap_global && lheap_arena_depth > 0) {
+        a = lval_promote(a, heap);
+        x = lval_promote(x, heap);
+    }
+
+    i = m->unused;
+    lmemo_entry* y = &m->entries[i];
+    m->unused = y->chain;
+    y->args = a;
+    y->result = x;
+    y->hash = h;
+    y->bytes = bytes;
+    y->chain = m->buckets[h & (m->cap - 1)];
+    m->buckets[h & (m->cap - 1)] = i;
+    lmemo_touch(m, i);
+    m->count++;
+    m->bytes += bytes;
+}
+
+// construct memo of function fn, keeping at most max entries and
+// max_bytes bytes. Takes ownership of fn
+lval* lval_memo(lval* fn, int max, long max_bytes) {
+    lval* v = lval_new(LVAL_MEMO);
+    v->fn = fn;
+    v->memo = lmemo_new(max, max_bytes);
+    return v;
+}
+
+// call memo f with arguments a, consuming both. Only results that are not
+// errors are cached
+lval* lval_call(lenv* e, lval* f, lval* a);
+lval* lmemo_call(lenv* e, lval* f, lval* a) {
+    lmemo* m = f->memo;
+    uint32_t h = lval_hash(a);
+    int i = lmemo_find(m, a, h);
+    if (i >= 0) {
+        m->hits++;
+        lmemo_unlink(m, i);
+        lmemo_touch(m, i);
+        lval* x = lval_ref(m->entries[i].result);
+        lval_del(a);
+        lval_del(f);
+        return x;
+    }
+
+    // the call takes the argument list apart, so the key is a copy of it
+    m->misses++;
+    lval* key = lval_copy(a);
+    lval* x = lval_call(e, lval_ref(f->fn), a);
+    if (lval_type(x) != LVAL_ERR) {
+        lmemo_put(f, key, h, x);
+    } else {
+        lval_del(key);
+    }
+    lval_del(f);
+    return x;
+}
+
+/**
+ * Garbage collection
+ *
+ * Reference counting frees most values as soon as their last owner lets
+ * go. The collector is the backstop for what counting cannot see, such as
+ * cycles and references lost by an arena reset. It is a mark-and-sweep
+ * over the lval and lenv slabs of both heaps.
+ *
+ * Roots are the registered global environments plus every value owned
+ * from outside the heap, which covers everything held on the C stack by
+ * evaluations in progress. These are found without scanning the stack:
+ * once every reference held by a heap object is subtracted from the
+ * reference counts, only values with an outside owner are left positive.
+ */
+#define LGC_MIN_THRESHOLD 65536
+
+// what lgc_children does with each child of an object
+enum { LGC_CLEAR, LGC_SUBTRACT, LGC_RESTORE, LGC_MARK, LGC_RELEASE,
+       LGC_DROP_GLOBAL };
+
+// collector counters, reported by the gc-stats builtin. Times are in
+// microseconds.
+_Thread_local struct {
+    long collections;
+    long freed;
+    long live;
+    long pause_last;
+    long pause_max;
+    long pause_total;
+} lgc_stats;
+
+static _Thread_local lenv** lgc_roots = NULL;
+static _Thread_local int lgc_root_count = 0;
+static _Thread_local int lgc_root_cap = 0;
+
+// collect again once this many allocations have happened since the last
+static _Thread_local long lgc_threshold = LGC_MIN_THRESHOLD;
+static _Thread_local long lgc_last_allocs = 0;
+
+// objects found reachable but whose children have not been marked yet
+static _Thread_local void** lgc_stack = NULL;
+static _Thread_local int lgc_stack_count = 0;
+static _Thread_local int lgc_stack_cap = 0;
+
+// false if there is no memory for another root
+int lgc_add_root(lenv* e) {
+    if (lgc_root_count == lgc_root_cap) {
+        int cap = lgc_root_cap ? lgc_root_cap * 2 : 8;
+        lenv** roots = realloc(lgc_roots, sizeof(lenv*) * cap);
+        if (!roots) { return 0; }
+        lgc_roots = roots;
+        lgc_root_cap = cap;
+    }
+    lgc_roots[lgc_root_count++] = e;
+    return 1;
+}
+
+void lgc_remove_root(lenv* e) {
+    for (int i = 0; i < lgc_root_count; i++) {
+        if (lgc_roots[i] == e) {
+            lgc_roots[i] = lgc_roots[--lgc_root_count];
+            return;
+        }
+    }
+}
+
+// free the collector's own storage once this thread is done with it
+void lgc_release(void) {
+    free(lgc_stack);
+    lgc_stack = NULL;
+    lgc_stack_count = lgc_stack_cap = 0;
+    free(lgc_roots);
+    lgc_roots = NULL;
+    lgc_root_count = lgc_root_cap = 0;
+}
+
+static void lgc_push(void* p) {
+    if (lgc_stack_count == lgc_stack_cap) {
+        lgc_stack_cap = lgc_stack_cap ? lgc_stack_cap * 2 : 256;
+        lgc_stack = realloc(lgc_stack, sizeof(void*) * lgc_stack_cap);
+    }
+    lgc_stack[lgc_stack_count++] = p;
+}
+
+static int lgc_is_lenv(void* p) {
+    return *(unsigned char*)p == LENV_TYPE;
+}
+
+static void lgc_visit(lval* v, int op) {
+    if (lval_is_imm(v)) { return; }
+    switch (op) {
+        case LGC_SUBTRACT: v->refs--; break;
+        case LGC_RESTORE:  v->refs++; break;
+        case LGC_MARK:     if (!v->mark) { lgc_push(v); } break;
+        case LGC_RELEASE:  if (v->mark) { v->refs--; } break;
+        case LGC_DROP_GLOBAL:
+            if (lalloc_obj_heap(v) == &lheap_global) {
+                lval_del(v);
+            }
+            break;
+    }
+}
+
+lval* lcode_src(lcode* c);
+void lcode_free(lcode* c);
+
+// apply op to everything object p holds a reference to
+static void lgc_children(void* p, int op) {
+    if (lgc_is_lenv(p)) {
+        lenv* e = p;
+        if (op == LGC_CLEAR) { e->mark = 0; return; }
+        for (int i = 0; i < e->count; i++) { lgc_visit(e->vals[i], op); }
+        return;
+    }
+
+    lval* v = p;
+    if (op == LGC_CLEAR) { v->mark = 0; return; }
+    switch (v->type) {
+        case LVAL_FUN:
+            if (op == LGC_MARK && !v->env->mark) { lgc_push(v->env); }
+            lgc_visit(v->formals, op);
+            lgc_visit(v->body, op);
+            break;
+        case LVAL_MEMO:
+            lgc_visit(v->fn, op);
+            lmemo_children(v->memo, lgc_visit, op);
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (lval_is_slice(v)) {
+                lgc_visit(v->base, op);
+                break;
+            }
+            for (int i = 0; i < v->count; i++) { lgc_visit(v->cell[i], op); }
+            if (v->code && lcode_src(v->code)) {
+                lgc_visit(lcode_src(v->code), op);
+            }
+            break;
+        case LVAL_VEC:
+        case LVAL_MAP:
+            if (v->root) { lgc_visit(v->root, op); }
+            break;
+        case LVAL_NODE:
+            for (int i = 0; i < v->width; i++) { lgc_visit(v->kids[i], op); }
+            break;
+        // the values held by tasks and channels are not followed, so are
+        // roots for as long as a handle keeps them
+        case LVAL_FUTURE:
+            if (op == LGC_DROP_GLOBAL) { ltask_unref(v->task); }
+            break;
+        case LVAL_CHAN:
+            if (op == LGC_DROP_GLOBAL) { lchan_unref(v->chan); }
+            break;
+    }
+}
+
+// call fn on every object in the lval and lenv slabs of heap h
+static void lgc_each_in(lheap* h, void (*fn)(void*, int), int op) {
+    int kinds[] = { LKIND_LVAL, LKIND_LENV };
+    size_t sizes[] = { lalloc_slot_size(sizeof(lval)),
+                       lalloc_slot_size(sizeof(lenv)) };
+    for (int k = 0; k < 2; k++) {
+        int kind = kinds[k];
+        for (lslab* s = h->slabs[kind]; s; s = s->next) {
+            // only the newest slab can be partly carved
+            char* end = (s == h->slabs[kind])
+                ? h->bump[kind] : (char*)s + LSLAB_SIZE;
+            for (char* p = (char*)s + LSLAB_HEADER;
+                 p + sizes[k] <= end; p += sizes[k]) {
+                if (*(unsigned char*)p != LOBJ_FREE) { fn(p, op); }
+            }
+        }
+    }
+}
+
+static void lgc_each(void (*fn)(void*, int), int op) {
+    lgc_each_in(&lheap_global, fn, op);
+    lgc_each_in(&lheap_arena, fn, op);
+}
+
+// objects still referenced once heap references are subtracted are roots
+static void lgc_find_root(void* p, int op) {
+    if (!lgc_is_lenv(p) && ((lval*)p)->refs > 0) { lgc_push(p); }
+}
+
+// free an unreachable object without following its references, since
+// its children are either unreachable too or survive the collection
+static void lgc_sweep(void* p, int op) {
+    if (lgc_is_lenv(p)) {
+        lenv* e = p;
+        if (e->mark) { return; }
+        lgc_children(e, LGC_RELEASE);
+        lfree(e->syms, sizeof(lval*) * e->cap);
+        lfree(e->vals, sizeof(lval*) * e->cap);
+        lfree(e->index, sizeof(int) * e->icap);
+        lfree_obj(e, sizeof(lenv));
+    } else {
+        lval* v = p;
+        if (v->mark) { lgc_stats.live++; return; }
+        lgc_children(v, LGC_RELEASE);
+        switch (v->type) {
+            case LVAL_ERR: lstrfree(v->err); break;
+            case LVAL_STR: lstrfree(v->str); break;
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                if (lval_is_slice(v)) { break; }
+                lfree(v->cell, sizeof(lval*) * v->cap);
+                lcode_free(v->code);
+                break;
+            case LVAL_NODE: lfree(v->kids, sizeof(lval*) * v->width); break;
+            case LVAL_BIG: lfree(v->digits, sizeof(uint32_t) * v->limbs); break;
+            case LVAL_MEMO: lmemo_free(v->memo); break;
+            case LVAL_FUTURE: ltask_unref(v->task); break;
+            case LVAL_CHAN: lchan_unref(v->chan); break;
+        }
+        lfree_obj(v, sizeof(lval));
+    }
+    lgc_stats.freed++;
+}
+
+// run a full collection, returning the number of objects freed
+long lgc_collect(void) {
+    struct timespec start, end;
+    timespec_get(&start, TIME_UTC);
+    long freed = lgc_stats.freed;
+
+    // find roots
+    lgc_each(lgc_children, LGC_CLEAR);
+    lgc_each(lgc_children, LGC_SUBTRACT);
+    lgc_each(lgc_find_root, 0);
+    for (int i = 0; i < lgc_root_count; i++) { lgc_push(lgc_roots[i]); }
+
+    // mark everything reachable from them
+    while (lgc_stack_count) {
+        void* p = lgc_stack[--lgc_stack_count];
+        unsigned char* mark = lgc_is_lenv(p) ? &((lenv*)p)->mark
+                                              : &((lval*)p)->mark;
+        if (*mark) { continue; }
+        *mark = 1;
+        lgc_children(p, LGC_MARK);
+    }
+
+    // put counts back and sweep
+    lgc_each(lgc_children, LGC_RESTORE);
+    lgc_stats.live = 0;
+    lgc_each(lgc_sweep, 0);
+
+    // pace collections by the size of the surviving heap
+    lgc_last_allocs = lalloc_stats.allocs;
+    lgc_threshold = lgc_stats.live * 2 > LGC_MIN_THRESHOLD
+        ? lgc_stats.live * 2 : LGC_MIN_THRESHOLD;
+
+    timespec_get(&end, TIME_UTC);
+    long pause = (end.tv_sec - start.tv_sec) * 1000000
+               + (end.tv_nsec - start.tv_nsec) / 1000;
+    lgc_stats.collections++;
+    lgc_stats.pause_last = pause;
+    lgc_stats.pause_total += pause;
+    if (pause > lgc_stats.pause_max) { lgc_stats.pause_max = pause; }
+
+    return lgc_stats.freed - freed;
+}
+
+void lgc_maybe_collect(void) {
+    if (lalloc_stats.allocs - lgc_last_allocs > lgc_threshold) {
+        lgc_collect();
+    }
+}
+
+// drop the references leaked arena objects hold into the global heap,
+// just before the arena is reset underneath them
+void lgc_release_arena(void) {
+    lgc_each_in(&lheap_arena, lgc_children, LGC_DROP_GLOBAL);
+}
+
+/**
+ * Images
+ *
+ * The global environment can be dumped to an image file and restored at
+ * startup, which skips reading and evaluating a prelude. An image is a
+ * header followed by flat arrays:
+ *   syms  - the name of every symbol used, numbered in the order first met
+ *   funs  - the name of every builtin used, numbered likewise
+ *   objs  - one record per heap lval, numbered in the order first reached
+ *   refs  - the cells of every list
+ *   binds - symbol and value pairs, the env's first and then those of
+ *           each lambda's env
+ *   strs  - the characters of names, strings and errors
+ * Values are stored as they are tagged in an lval*. Symbols and builtins
+ * hold their number in the image in place of their index, other
+ * immediates are kept as they are, and a heap lval is stored as its number
+ * in objs shifted past the tag bits, so it too has a clear tag. Restoring
+ * maps the file, allocates every object and then fixes each reference up
+ * to the new lval, renumbering symbols and builtins by name.
+ *
+ * Besides the bindings an image carries a single root value, which lets
+ * images also pass values between threads.
+ */
+#define LIMG_MAGIC "LISPYIMG"
+#define LIMG_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t word;     // sizeof(long), as images are not portable between ABIs
+    uint32_t nsyms;
+    uint32_t nfuns;
+    uint32_t nobjs;
+    uint32_t nrefs;
+    uint32_t nbinds;
+    uint32_t nglobals; // bindings of the global env at the start of binds
+    uint64_t nstrs;
+    uint64_t root;
+} limg_header;
+
+// name of a symbol or builtin in strs
+typedef struct {
+    uint32_t off;
+    uint32_t len;
+} limg_name;
+
+// heap lval. count and a are the length and start of a string in strs,
+// of cells or node kids in refs or of a lambda's bindings in binds, or a
+// boxed number is held in a. A lambda's formals and body are in b and c.
+// A vector or map has its size in count, shift in a and root in b, and a
+// node its bitmaps in b. A float's bits are in a, and a bignum's limbs are
+// in strs like a string's characters, with b set if it is negative. A
+// memoized function has the function in b and its bounds in a and c, and
+// its cache is left out.
+typedef struct {
+    uint32_t type;
+    uint32_t count;
+    uint64_t a;
+    uint64_t b;
+    uint64_t c;
+} limg_obj;
+
+// numbers given to symbols or builtins in an image. map holds the number
+// + 1 of each index, zero marking those not used yet, and ids the index of
+// each number
+typedef struct {
+    uint32_t* map;
+    uint32_t map_cap;
+    int* ids;
+    uint32_t n, cap;
+} limg_names;
+
+typedef struct {
+    limg_obj* objs;
+    uint64_t* refs;
+    uint64_t* binds;
+    char* strs;
+    uint32_t nobjs, nrefs, nbinds;
+    uint64_t nstrs;
+    uint32_t objs_cap, refs_cap, binds_cap;
+    uint64_t strs_cap;
+
+    // numbers given to the lvals already written, by address
+    lval** seen;
+    uint32_t* seen_num;
+    uint32_t seen_cap;
+
+    limg_names syms;
+    limg_names funs;
+
+    // why the first value that can not be saved could not be
+    char* err;
+} limg_writer;
+
+static void* limg_grow(void* p, uint32_t* cap, uint64_t n, size_t size) {
+    if (n <= *cap) { return p; }
+    while (*cap < n) { *cap = *cap ? *cap * 2 : 256; }
+    return realloc(p, size * *cap);
+}
+
+static uint64_t limg_add_str(limg_writer* w, char* s, uint32_t len) {
+    if (w->nstrs + len > w->strs_cap) {
+        while (w->strs_cap < w->nstrs + len) {
+            w->strs_cap = w->strs_cap ? w->strs_cap * 2 : 4096;
+        }
+        w->strs = realloc(w->strs, w->strs_cap);
+    }
+    uint64_t off = w->nstrs;
+    memcpy(w->strs + off, s, len);
+    w->nstrs += len;
+    return off;
+}
+
+// number given to v, or -1 with the place to record it in *pos
+static int64_t limg_seen(limg_writer* w, lval* v, uint32_t* pos) {
+    uint32_t mask = w->seen_cap - 1;
+    uint32_t i = ((uintptr_t)v >> 4) * 2654435761U & mask;
+    while (w->seen[i]) {
+        if (w->seen[i] == v) { return w->seen_num[i]; }
+        i = (i + 1) & mask;
+    }
+    *pos = i;
+    return -1;
+}
+
+static void limg_see(limg_writer* w, lval* v, uint32_t pos, uint32_t num) {
+    w->seen[pos] = v;
+    w->seen_num[pos] = num;
+
+    // keep the table at most half full
+    if (w->nobjs * 2 <= w->seen_cap) { return; }
+    lval** seen = w->seen;
+    uint32_t* seen_num = w->seen_num;
+    uint32_t cap = w->seen_cap;
+    w->seen_cap *= 2;
+    w->seen = calloc(w->seen_cap, sizeof(lval*));
+    w->seen_num = malloc(sizeof(uint32_t) * w->seen_cap);
+    for (uint32_t i = 0; i < cap; i++) {
+        if (seen[i]) {
+            limg_seen(w, seen[i], &pos);
+            w->seen[pos] = seen[i];
+            w->seen_num[pos] = seen_num[i];
+        }
+    }
+    free(seen);
+    free(seen_num);
+}
+
+// number in the image of symbol or builtin index id, numbering it if it
+// is new
+static uint64_t limg_number(limg_names* t, int id) {
+    if ((uint32_t)id >= t->map_cap) {
+        uint32_t cap = t->map_cap;
+        t->map = limg_grow(t->map, &t->map_cap, (uint64_t)id + 1,
+                           sizeof(uint32_t));
+        memset(t->map + cap, 0, sizeof(uint32_t) * (t->map_cap - cap));
+    }
+    if (!t->map[id]) {
+        t->ids = limg_grow(t->ids, &t->cap, t->n + 1, sizeof(int));
+        t->ids[t->n++] = id;
+        t->map[id] = t->n;
+    }
+    return t->map[id] - 1;
+}
+
+static uint64_t limg_write_imm(limg_writer* w, lval* v) {
+    switch ((uintptr_t)v & LVAL_TAG_MASK) {
+        case LVAL_TAG_BUILTIN:
+            return limg_number(&w->funs, (uintptr_t)v >> 3) << 3 |
+                   LVAL_TAG_BUILTIN;
+        case LVAL_TAG_SYM:
+            return limg_number(&w->syms, lsym_id(v)) << 3 | LVAL_TAG_SYM;
+        case LVAL_TAG_LOCAL:
+            return limg_number(&w->syms, lsym_id(v)) << (LSYM_SLOT_BITS + 3) |
+                   (uint64_t)lsym_slot(v) << 3 | LVAL_TAG_LOCAL;
+        default:
+            return (uintptr_t)v;
+    }
+}
+
+static uint64_t limg_write_val(limg_writer* w, lval* v);
+
+// write the bindings of e into the n pairs of binds starting at at
+static void limg_write_env(limg_writer* w, lenv* e, uint32_t at) {
+    for (int i = 0; i < e->count; i++) {
+        w->binds[at + i * 2] = limg_write_imm(w, e->syms[i]);
+        uint64_t x = limg_write_val(w, e->vals[i]);
+        w->binds[at + i * 2 + 1] = x;
+    }
+}
+
+static uint64_t limg_write_val(limg_writer* w, lval* v) {
+    if (lval_is_imm(v)) { return limg_write_imm(w, v); }
+
+    uint32_t pos;
+    int64_t seen = limg_seen(w, v, &pos);
+    if (seen >= 0) { return (uint64_t)seen << 3; }
+
+    // number v before writing its children, which may refer back to it
+    uint32_t num = w->nobjs++;
+    w->objs = limg_grow(w->objs, &w->objs_cap, w->nobjs, sizeof(limg_obj));
+    limg_see(w, v, pos, num);
+
+    limg_obj o = { v->type, 0, 0, 0, 0 };
+    switch (v->type) {
+        case LVAL_NUM: o.a = (uint64_t)v->num; break;
+        case LVAL_DBL: memcpy(&o.a, &v->dbl, sizeof(o.a)); break;
+        case LVAL_BIG:
+            o.count = v->limbs;
+            o.a = limg_add_str(w, (char*)v->digits, sizeof(uint32_t) * o.count);
+            o.b = v->sign < 0;
+            break;
+        case LVAL_ERR:
+        case LVAL_STR: {
+            char* str = v->type == LVAL_ERR ? v->err : v->str;
+            o.count = strlen(str);
+            o.a = limg_add_str(w, str, o.count);
+            break;
+        }
+        // tasks and channels belong to the thread that made them, so an
+        // error is saved in their place and noted for the caller
+        case LVAL_FUTURE:
+        case LVAL_CHAN: {
+            char* err = lval_type(v) == LVAL_FUTURE
+                ? "Futures can not be saved in an image."
+                : "Channels can not be saved in an image.";
+            if (!w->err) { w->err = err; }
+            o.type = LVAL_ERR;
+            o.count = strlen(err);
+            o.a = limg_add_str(w, err, o.count);
+            break;
+        }
+        case LVAL_FUN:
+            o.count = v->env->count;
+            o.a = w->nbinds;
+            w->nbinds += o.count * 2;
+            w->binds = limg_grow(w->binds, &w->binds_cap, w->nbinds,
+                                 sizeof(uint64_t));
+            limg_write_env(w, v->env, o.a);
+            o.b = limg_write_val(w, v->formals);
+            o.c = limg_write_val(w, v->body);
+            break;
+        case LVAL_MEMO:
+            o.a = lmemo_max(v->memo);
+            o.b = limg_write_val(w, v->fn);
+            o.c = lmemo_max_bytes(v->memo);
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            o.count = v->count;
+            o.a = w->nrefs;
+            w->nrefs += o.count;
+            w->refs = limg_grow(w->refs, &w->refs_cap, w->nrefs,
+                                sizeof(uint64_t));
+            for (uint32_t i = 0; i < o.count; i++) {
+                uint64_t x = limg_write_val(w, v->cell[i]);
+                w->refs[o.a + i] = x;
+            }
+            break;
+        case LVAL_VEC:
+        case LVAL_MAP:
+            o.count = v->size;
+            o.a = v->shift;
+            if (v->root) { o.b = limg_write_val(w, v->root); }
+            break;
+        case LVAL_NODE:
+            o.count = v->width;
+            o.a = w->nrefs;
+            o.b = v->datamap | (uint64_t)v->nodemap << 32;
+            w->nrefs += o.count;
+            w->refs = limg_grow(w->refs, &w->refs_cap, w->nrefs,
+                                sizeof(uint64_t));
+            for (uint32_t i = 0; i < o.count; i++) {
+                uint64_t x = limg_write_val(w, v->kids[i]);
+                w->refs[o.a + i] = x;
+            }
+            break;
+    }
+    w->objs[num] = o;
+    return (uint64_t)num << 3;
+}
+
+// add name s to strs, filling in where it is in m
+static void limg_add_name(limg_writer* w, limg_name* m, char* s) {
+    if (!s) { s = ""; }
+    m->len = strlen(s);
+    m->off = limg_add_str(w, s, m->len);
+}
+
+// true if the binding of k in env b is the one seen from env e
+static int limg_visible(lenv* e, lenv* b, lval* k) {
+    int slot;
+    return lenv_find(e, k, &slot) == b;
+}
+
+// image of the bindings seen from env e, the global env's and those of
+// any frames it is in, and of value x, in a buffer of *size bytes that
+// the caller frees. Values that can not be saved are saved as errors, and
+// if err is given the first such error is put there, or NULL if none
+static char* limg_write(lenv* e, lval* x, size_t* size, char** err) {
+    limg_writer w = { 0 };
+    w.seen_cap = 256;
+    w.seen = calloc(w.seen_cap, sizeof(lval*));
+    w.seen_num = malloc(sizeof(uint32_t) * w.seen_cap);
+
+    // the bindings come first, ahead of any their values add
+    uint32_t nglobals = 0;
+    for (lenv* b = e; b; b = b->par) {
+        for (int i = 0; i < b->count; i++) {
+            if (limg_visible(e, b, b->syms[i])) { nglobals += 2; }
+        }
+    }
+    w.nbinds = nglobals;
+    w.binds = limg_grow(NULL, &w.binds_cap, w.nbinds, sizeof(uint64_t));
+    uint32_t at = 0;
+    for (lenv* b = e; b; b = b->par) {
+        for (int i = 0; i < b->count; i++) {
+            if (!limg_visible(e, b, b->syms[i])) { continue; }
+            w.binds[at++] = limg_write_imm(&w, b->syms[i]);
+            uint64_t v = limg_write_val(&w, b->vals[i]);
+            w.binds[at++] = v;
+        }
+    }
+    uint64_t root = limg_write_val(&w, x);
+
+    // names go last, once every one in use is known
+    limg_name* syms = malloc(sizeof(limg_name) * (w.syms.n + 1));
+    for (uint32_t i = 0; i < w.syms.n; i++) {
+        limg_add_name(&w, &syms[i], lsym_name_of(w.syms.ids[i]));
+    }
+    limg_name* funs = malloc(sizeof(limg_name) * (w.funs.n + 1));
+    pthread_mutex_lock(&lbuiltin_lock);
+    for (uint32_t i = 0; i < w.funs.n; i++) {
+        limg_add_name(&w, &funs[i], lbuiltin_names[w.funs.ids[i]]);
+    }
+    pthread_mutex_unlock(&lbuiltin_lock);
+
+    limg_header h = { LIMG_MAGIC, LIMG_VERSION, sizeof(long), w.syms.n,
+                      w.funs.n, w.nobjs, w.nrefs, w.nbinds, nglobals,
+                      w.nstrs, root };
+    size_t parts[] = { sizeof(limg_header), sizeof(limg_name) * h.nsyms,
+                       sizeof(limg_name) * h.nfuns, sizeof(limg_obj) * h.nobjs,
+                       sizeof(uint64_t) * h.nrefs, sizeof(uint64_t) * h.nbinds,
+                       h.nstrs };
+    void* srcs[] = { &h, syms, funs, w.objs, w.refs, w.binds, w.strs };
+    *size = 0;
+    for (int i = 0; i < 7; i++) { *size += parts[i]; }
+    char* data = malloc(*size);
+    char* p = data;
+    for (int i = 0; i < 7; i++) {
+        if (parts[i]) { memcpy(p, srcs[i], parts[i]); }
+        p += parts[i];
+    }
+
+    free(syms);
+    free(funs);
+    free(w.objs);
+    free(w.refs);
+    free(w.binds);
+    free(w.strs);
+    free(w.seen);
+    free(w.seen_num);
+    free(w.syms.map);
+    free(w.syms.ids);
+    free(w.funs.map);
+    free(w.funs.ids);
+    if (err) { *err = w.err; }
+    return data;
+}
+
+// dump the bindings of env e to an image file called name, leaving any
+// file there as it was if some of them can not be saved
+lval* lenv_dump(lenv* e, const char* name) {
+    size_t size;
+    char* err;
+    char* data = limg_write(e, lval_num(0), &size, &err);
+    if (err) {
+        free(data);
+        return lval_err("%s", err);
+    }
+
+    FILE* f = fopen(name, "wb");
+    if (!f) {
+        free(data);
+        return lval_err("%s: error: Unable to open file!", name);
+    }
+    fwrite(data, 1, size, f);
+    free(data);
+
+    int failed = ferror(f);
+    if (fclose(f) != 0 || failed) {
+        return lval_err("%s: error: Unable to write image!", name);
+    }
+    return NULL;
+}
+
+typedef struct {
+    limg_header* h;
+    limg_name* syms;
+    limg_name* funs;
+    limg_obj* objs;
+    uint64_t* refs;
+    uint64_t* binds;
+    char* strs;
+    lval** sym_map; // symbol in this process of each symbol in the image
+    lval** fun_map; // builtin of each builtin in the image, or NULL
+    lval** vals;    // restored lval of each object
+} limg_reader;
+
+// true if the stored value x refers to something in the image
+static int limg_valid(limg_reader* r, uint64_t x) {
+    switch (x & LVAL_TAG_MASK) {
+        case 0:                return (x >> 3) < r->h->nobjs;
+        case LVAL_TAG_BUILTIN: return (x >> 3) < r->h->nfuns && r->fun_map[x >> 3];
+        case LVAL_TAG_SYM:     return (x >> 3) < r->h->nsyms;
+        case LVAL_TAG_LOCAL:   return (x >> (LSYM_SLOT_BITS + 3)) < r->h->nsyms;
+        default:               return 1;
+    }
+}
+
+// true if x is an object of the image of type t, or a list if t is a
+// Q-Expression
+static int limg_valid_obj(limg_reader* r, uint64_t x, uint32_t t) {
+    if ((x & LVAL_TAG_MASK) != 0 || (x >> 3) >= r->h->nobjs) { return 0; }
+    uint32_t type = r->objs[x >> 3].type;
+    return type == t || (t == LVAL_QEXPR && type == LVAL_SEXPR);
+}
+
+// check that every reference in the image is in bounds, so restoring it
+// can go ahead without checking anything
+static int limg_check(limg_reader* r) {
+    limg_header* h = r->h;
+    for (uint32_t i = 0; i < h->nobjs; i++) {
+        limg_obj* o = &r->objs[i];
+        switch (o->type) {
+            case LVAL_NUM: break;
+            case LVAL_DBL: break;
+            case LVAL_BIG:
+                if (o->a > h->nstrs || o->count > (h->nstrs - o->a) / 4) { return 0; }
+                break;
+            case LVAL_ERR:
+            case LVAL_STR:
+                if (o->a > h->nstrs || o->count > h->nstrs - o->a) { return 0; }
+                break;
+            case LVAL_FUN:
+                if (o->a > h->nbinds || o->count > (h->nbinds - o->a) / 2) { return 0; }
+                if (!limg_valid_obj(r, o->b, LVAL_QEXPR) ||
+                    !limg_valid_obj(r, o->c, LVAL_QEXPR)) { return 0; }
+                break;
+            case LVAL_MEMO:
+                if (o->a < 1 || o->a > INT_MAX || o->c < 1 || o->c > LONG_MAX) {
+                    return 0;
+                }
+                if ((o->b & LVAL_TAG_MASK) == LVAL_TAG_BUILTIN
+                    ? !limg_valid(r, o->b)
+                    : !limg_valid_obj(r, o->b, LVAL_FUN) &&
+                      !limg_valid_obj(r, o->b, LVAL_MEMO)) { return 0; }
+                break;
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+            case LVAL_NODE:
+                if (o->a > h->nrefs || o->count > h->nrefs - o->a) { return 0; }
+                break;
+            case LVAL_VEC:
+            case LVAL_MAP:
+                if (o->count > INT_MAX || o->a > LTRIE_HASH_BITS) { return 0; }
+                if (o->count && !limg_valid_obj(r, o->b, LVAL_NODE)) { return 0; }
+                break;
+            default: return 0;
+        }
+    }
+    for (uint32_t i = 0; i < h->nrefs; i++) {
+        if (!limg_valid(r, r->refs[i])) { return 0; }
+    }
+    for (uint32_t i = 0; i < h->nbinds; i += 2) {
+        if ((r->binds[i] & LVAL_TAG_MASK) != LVAL_TAG_SYM) { return 0; }
+        if (!limg_valid(r, r->binds[i]) || !limg_valid(r, r->binds[i + 1])) {
+            return 0;
+        }
+    }
+    return h->nglobals <= h->nbinds && limg_valid(r, h->root);
+}
+
+// the lval for stored value x, adding a reference to heap lvals
+static lval* limg_val(limg_reader* r, uint64_t x) {
+    switch (x & LVAL_TAG_MASK) {
+        case 0: {
+            lval* v = r->vals[x >> 3];
+            v->refs++;
+            return v;
+        }
+        case LVAL_TAG_BUILTIN: return r->fun_map[x >> 3];
+        case LVAL_TAG_SYM:     return r->sym_map[x >> 3];
+        case LVAL_TAG_LOCAL:
+            return lsym_local(r->sym_map[x >> (LSYM_SLOT_BITS + 3)],
+                              (x >> 3) & LSYM_SLOT_MAX);
+        default:               return (lval*)(uintptr_t)x;
+    }
+}
+
+// bind the n pairs of stored symbols and values at binds in e
+static void limg_bind(limg_reader* r, lenv* e, uint64_t* binds, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        lval* v = limg_val(r, binds[i * 2 + 1]);
+        lenv_put(e, limg_val(r, binds[i * 2]), v);
+        lval_del(v);
+    }
+}
+
+// restore the size bytes of image data, binding its bindings in e if it is
+// given and setting *root to its root value if root is. Without an env,
+// values are allocated from the current heap
+static lval* limg_restore(lenv* e, const char* name, char* data, size_t size,
+                          lval** root) {
+    limg_reader r = { (limg_header*)data };
+    limg_header* h = r.h;
+    if (size < sizeof(limg_header) ||
+        memcmp(h->magic, LIMG_MAGIC, sizeof(h->magic)) != 0) {
+        return lval_err("%s: error: Not an image!", name);
+    }
+    if (h->version != LIMG_VERSION || h->word != sizeof(long)) {
+        return lval_err("%s: error: Image made by another version!", name);
+    }
+
+    // the arrays follow the header in order, each 8-byte aligned
+    uint64_t arrays = sizeof(limg_name) * ((uint64_t)h->nsyms + h->nfuns) +
+                      sizeof(limg_obj) * (uint64_t)h->nobjs +
+                      sizeof(uint64_t) * ((uint64_t)h->nrefs + h->nbinds);
+    if (size - sizeof(limg_header) < arrays ||
+        size - sizeof(limg_header) - arrays != h->nstrs || h->nbinds % 2) {
+        return lval_err("%s: error: Image is corrupt!", name);
+    }
+    r.syms = (limg_name*)(h + 1);
+    r.funs = r.syms + h->nsyms;
+    r.objs = (limg_obj*)(r.funs + h->nfuns);
+    r.refs = (uint64_t*)(r.objs + h->nobjs);
+    r.binds = r.refs + h->nrefs;
+    r.strs = (char*)(r.binds + h->nbinds);
+    for (uint32_t i = 0; i < h->nsyms + h->nfuns; i++) {
+        if ((uint64_t)r.syms[i].off + r.syms[i].len > h->nstrs) {
+            return lval_err("%s: error: Image is corrupt!", name);
+        }
+    }
+
+    // symbols and builtins are renumbered by name
+    r.sym_map = malloc(sizeof(lval*) * h->nsyms);
+    for (uint32_t i = 0; i < h->nsyms; i++) {
+        r.sym_map[i] = lval_sym_n(r.strs + r.syms[i].off, r.syms[i].len);
+        if (!r.sym_map[i]) {
+            free(r.sym_map);
+            return lval_err("%s: error: Too many symbols!", name);
+        }
+    }
+    r.fun_map = malloc(sizeof(lval*) * h->nfuns);
+    pthread_mutex_lock(&lbuiltin_lock);
+    for (uint32_t i = 0; i < h->nfuns; i++) {
+        r.fun_map[i] = NULL;
+        for (int j = 0; j < lbuiltin_count; j++) {
+            char* n = lbuiltin_names[j];
+            if (n && strlen(n) == r.funs[i].len &&
+                memcmp(n, r.strs + r.funs[i].off, r.funs[i].len) == 0) {
+                r.fun_map[i] = (lval*)(((uintptr_t)j << 3) | LVAL_TAG_BUILTIN);
+            }
+        }
+    }
+    pthread_mutex_unlock(&lbuiltin_lock);
+
+    lval* err = NULL;
+    if (!limg_check(&r)) {
+        err = lval_err("%s: error: Image is corrupt!", name);
+    } else {
+        lheap* prev = lalloc_switch(e ? &lheap_global : lheap_cur);
+
+        // allocate every object before any reference to one is fixed up.
+        // References are counted as they are
+        r.vals = malloc(sizeof(lval*) * h->nobjs);
+        for (uint32_t i = 0; i < h->nobjs; i++) {
+            r.vals[i] = lval_new(r.objs[i].type);
+            r.vals[i]->refs = 0;
+        }
+        for (uint32_t i = 0; i < h->nobjs; i++) {
+            limg_obj* o = &r.objs[i];
+            lval* v = r.vals[i];
+            switch (o->type) {
+                case LVAL_NUM: v->num = (long)o->a; break;
+                case LVAL_DBL: memcpy(&v->dbl, &o->a, sizeof(v->dbl)); break;
+                case LVAL_BIG:
+                    v->limbs = o->count;
+                    v->sign = o->b ? -1 : 1;
+                    v->digits = lalloc(sizeof(uint32_t) * o->count);
+                    memcpy(v->digits, r.strs + o->a, sizeof(uint32_t) * o->count);
+                    break;
+                case LVAL_ERR:
+                case LVAL_STR: {
+                    char* s = lalloc(o->count + 1);
+                    memcpy(s, r.strs + o->a, o->count);
+                    s[o->count] = '\0';
+                    if (o->type == LVAL_ERR) { v->err = s; } else { v->str = s; }
+                    break;
+                }
+                case LVAL_FUN:
+                    v->env = lenv_frame(o->count);
+                    v->formals = limg_val(&r, o->b);
+                    v->body = limg_val(&r, o->c);
+                    limg_bind(&r, v->env, r.binds + o->a, o->count);
+                    break;
+                case LVAL_MEMO:
+                    v->fn = limg_val(&r, o->b);
+                    v->memo = lmemo_new(o->a, o->c);
+                    break;
+                case LVAL_SEXPR:
+                case LVAL_QEXPR:
+                    v->count = o->count;
+                    v->cap = o->count;
+                    v->cell = lalloc(sizeof(lval*) * o->count);
+                    v->code = NULL;
+                    for (uint32_t j = 0; j < o->count; j++) {
+                        v->cell[j] = limg_val(&r, r.refs[o->a + j]);
+                    }
+                    break;
+                case LVAL_VEC:
+                case LVAL_MAP:
+                    v->size = o->count;
+                    v->shift = o->a;
+                    v->root = o->count ? limg_val(&r, o->b) : NULL;
+                    break;
+                case LVAL_NODE:
+                    v->width = o->count;
+                    v->datamap = (uint32_t)o->b;
+                    v->nodemap = (uint32_t)(o->b >> 32);
+                    v->kids = lalloc(sizeof(lval*) * o->count);
+                    for (uint32_t j = 0; j < o->count; j++) {
+                        v->kids[j] = limg_val(&r, r.refs[o->a + j]);
+                    }
+                    break;
+            }
+        }
+        if (e) { limg_bind(&r, e, r.binds, h->nglobals / 2); }
+        if (root) { *root = limg_val(&r, h->root); }
+
+        lalloc_switch(prev);
+        free(r.vals);
+    }
+
+    free(r.sym_map);
+    free(r.fun_map);
+    return err;
+}
+
+// restore the bindings in the image file called name into env e
+lval* lenv_restore(lenv* e, const char* name) {
+    FILE* f = fopen(name, "rb");
+    if (!f) { return lval_err("%s: error: Unable to open file!", name); }
+
+#ifndef _WIN32
+    // images are mapped and read in place
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0 && st.st_size > 0) {
+        char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                          fileno(f), 0);
+        if (data != MAP_FAILED) {
+            fclose(f);
+            lval* err = limg_restore(e, name, data, st.st_size, NULL);
+            munmap(data, st.st_size);
+            return err;
+        }
+    }
+#endif
+
+    // otherwise read the whole file, keeping it 8-byte aligned
+    size_t size = 0, cap = 65536;
+    char* data = malloc(cap);
+    size_t n;
+    while ((n = fread(data + size, 1, cap - size, f)) > 0) {
+        size += n;
+        if (size == cap) { data = realloc(data, cap *= 2); }
+    }
+    fclose(f);
+    lval* err = limg_restore(e, name, data, size, NULL);
+    free(data);
+    return err;
+}
+
+/**
+ * builtin functions
+ */
+
+lval* builtin_head(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("head", a, 1);
+    LASSERT_ARG_TYPE("head", a, 0, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY("head", a, 0);
+
+    lval* v = lval_take(a, 0); // take the first arg (a qexpr)
+    lval* x = lval_add(lval_qexpr(), lval_ref(v->cell[0])); // share head
+    lval_del(v);
+    return x;
+}
+
+lval* builtin_tail(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("tail", a, 1);
+    LASSERT_ARG_TYPE("tail", a, 0, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY("tail", a, 0);
+
+    lval* v = lval_take(a, 0); // take the first arg (a qexpr)
+    lval* x = lval_slice(v, 1, v->count - 1); // share all but the head
+    lval_del(v);
+    return x;
+}
+
+lval* builtin_list(lenv* e, lval* a) {
+    a->type = LVAL_QEXPR;
+    return a;
+}
+
+// append the items of y to x, which must not be shared, consuming y
+lval* lval_join(lval* x, lval* y) {
+    lval_reserve(x, x->count + y->count);
+
+    // a list held by no one else gives up its items instead of sharing them
+    if (y->refs == 1 && !lval_is_slice(y)) {
+        if (y->count) {
+            memcpy(x->cell + x->count, y->cell, sizeof(lval*) * y->count);
+        }
+        x->count += y->count;
+        y->count = 0;
+    } else {
+        for (int i = 0; i < y->count; i++) {
+            x->cell[x->count++] = lval_ref(y->cell[i]);
+        }
+    }
+    lval_del(y);
+    return x;
+}
+
+lval* lval_eval(lenv* e, lval* v);
+
+/*
+ * Calls in tail position of a function body don't run the function they
+ * call. Instead the caller's lval_run is handed the function through
+ * ltail_fun and loops to run it, so tail calls use no C stack.
+ *
+ * ltail is set just before evaluating something in tail position, and
+ * taken straight away by what is evaluated. Only if and eval pass it on.
+ */
+static _Thread_local int ltail = 0;
+static _Thread_local lval* ltail_fun = NULL;
+static _Thread_local lenv* ltail_env = NULL;
+
+// returned in place of a result when a tail call is pending
+static lval ltail_pending;
+#define LVAL_TAIL (&ltail_pending)
+
+static inline int ltail_take(void) {
+    int tail = ltail;
+    ltail = 0;
+    return tail;
+}
+
+lval* builtin_eval(lenv* e, lval* a) {
+    int tail = ltail_take();
+    LASSERT_NUM_ARGS("eval", a, 1);
+    LASSERT_ARG_TYPE("eval", a, 0, LVAL_QEXPR);
+
+    lval* x = lval_own(lval_take(a, 0));
+    x->type = LVAL_SEXPR;
+    ltail = tail;
+    return lval_eval(e, x);
+}
+
+lval* builtin_join(lenv* e, lval* a) {
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_ARG_TYPE("join", a, i, LVAL_QEXPR);
+    }
+
+    lval* x = lval_own(lval_pop(a, 0));
+
+    // make room for every list up front
+    int count = x->count;
+    for (int i = 0; i < a->count; i++) { count += a->cell[i]->count; }
+    lval_reserve(x, count);
+
+    while(a->count) {
+        x = lval_join(x, lval_pop(a, 0));
+    }
+
+    lval_del(a);
+    return x;
+}
+
+/*
+ * Native versions of the prelude's list functions, each a single pass over
+ * the cells. Like the prelude's fst, they evaluate each item before passing
+ * it to a function. take and drop return slices of the list.
+ */
+lval* lval_call(lenv* e, lval* f, lval* a);
+lval* builtin_add(lenv* e, lval* a);
+lval* builtin_mul(lenv* e, lval* a);
+
+// evaluate item x as fst does, and call f with it, keeping f
+static lval* lval_call_item(lenv* e, lval* f, lval* x) {
+    x = lval_eval(e, lval_ref(x));
+    if (lval_type(x) == LVAL_ERR) { return x; }
+    return lval_call(e, lval_ref(f), lval_add(lval_sexpr(), x));
+}
+
+// fn partially applied to a, which holds fewer than its n formals, as the
+// prelude versions of the list builtins could be. It is a lambda calling
+// fn itself, so no binding of fn's name can get in the way
+lval* builtin_lambda(lenv* e, lval* a);
+static lval* lval_partial(lenv* e, lbuiltin fn, char** formals, int n,
+                          lval* a) {
+    lval* fs = lval_qexpr();
+    lval* body = lval_add(lval_qexpr(), lval_fun(fn));
+    for (int i = 0; i < n; i++) {
+        lval* k = lval_sym(formals[i]);
+        if (!k) {
+            lval_del(fs);
+            lval_del(body);
+            lval_del(a);
+            return lval_err("Too many symbols.");
+        }
+        lval_add(fs, k);
+        lval_add(body, k);
+    }
+    lval* f = builtin_lambda(e, lval_add(lval_add(lval_sexpr(), fs), body));
+    return lval_call(e, f, a);
+}
+
+lval* builtin_len(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("len", a, 1);
+    LASSERT_ARG_TYPE("len", a, 0, LVAL_QEXPR);
+
+    lval* x = lval_num(a->cell[0]->count);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_nth(lenv* e, lval* a) {
+    if (a->count < 2) {
+        return lval_partial(e, builtin_nth, (char*[]){ "n", "xs" }, 2, a);
+    }
+    LASSERT_NUM_ARGS("nth", a, 2);
+    LASSERT_ARG_TYPE("nth", a, 0, LVAL_NUM);
+    LASSERT_ARG_TYPE("nth", a, 1, LVAL_QEXPR);
+
+    long n = lval_as_num(a->cell[0]);
+    int count = a->cell[1]->count;
+    LASSERT(a, (n >= 0 && n < count),
+            "Function 'nth' passed index %li for a list of %i items.",
+            n, count);
+
+    lval* x = lval_ref(a->cell[1]->cell[n]);
+    lval_del(a);
+    return lval_eval(e, x);
+}
+
+lval* builtin_take(lenv* e, lval* a) {
+    if (a->count < 2) {
+        return lval_partial(e, builtin_take, (char*[]){ "n", "xs" }, 2, a);
+    }
+    LASSERT_NUM_ARGS("take", a, 2);
+    LASSERT_ARG_TYPE("take", a, 0, LVAL_NUM);
+    LASSERT_ARG_TYPE("take", a, 1, LVAL_QEXPR);
+
+    long n = lval_as_num(a->cell[0]);
+    int count = a->cell[1]->count;
+    LASSERT(a, (n >= 0 && n <= count),
+            "Function 'take' passed %li for a list of %i items.", n, count);
+
+    lval* x = lval_slice(a->cell[1], 0, n);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_drop(lenv* e, lval* a) {
+    if (a->count < 2) {
+        return lval_partial(e, builtin_drop, (char*[]){ "n", "xs" }, 2, a);
+    }
+    LASSERT_NUM_ARGS("drop", a, 2);
+    LASSERT_ARG_TYPE("drop", a, 0, LVAL_NUM);
+    LASSERT_ARG_TYPE("drop", a, 1, LVAL_QEXPR);
+
+    long n = lval_as_num(a->cell[0]);
+    int count = a->cell[1]->count;
+    LASSERT(a, (n >= 0 && n <= count),
+            "Function 'drop' passed %li for a list of %i items.", n, count);
+
+    lval* x = lval_slice(a->cell[1], n, count - n);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_map(lenv* e, lval* a) {
+    if (a->count < 2) {
+        return lval_partial(e, builtin_map, (char*[]){ "f", "xs" }, 2, a);
+    }
+    LASSERT_NUM_ARGS("map", a, 2);
+    LASSERT_ARG_TYPE("map", a, 0, LVAL_FUN);
+    LASSERT_ARG_TYPE("map", a, 1, LVAL_QEXPR);
+
+    // every item is mapped even after an error, as in the prelude, and the
+    // first error is the result
+    lval* xs = a->cell[1];
+    lval* x = lval_qexpr_n(xs->count);
+    for (int i = 0; i < xs->count; i++) {
+        x->cell[i] = lval_call_item(e, a->cell[0], xs->cell[i]);
+    }
+    lval_del(a);
+
+    for (int i = 0; i < x->count; i++) {
+        if (lval_type(x->cell[i]) == LVAL_ERR) { return lval_take(x, i); }
+    }
+    return x;
+}
+
+lval* builtin_filter(lenv* e, lval* a) {
+    if (a->count < 2) {
+        return lval_partial(e, builtin_filter, (char*[]){ "f", "xs" }, 2, a);
+    }
+    LASSERT_NUM_ARGS("filter", a, 2);
+    LASSERT_ARG_TYPE("filter", a, 0, LVAL_FUN);
+    LASSERT_ARG_TYPE("filter", a, 1, LVAL_QEXPR);
+
+    lval* xs = a->cell[1];
+    lval* x = lval_qexpr_n(xs->count);
+    lval* err = NULL;
+    int n = 0;
+    for (int i = 0; i < xs->count; i++) {
+        lval* r = lval_call_item(e, a->cell[0], xs->cell[i]);
+        if (lval_type(r) == LVAL_NUM) {
+            if (lval_as_num(r)) { x->cell[n++] = lval_ref(xs->cell[i]); }
+        } else if (!err) {
+            err = lval_type(r) == LVAL_ERR ? lval_ref(r)
+                : lval_err("Function 'filter' passed a function returning "
+                           "%s, expected %s.",
+                           ltype_name(lval_type(r)), ltype_name(LVAL_NUM));
+        }
+        lval_del(r);
+    }
+    lval_del(a);
+
+    // items not kept are still zero, and need not be freed
+    x->count = n;
+    if (err) {
+        lval_del(x);
+        return err;
+    }
+    return x;
+}
+
+// fold f over the items of xs from z, consuming z
+static lval* lval_foldl(lenv* e, lval* f, lval* z, lval* xs) {
+    for (int i = 0; i < xs->count; i++) {
+        lval* x = lval_eval(e, lval_ref(xs->cell[i]));
+        if (lval_type(x) == LVAL_ERR) {
+            lval_del(z);
+            return x;
+        }
+        z = lval_call(e, lval_ref(f), lval_add(lval_add(lval_sexpr(), z), x));
+        if (lval_type(z) == LVAL_ERR) { return z; }
+    }
+    return z;
+}
+
+lval* builtin_foldl(lenv* e, lval* a) {
+    if (a->count < 3) {
+        return lval_partial(e, builtin_foldl, (char*[]){ "f", "z", "xs" }, 3, a);
+    }
+    LASSERT_NUM_ARGS("foldl", a, 3);
+    LASSERT_ARG_TYPE("foldl", a, 0, LVAL_FUN);
+    LASSERT_ARG_TYPE("foldl", a, 2, LVAL_QEXPR);
+
+    lval* x = lval_foldl(e, a->cell[0], lval_ref(a->cell[1]), a->cell[2]);
+    lval_del(a);
+    return x;
+}
+
+#ifdef __GNUC__
+typedef uintptr_t lvec __attribute__((vector_size(4 * sizeof(uintptr_t))));
+#endif
+
+// sum the n cells, returning whether they were all fixnums whose sum
+// fits in a long. Any other sum is left to the + builtin
+static int lval_sum_fixnums(lval** cell, int n, long* sum) {
+    const int top = sizeof(uintptr_t) * CHAR_BIT - 1;
+    const uintptr_t sign = (uintptr_t)1 << top;
+    uintptr_t s = 0;
+    uintptr_t tags = LVAL_TAG_FIXNUM;
+    uintptr_t mags = 0; // the bits of every magnitude, or'ed together
+    int i = 0;
+
+#ifdef __GNUC__
+    // four cells at a time. A logical shift that keeps the sign bit
+    // untags them, as vectors may have no arithmetic 64-bit shift
+    lvec vs = { 0 };
+    lvec vmags = { 0 };
+    lvec vtags = vs + LVAL_TAG_FIXNUM;
+    for (; i + 4 <= n; i += 4) {
+        lvec v;
+        memcpy(&v, cell + i, sizeof(lvec));
+        vtags &= v;
+        lvec x = (v >> 1) | (v & sign);
+        vs += x;
+        vmags |= x ^ -(x >> top);
+    }
+    for (int j = 0; j < 4; j++) {
+        s += vs[j];
+        tags &= vtags[j];
+        mags |= vmags[j];
+    }
+#endif
+
+    for (; i < n; i++) {
+        uintptr_t v = (uintptr_t)cell[i];
+        tags &= v;
+        uintptr_t x = (v >> 1) | (v & sign);
+        s += x;
+        mags |= x ^ -(x >> top);
+    }
+    *sum = (long)(intptr_t)s;
+
+    // n numbers within 2^bits of zero cannot overflow if n * 2^bits does
+    // not. Checking the bound costs less than checking every addition
+    int bits = 0;
+    while (bits < top && (mags >> bits)) { bits++; }
+    return tags != 0 && bits < top && (uintptr_t)n < (uintptr_t)1 << (top - bits);
+}
+
+lval* builtin_sum(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("sum", a, 1);
+    LASSERT_ARG_TYPE("sum", a, 0, LVAL_QEXPR);
+
+    // lists of plain numbers are summed directly, others folded with +
+    long sum;
+    lval* x = lval_sum_fixnums(a->cell[0]->cell, a->cell[0]->count, &sum)
+        ? lval_num(sum)
+        : lval_foldl(e, lval_fun(builtin_add), lval_num(0), a->cell[0]);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_prod(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("prod", a, 1);
+    LASSERT_ARG_TYPE("prod", a, 0, LVAL_QEXPR);
+
+    lval* xs = a->cell[0];
+    long prod = 1;
+    int i = 0;
+    for (; i < xs->count && lval_is_fixnum(xs->cell[i]); i++) {
+        if (__builtin_mul_overflow(prod, lval_as_num(xs->cell[i]), &prod)) {
+            break;
+        }
+    }
+    lval* x = i == xs->count
+        ? lval_num(prod)
+        : lval_foldl(e, lval_fun(builtin_mul), lval_num(1), xs);
+    lval_del(a);
+    return x;
+}
+
+/**
+ * Parallel list functions
+ *
+ * pmap, pfilter and preduce split a list into chunks and hand them to a
+ * pool of worker threads. Values can not be shared between threads, as
+ * each has heaps of its own and reference counts are not atomic, so what a
+ * worker needs crosses over as images: one of the bindings the function
+ * can see and the function itself, which each worker restores once per
+ * call, and one of each chunk's items. Results come back the same way.
+ * Images are never written to once made, so any number of workers may
+ * restore the same one at once.
+ *
+ * Each worker has a deque of chunks. It takes chunks from the back of its
+ * own and, once that is empty, steals from the front of the others', so
+ * that chunks which take longer do not leave the other workers idle.
+ */
+#define LPOOL_MAX 64
+#define LPAR_CHUNKS_PER_WORKER 4
+
+enum { LPAR_MAP, LPAR_FILTER, LPAR_REDUCE };
+
+typedef struct {
+    int op;
+    char* env;        // image of the bindings seen and the function
+    size_t env_size;
+    char** in;        // image of each chunk's items
+    size_t* in_size;
+    char** out;       // image of each chunk's result
+    size_t* out_size;
+    int nchunks;
+    int left;         // chunks not finished yet
+    int busy;         // workers still holding on to the job
+} lpar_job;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int* chunks;
+    int head, tail;
+} lpool_deque;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;  // a job was posted
+    pthread_cond_t done;  // a job was finished and let go of
+    pthread_mutex_t run;  // held by the thread whose job is posted
+    int size;
+    lpar_job* job;
+    unsigned long jobs;   // number of jobs posted so far
+    lpool_deque deques[LPOOL_MAX];
+} lpool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+            PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t lpool_once = PTHREAD_ONCE_INIT;
+
+// set on worker threads, where the parallel functions run sequentially
+// rather than wait on the pool they are part of
+static _Thread_local int lpool_worker_thread = 0;
+
+// next chunk for worker self, its own or stolen, or -1 once there are none
+static int lpool_next(int self) {
+    int c = -1;
+    lpool_deque* d = &lpool.deques[self];
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) { c = d->chunks[--d->tail]; }
+    pthread_mutex_unlock(&d->lock);
+
+    for (int i = 1; c < 0 && i < lpool.size; i++) {
+        d = &lpool.deques[(self + i) % lpool.size];
+        pthread_mutex_lock(&d->lock);
+        if (d->head < d->tail) { c = d->chunks[d->head++]; }
+        pthread_mutex_unlock(&d->lock);
+    }
+    return c;
+}
+
+// image of the result of job's operation on chunk c, with function f
+// evaluated in env e
+static char* lpar_chunk(lpar_job* job, lenv* e, lval* f, int c,
+                        size_t* size) {
+    lalloc_arena_begin();
+    lval* xs;
+    lval* x = limg_restore(NULL, "<chunk>", job->in[c], job->in_size[c], &xs);
+    if (!x) {
+        lval* a = lval_add(lval_sexpr(), lval_ref(f));
+        switch (job->op) {
+            case LPAR_MAP:    x = builtin_map(e, lval_add(a, xs));    break;
+            case LPAR_FILTER: x = builtin_filter(e, lval_add(a, xs)); break;
+            case LPAR_REDUCE: {
+                // a chunk is folded from its first item, leaving the
+                // initial value to the caller
+                lval* z = lval_eval(e, lval_ref(xs->cell[0]));
+                lval* rest = lval_slice(xs, 1, xs->count - 1);
+                x = lval_type(z) == LVAL_ERR ? z : lval_foldl(e, f, z, rest);
+                lval_del(rest);
+                lval_del(xs);
+                lval_del(a);
+                break;
+            }
+        }
+    }
+    char* img = limg_write(NULL, x, size, NULL);
+    lval_del(x);
+    lalloc_arena_end();
+    return img;
+}
+
+// work on chunks of job as worker self until there are none left
+static void lpar_work(lpar_job* job, int self) {
+    lispy_vm* vm = NULL;
+    lval* f = NULL;
+    int c;
+    while ((c = lpool_next(self)) >= 0) {
+        // the env is only restored by workers that get to a chunk
+        if (!vm) {
+            vm = lispy_new();
+            lispy_cur = vm;
+            lval* err = limg_restore(vm->env, "<pool>", job->env,
+                                     job->env_size, &f);
+            if (err) { f = err; }
+        }
+        job->out[c] = lval_type(f) == LVAL_ERR
+            ? limg_write(NULL, f, &job->out_size[c], NULL)
+            : lpar_chunk(job, vm->env, f, c, &job->out_size[c]);
+
+        pthread_mutex_lock(&lpool.lock);
+        job->left--;
+        pthread_mutex_unlock(&lpool.lock);
+    }
+    if (vm) {
+        lval_del(f);
+        lispy_free(vm);
+        lispy_cur = NULL;
+    }
+}
+
+static void* lpool_worker(void* arg) {
+    int self = (int)(intptr_t)arg;
+    lpool_worker_thread = 1;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&lpool.lock);
+    while (1) {
+        while (lpool.jobs == seen) { pthread_cond_wait(&lpool.work, &lpool.lock); }
+        seen = lpool.jobs;
+        lpar_job* job = lpool.job;
+        if (!job) { continue; }
+        job->busy++;
+        pthread_mutex_unlock(&lpool.lock);
+
+        lpar_work(job, self);
+
+        pthread_mutex_lock(&lpool.lock);
+        if (--job->busy == 0 && job->left == 0) {
+            pthread_cond_signal(&lpool.done);
+        }
+    }
+    return NULL;
+}
+
+// start the workers, one for each processor unless LISPY_THREADS says
+static void lpool_start(void) {
+    long n = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    char* env = getenv("LISPY_THREADS");
+    if (env) { n = strtol(env, NULL, 10); }
+    if (n > LPOOL_MAX) { n = LPOOL_MAX; }
+
+    // a single worker would only add the cost of images
+    if (n < 2) { return; }
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_init(&lpool.deques[i].lock, NULL);
+        pthread_t t;
+        if (pthread_create(&t, NULL, lpool_worker, (void*)(intptr_t)i) != 0) {
+            break;
+        }
+        pthread_detach(t);
+        lpool.size++;
+    }
+}
+
+// result of op on each chunk of the items of xs, with function f and the
+// bindings seen from e, or NULL if they are better done on this thread
+static lval* lpar_run(lenv* e, int op, lval* f, lval* xs) {
+    if (lpool_worker_thread || xs->count < 2) { return NULL; }
+    pthread_once(&lpool_once, lpool_start);
+    if (lpool.size < 2) { return NULL; }
+
+    lpar_job job = { op };
+    job.nchunks = xs->count < lpool.size * LPAR_CHUNKS_PER_WORKER
+        ? xs->count : lpool.size * LPAR_CHUNKS_PER_WORKER;
+    job.left = job.nchunks;
+    job.env = limg_write(e, f, &job.env_size, NULL);
+    job.in = malloc(sizeof(char*) * job.nchunks);
+    job.in_size = malloc(sizeof(size_t) * job.nchunks);
+    job.out = calloc(job.nchunks, sizeof(char*));
+    job.out_size = calloc(job.nchunks, sizeof(size_t));
+    for (int c = 0; c < job.nchunks; c++) {
+        int from = (int)((long)xs->count * c / job.nchunks);
+        int to = (int)((long)xs->count * (c + 1) / job.nchunks);
+        lval* chunk = lval_slice(xs, from, to - from);
+        job.in[c] = limg_write(NULL, chunk, &job.in_size[c], NULL);
+        lval_del(chunk);
+    }
+
+    // deal chunks out in turn, so each worker starts on its own share
+    pthread_mutex_lock(&lpool.run);
+    for (int i = 0; i < lpool.size; i++) {
+        lpool_deque* d = &lpool.deques[i];
+        pthread_mutex_lock(&d->lock);
+        d->chunks = realloc(d->chunks, sizeof(int) * job.nchunks);
+        d->head = d->tail = 0;
+        for (int c = i; c < job.nchunks; c += lpool.size) {
+            d->chunks[d->tail++] = c;
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+    pthread_mutex_lock(&lpool.lock);
+    lpool.job = &job;
+    lpool.jobs++;
+    pthread_cond_broadcast(&lpool.work);
+    while (job.left > 0 || job.busy > 0) {
+        pthread_cond_wait(&lpool.done, &lpool.lock);
+    }
+    lpool.job = NULL;
+    pthread_mutex_unlock(&lpool.lock);
+    pthread_mutex_unlock(&lpool.run);
+
+    lval* rs = lval_qexpr_n(job.nchunks);
+    for (int c = 0; c < job.nchunks; c++) {
+        lval* err = limg_restore(NULL, "<chunk>", job.out[c], job.out_size[c],
+                                 &rs->cell[c]);
+        if (err) { rs->cell[c] = err; }
+        free(job.in[c]);
+        free(job.out[c]);
+    }
+    free(job.env);
+    free(job.in);
+    free(job.in_size);
+    free(job.out);
+    free(job.out_size);
+    return rs;
+}
+
+// the lists in rs joined in order, or the first error among them
+static lval* lpar_join(lval* rs) {
+    int n = 0;
+    for (int i = 0; i < rs->count; i++) {
+        if (lval_type(rs->cell[i]) == LVAL_ERR) { return lval_take(rs, i); }
+        n += rs->cell[i]->count;
+    }
+    lval* x = lval_qexpr_n(n);
+    n = 0;
+    for (int i = 0; i < rs->count; i++) {
+        lval* r = rs->cell[i];
+        for (int j = 0; j < r->count; j++) { x->cell[n++] = lval_ref(r->cell[j]); }
+    }
+    lval_del(rs);
+    return x;
+}
+
+lval* builtin_pmap(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("pmap", a, 2);
+    LASSERT_ARG_TYPE("pmap", a, 0, LVAL_FUN);
+    LASSERT_ARG_TYPE("pmap", a, 1, LVAL_QEXPR);
+
+    lval* rs = lpar_run(e, LPAR_MAP, a->cell[0], a->cell[1]);
+    if (!rs) { return builtin_map(e, a); }
+    lval_del(a);
+    return lpar_join(rs);
+}
+
+lval* builtin_pfilter(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("pfilter", a, 2);
+    LASSERT_ARG_TYPE("pfilter", a, 0, LVAL_FUN);
+    LASSERT_ARG_TYPE("pfilter", a, 1, LVAL_QEXPR);
+
+    lval* rs = lpar_run(e, LPAR_FILTER, a->cell[0], a->cell[1]);
+    if (!rs) { return builtin_filter(e, a); }
+    lval_del(a);
+    return lpar_join(rs);
+}
+
+// f must be associative, as chunks are folded apart and their results then
+// folded onto z in order
+lval* builtin_preduce(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("preduce", a, 3);
+    LASSERT_ARG_TYPE("preduce", a, 0, LVAL_FUN);
+    LASSERT_ARG_TYPE("preduce", a, 2, LVAL_QEXPR);
+
+    lval* rs = lpar_run(e, LPAR_REDUCE, a->cell[0], a->cell[2]);
+    if (!rs) { return builtin_foldl(e, a); }
+    lval* x = lval_foldl(e, a->cell[0], lval_ref(a->cell[1]), rs);
+    lval_del(rs);
+    lval_del(a);
+    return x;
+}
+
+// construct vector of the items of a Q-Expression
+lval* builtin_vec(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("vec", a, 1);
+    LASSERT_ARG_TYPE("vec", a, 0, LVAL_QEXPR);
+
+    lval* x = lvector_from(a->cell[0]->cell, a->cell[0]->count);
+    lval_del(a);
+    return x;
+}
+
+// construct map of the keys and values alternating in a Q-Expression
+lval* builtin_hash_map(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("hash-map", a, 1);
+    LASSERT_ARG_TYPE("hash-map", a, 0, LVAL_QEXPR);
+
+    lval* kvs = a->cell[0];
+    LASSERT(a, (kvs->count % 2 == 0),
+            "Function 'hash-map' passed %i items, expected keys and values "
+            "in pairs.", kvs->count);
+
+    lval* m = lval_map();
+    for (int i = 0; i < kvs->count; i += 2) {
+        lval* x = lmap_assoc(m, lval_ref(kvs->cell[i]),
+                             lval_ref(kvs->cell[i + 1]));
+        lval_del(m);
+        m = x;
+    }
+    lval_del(a);
+    return m;
+}
+
+lval* builtin_get(lenv* e, lval* a) {
+    LASSERT(a, (a->count == 2 || a->count == 3),
+            "Function 'get' passed incorrect number of arguments. "
+            "Got %i, expected 2 or 3.", a->count);
+    LASSERT_ARG_TYPE2("get", a, 0, LVAL_VEC, LVAL_MAP);
+
+    // a third argument is given back for items that are not there
+    lval* c = a->cell[0];
+    lval* x;
+    if (c->type == LVAL_VEC) {
+        LASSERT_ARG_TYPE("get", a, 1, LVAL_NUM);
+        long i = lval_as_num(a->cell[1]);
+        int found = i >= 0 && i < c->size;
+        LASSERT(a, (found || a->count == 3),
+                "Function 'get' passed index %li for a vector of %i items.",
+                i, c->size);
+        x = found ? lvector_nth(c, i) : a->cell[2];
+    } else {
+        x = lmap_get(c, a->cell[1]);
+        LASSERT(a, (x || a->count == 3),
+                "Function 'get' passed a key not in the map.");
+        x = x ? x : a->cell[2];
+    }
+    x = lval_ref(x);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_assoc(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("assoc", a, 3);
+    LASSERT_ARG_TYPE2("assoc", a, 0, LVAL_VEC, LVAL_MAP);
+
+    lval* c = a->cell[0];
+    lval* x;
+    if (c->type == LVAL_VEC) {
+        // setting the item just past the end adds to the vector
+        LASSERT_ARG_TYPE("assoc", a, 1, LVAL_NUM);
+        long i = lval_as_num(a->cell[1]);
+        LASSERT(a, (i >= 0 && i <= c->size),
+                "Function 'assoc' passed index %li for a vector of %i items.",
+                i, c->size);
+        x = lvector_assoc(c, i, lval_ref(a->cell[2]));
+    } else {
+        x = lmap_assoc(c, lval_ref(a->cell[1]), lval_ref(a->cell[2]));
+    }
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_dissoc(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("dissoc", a, 2);
+    LASSERT_ARG_TYPE("dissoc", a, 0, LVAL_MAP);
+
+    lval* x = lmap_dissoc(a->cell[0], a->cell[1]);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_count(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("count", a, 1);
+    LASSERT_ARG_TYPE2("count", a, 0, LVAL_VEC, LVAL_MAP);
+
+    lval* x = lval_num(a->cell[0]->size);
+    lval_del(a);
+    return x;
+}
+
+// list the items of a vector, or the key and value pairs of a map
+lval* builtin_seq(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("seq", a, 1);
+    LASSERT_ARG_TYPE2("seq", a, 0, LVAL_VEC, LVAL_MAP);
+
+    lval* x = lval_items(a->cell[0], LITEMS_PAIRS);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_keys(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("keys", a, 1);
+    LASSERT_ARG_TYPE("keys", a, 0, LVAL_MAP);
+
+    lval* x = lval_items(a->cell[0], LITEMS_KEYS);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_vals(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("vals", a, 1);
+    LASSERT_ARG_TYPE("vals", a, 0, LVAL_MAP);
+
+    lval* x = lval_items(a->cell[0], LITEMS_VALS);
+    lval_del(a);
+    return x;
+}
+
+// bind symbols to values with bind, which is lenv_def for 'def' and
+// lenv_put for '='
+lval* builtin_var(lenv* e, lval* a, char* func,
+                  void (*bind)(lenv*, lval*, lval*)) {
+    LASSERT_ARG_TYPE(func, a, 0, LVAL_QEXPR);
+
+    // first argument is symbol list
+    lval* syms = a->cell[0];
+
+    // ensure all elements of first list are symbols
+    for (int i = 0; i < syms->count; i++) {
+        LASSERT(a, (lval_type(syms->cell[i]) == LVAL_SYM),
+                "Function '%s' cannot define non-symbol. "
+                "Got %s, expected %s.",
+                func, ltype_name(lval_type(syms->cell[i])), ltype_name(LVAL_SYM));
+    }
+
+    // check correct number of symbols and values
+    LASSERT(a, (syms->count == a->count - 1),
+            "Function '%s' cannot define incorrect number of values to "
+            "symbols. Got %i symbols and %i values.",
+            func, syms->count, a->count - 1);
+
+    // assign copies of values to symbols
+    for (int i = 0; i < syms->count; i++) {
+        bind(e, syms->cell[i], a->cell[i + 1]);
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* builtin_def(lenv* e, lval* a) {
+    return builtin_var(e, a, "def", lenv_def);
+}
+
+lval* builtin_put(lenv* e, lval* a) {
+    return builtin_var(e, a, "=", lenv_put);
+}
+
+lcode* lval_prepare(lenv* e, lval* body);
+lval* lcode_src(lcode* c);
+lval* builtin_lambda(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("\\", a, 2);
+    LASSERT_ARG_TYPE("\\", a, 0, LVAL_QEXPR);
+    LASSERT_ARG_TYPE("\\", a, 1, LVAL_QEXPR);
+
+    // ensure all elements of first list are symbols
+    for (int i = 0; i < a->cell[0]->count; i++) {
+        LASSERT(a, (lval_type(a->cell[0]->cell[i]) == LVAL_SYM),
+                "Function '\' cannot define non-symbol. "
+                "Got %s, expected %s.",
+                ltype_name(lval_type(a->cell[0]->cell[i])), ltype_name(LVAL_SYM));
+    }
+
+    // pop args and return new lval_lambda, with references to the formals
+    // in its body resolved to their slots
+    lval* formals = lval_pop(a, 0);
+    lval* body = lval_pop(a, 0);
+    lval_del(a);
+
+    lval* resolved = lval_resolve(body, formals);
+    if (resolved) {
+        lval_del(body);
+        body = resolved;
+    }
+
+    // the body needs cells of its own to keep its compiled code with
+    if (lval_is_slice(body)) {
+        resolved = lval_copy(body);
+        lval_del(body);
+        body = resolved;
+    }
+
+    // optimize and compile the body now, rather than on its first call
+    lval_prepare(e, body);
+    return lval_lambda(formals, body);
+}
+
+// optimized form of lambda's body, which its code is compiled from
+lval* builtin_optimized(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("optimized", a, 1);
+    LASSERT_ARG_TYPE("optimized", a, 0, LVAL_FUN);
+
+    // a memo runs the function it wraps
+    lval* f = a->cell[0];
+    while (!lval_is_builtin(f) && f->type == LVAL_MEMO) { f = f->fn; }
+    LASSERT(a, !lval_is_builtin(f),
+            "Function 'optimized' passed a builtin, expected a lambda.");
+
+    lval* src = lcode_src(lval_prepare(e, f->body));
+    lval* x = lval_ref(src ? src : f->body);
+    lval_del(a);
+    return x;
+}
+
+// number r as the result of the arguments a. If r is too wide for a
+// fixnum it goes in the box of the first argument, if nothing else has it
+static lval* lnum_result(lval* a, long r) {
+    lval* x = a->cell[0];
+    if ((r < LVAL_FIXNUM_MIN || r > LVAL_FIXNUM_MAX) && !lval_is_imm(x) &&
+        x->type == LVAL_NUM && x->refs == 1) {
+        x = lval_take(a, 0);
+        x->num = r;
+        return x;
+    }
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* builtin_op(lenv* e, lval* a, int op) {
+    char* name = lnum_op_names[op];
+
+    // the common (op x y) on plain numbers needs no loop
+    if (a->count == 2 && lval_type(a->cell[0]) == LVAL_NUM &&
+        lval_type(a->cell[1]) == LVAL_NUM) {
+        long r;
+        if (lnum_op_long(op, lval_as_num(a->cell[0]),
+                         lval_as_num(a->cell[1]), &r)) {
+            return lnum_result(a, r);
+        }
+    }
+
+    // ensure all arguments are numbers
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_ARG_NUMBER(name, a, i);
+    }
+
+    // accumulate in a machine integer while the arguments are plain
+    // numbers and nothing overflows, boxing only the final result
+    long x = 0;
+    int i = 0;
+    if (lval_type(a->cell[0]) == LVAL_NUM) {
+        x = lval_as_num(a->cell[0]);
+        i = 1;
+    }
+
+    // if no arguments and sub the perform unary negation
+    if (op == LNUM_SUB && a->count == 1) {
+        if (i == 1 && x != LONG_MIN) { return lnum_result(a, -x); }
+        lval* r = lnum_op(lval_num(0), a->cell[0], LNUM_SUB);
+        lval_del(a);
+        return r;
+    }
+
+    // fold in the remaining arguments
+    for (; i && i < a->count && lval_type(a->cell[i]) == LVAL_NUM; i++) {
+        long r;
+        if (!lnum_op_long(op, x, lval_as_num(a->cell[i]), &r)) { break; }
+        x = r;
+    }
+    if (i == a->count) { return lnum_result(a, x); }
+
+    // the rest are folded in one at a time, promoting to bignums or
+    // floats as they need
+    lval* acc = i ? lval_num(x) : lval_ref(a->cell[0]);
+    for (i = i ? i : 1; i < a->count; i++) {
+        lval* r = lnum_op(acc, a->cell[i], op);
+        lval_del(acc);
+        if (!r) {
+            lval_del(a);
+            return lval_err("Function '%s' caused division by zero.", name);
+        }
+        acc = r;
+    }
+    lval_del(a);
+    return acc;
+}
+
+lval* builtin_add(lenv* e, lval* a) {
+    return builtin_op(e, a, LNUM_ADD);
+}
+
+lval* builtin_sub(lenv* e, lval* a) {
+    return builtin_op(e, a, LNUM_SUB);
+}
+
+lval* builtin_mul(lenv* e, lval* a) {
+    return builtin_op(e, a, LNUM_MUL);
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+    return builtin_op(e, a, LNUM_DIV);
+}
+
+lval* builtin_mod(lenv* e, lval* a) {
+    return builtin_op(e, a, LNUM_MOD);
+}
+
+lval* builtin_float(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("float", a, 1);
+    LASSERT_ARG_NUMBER("float", a, 0);
+
+    lval* x = lval_float(lnum_to_double(a->cell[0]));
+    lval_del(a);
+    return x;
+}
+
+// integer part of a float, or an integer as it is
+lval* builtin_int(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("int", a, 1);
+    LASSERT_ARG_NUMBER("int", a, 0);
+
+    lval* x = a->cell[0];
+    if (lval_type(x) != LVAL_DBL) { return lval_take(a, 0); }
+    LASSERT(a, isfinite(x->dbl),
+            "Function 'int' passed a float with no integer part.");
+    x = lint_from_double(x->dbl);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_ord(lenv* e, lval* a, int op) {
+    char* name = lnum_ord_names[op];
+    LASSERT_NUM_ARGS(name, a, 2);
+
+    // integers compare exactly, however wide, and only floats as doubles.
+    // Two fixnums are compared straight away
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    double dx = 0, dy = 0;
+    if (lval_is_fixnum(x) && lval_is_fixnum(y)) {
+        long lx = lval_as_num(x), ly = lval_as_num(y);
+        dx = (lx > ly) - (lx < ly);
+    } else {
+        LASSERT_ARG_NUMBER(name, a, 0);
+        LASSERT_ARG_NUMBER(name, a, 1);
+        if (lval_type(x) == LVAL_DBL || lval_type(y) == LVAL_DBL) {
+            dx = lnum_to_double(x);
+            dy = lnum_to_double(y);
+        } else {
+            dx = lint_cmp(x, y);
+        }
+    }
+
+    int r = lnum_ord(op, dx, dy);
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* builtin_gt(lenv* e, lval* a) {
+    return builtin_ord(e, a, LNUM_GT);
+}
+
+lval* builtin_lt(lenv* e, lval* a) {
+    return builtin_ord(e, a, LNUM_LT);
+}
+
+lval* builtin_ge(lenv* e, lval* a) {
+    return builtin_ord(e, a, LNUM_GE);
+}
+
+lval* builtin_le(lenv* e, lval* a) {
+    return builtin_ord(e, a, LNUM_LE);
+}
+
+// compare for equality, or inequality if ne is set
+lval* builtin_cmp(lenv* e, lval* a, int ne) {
+    LASSERT_NUM_ARGS(ne ? "!=" : "==", a, 2);
+    int r = lval_eq(a->cell[0], a->cell[1]) != ne;
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* builtin_eq(lenv* e, lval* a) {
+    return builtin_cmp(e, a, 0);
+}
+
+lval* builtin_ne(lenv* e, lval* a) {
+    return builtin_cmp(e, a, 1);
+}
+
+lval* builtin_if(lenv* e, lval* a) {
+    int tail = ltail_take();
+    LASSERT_NUM_ARGS("if", a, 3);
+    LASSERT_ARG_TYPE("if", a, 0, LVAL_NUM);
+    LASSERT_ARG_TYPE("if", a, 1, LVAL_QEXPR);
+    LASSERT_ARG_TYPE("if", a, 2, LVAL_QEXPR);
+
+    // if condition is true, evaluate the first expression. Else, the second.
+    // Branches may be shared with a function body, so own before marking
+    // the chosen one as eval-able
+    lval* x = lval_own(lval_take(a, lval_as_num(a->cell[0]) ? 1 : 2));
+    x->type = LVAL_SEXPR;
+    ltail = tail;
+    return lval_eval(e, x);
+}
+
+// result of loading a file, given the error met reading it if any
+static lval* lval_load_result(lval* a, lval* err) {
+    lval_del(a);
+    if (!err) { return lval_sexpr(); }
+    lval* x = lval_err("Could not load Library %s", err->err);
+    lval_del(err);
+    return x;
+}
+
+lval* builtin_load_stream(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("load-stream", a, 1);
+    LASSERT_ARG_TYPE("load-stream", a, 0, LVAL_STR);
+    return lval_load_result(a, lval_load_stream(e, a->cell[0]->str));
+}
+
+lval* builtin_load(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("load", a, 1);
+    LASSERT_ARG_TYPE("load", a, 0, LVAL_STR);
+
+    // each form is read, evaluated and freed in turn
+    if (!lread_use_mpc) {
+        return lval_load_result(a, lval_load_file(e, a->cell[0]->str));
+    }
+
+    // otherwise the whole file is parsed before anything is evaluated
+    mpc_result_t r;
+    if (!mpc_parse_contents(a->cell[0]->str, lispy_grammar(lispy_cur), &r)) {
+        // get parse error as string
+        char* err_msg = mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+
+        lval* err = lval_err("Could not load Library %s", err_msg);
+        free(err_msg);
+        lval_del(a);
+
+        return err;
+    }
+    lval* expr = lval_read(r.output);
+    mpc_ast_delete(r.output);
+
+    // eval each form in the arena, reclaiming its garbage in bulk. Each
+    // form's slot is emptied as it is taken
+    for (int i = 0; i < expr->count; i++) {
+        lval* form = expr->cell[i];
+        expr->cell[i] = lval_num(0);
+        lalloc_arena_begin();
+        lval* x = lval_eval(e, form);
+        if (lval_type(x) == LVAL_ERR) { lval_println(x); }
+        lval_del(x);
+        lalloc_arena_end();
+    }
+
+    // delete expr and arguments
+    lval_del(expr);
+    lval_del(a);
+
+    return lval_sexpr();
+}
+
+lval* builtin_dump(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("dump", a, 1);
+    LASSERT_ARG_TYPE("dump", a, 0, LVAL_STR);
+
+    // the image holds the global env, wherever dump is called from
+    while (e->par) { e = e->par; }
+    lval* err = lenv_dump(e, a->cell[0]->str);
+    lval_del(a);
+    return err ? err : lval_sexpr();
+}
+
+lval* builtin_print(lenv* e, lval* a) {
+    for (int i = 0; i < a->count; i++) {
+        lval_print(a->cell[i]);
+        putchar(' ');
+    }
+
+    putchar('\n');
+    lval_del(a);
+
+    return lval_sexpr();
+}
+
+lval* builtin_error(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("error", a, 1);
+    LASSERT_ARG_TYPE("error", a, 0, LVAL_STR);
+
+    lval* err = lval_err(a->cell[0]->str);
+    lval_del(a);
+    return err;
+}
+
+lval* lval_stat(char* name, long x) {
+    return lval_add(lval_add(lval_qexpr(), lval_str(name)), lval_num(x));
+}
+
+// arguments are ignored, they only make the call an S-expression
+lval* builtin_alloc_stats(lenv* e, lval* a) {
+    lval_del(a);
+
+    lval* x = lval_qexpr();
+    lval_add(x, lval_stat("allocs", lalloc_stats.allocs));
+    lval_add(x, lval_stat("frees", lalloc_stats.frees));
+    lval_add(x, lval_stat("live", lheap_global.live + lheap_arena.live));
+    lval_add(x, lval_stat("bytes", lheap_global.bytes + lheap_arena.bytes));
+    lval_add(x, lval_stat("arena-live", lheap_arena.live));
+    lval_add(x, lval_stat("slabs", lalloc_stats.slabs));
+    lval_add(x, lval_stat("big", lalloc_stats.big));
+    lval_add(x, lval_stat("resets", lalloc_stats.resets));
+    lval_add(x, lval_stat("reclaimed", lalloc_stats.reclaimed));
+    return x;
+}
+
+// wrap a function with a cache of its results, optionally given the most
+// entries and bytes to keep
+lval* builtin_memo(lenv* e, lval* a) {
+    LASSERT(a, (a->count >= 1 && a->count <= 3),
+            "Function 'memo' passed incorrect number of arguments. "
+            "Got %i, expected 1 to 3.", a->count);
+    LASSERT_ARG_TYPE("memo", a, 0, LVAL_FUN);
+    long max = LMEMO_MAX_ENTRIES;
+    long max_bytes = LMEMO_MAX_BYTES;
+    if (a->count > 1) {
+        LASSERT_ARG_TYPE("memo", a, 1, LVAL_NUM);
+        max = lval_as_num(a->cell[1]);
+        LASSERT(a, (max > 0 && max <= INT_MAX),
+                "Function 'memo' passed %li entries, expected a positive "
+                "number.", max);
+    }
+    if (a->count > 2) {
+        LASSERT_ARG_TYPE("memo", a, 2, LVAL_NUM);
+        max_bytes = lval_as_num(a->cell[2]);
+        LASSERT(a, (max_bytes > 0),
+                "Function 'memo' passed %li bytes, expected a positive "
+                "number.", max_bytes);
+    }
+
+    lval* x = lval_memo(lval_ref(a->cell[0]), max, max_bytes);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_memo_stats(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("memo-stats", a, 1);
+    LASSERT_ARG_TYPE("memo-stats", a, 0, LVAL_FUN);
+    LASSERT(a, (!lval_is_builtin(a->cell[0]) && a->cell[0]->type == LVAL_MEMO),
+            "Function 'memo-stats' passed a function that is not a memo.");
+
+    lmemo* m = a->cell[0]->memo;
+    lval* x = lval_qexpr();
+    lval_add(x, lval_stat("hits", m->hits));
+    lval_add(x, lval_stat("misses", m->misses));
+    lval_add(x, lval_stat("evictions", m->evictions));
+    lval_add(x, lval_stat("entries", m->count));
+    lval_add(x, lval_stat("bytes", m->bytes));
+    lval_add(x, lval_stat("max-entries", m->max));
+    lval_add(x, lval_stat("max-bytes", m->max_bytes));
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_gc(lenv* e, lval* a) {
+    lval_del(a);
+    return lval_num(lgc_collect());
+}
+
+// arguments are ignored, they only make the call an S-expression
+lval* builtin_gc_stats(lenv* e, lval* a) {
+    lval_del(a);
+
+    lval* x = lval_qexpr();
+    lval_add(x, lval_stat("collections", lgc_stats.collections));
+    lval_add(x, lval_stat("live", lheap_global.live + lheap_arena.live));
+    lval_add(x, lval_stat("bytes", lheap_global.bytes + lheap_arena.bytes));
+    lval_add(x, lval_stat("freed", lgc_stats.freed));
+    lval_add(x, lval_stat("pause-last-us", lgc_stats.pause_last));
+    lval_add(x, lval_stat("pause-max-us", lgc_stats.pause_max));
+    lval_add(x, lval_stat("pause-total-us", lgc_stats.pause_total));
+    return x;
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+    lval* k = lval_sym(name);
+    lval* v = lval_fun_named(func, name);
+    lenv_put(e, k, v);
+    lval_del(k);
+    lval_del(v);
+}
+
+// defined with the task scheduler
+lval* builtin_spawn(lenv* e, lval* a);
+lval* builtin_await(lenv* e, lval* a);
+lval* builtin_chan(lenv* e, lval* a);
+lval* builtin_send(lenv* e, lval* a);
+lval* builtin_recv(lenv* e, lval* a);
+lval* builtin_yield(lenv* e, lval* a);
+
+// adds builtin functions to environment
+void lenv_add_builtins(lenv* e) {
+    // variable functions
+    lenv_add_builtin(e, "\\",  builtin_lambda);
+    lenv_add_builtin(e, "def", builtin_def);
+    lenv_add_builtin(e, "=",   builtin_put);
+    lenv_add_builtin(e, "optimized", builtin_optimized);
+
+    // list functions
+    lenv_add_builtin(e, "list", builtin_list);
+    lenv_add_builtin(e, "head", builtin_head);
+    lenv_add_builtin(e, "tail", builtin_tail);
+    lenv_add_builtin(e, "eval", builtin_eval);
+    lenv_add_builtin(e, "join", builtin_join);
+    lenv_add_builtin(e, "len", builtin_len);
+    lenv_add_builtin(e, "nth", builtin_nth);
+    lenv_add_builtin(e, "take", builtin_take);
+    lenv_add_builtin(e, "drop", builtin_drop);
+    lenv_add_builtin(e, "map", builtin_map);
+    lenv_add_builtin(e, "filter", builtin_filter);
+    lenv_add_builtin(e, "foldl", builtin_foldl);
+    lenv_add_builtin(e, "pmap", builtin_pmap);
+    lenv_add_builtin(e, "pfilter", builtin_pfilter);
+    lenv_add_builtin(e, "preduce", builtin_preduce);
+    lenv_add_builtin(e, "sum", builtin_sum);
+    lenv_add_builtin(e, "prod", builtin_prod);
+
+    // vector and map functions
+    lenv_add_builtin(e, "vec", builtin_vec);
+    lenv_add_builtin(e, "hash-map", builtin_hash_map);
+    lenv_add_builtin(e, "get", builtin_get);
+    lenv_add_builtin(e, "assoc", builtin_assoc);
+    lenv_add_builtin(e, "dissoc", builtin_dissoc);
+    lenv_add_builtin(e, "count", builtin_count);
+    lenv_add_builtin(e, "seq", builtin_seq);
+    lenv_add_builtin(e, "keys", builtin_keys);
+    lenv_add_builtin(e, "vals", builtin_vals);
+
+    // tasks
+    lenv_add_builtin(e, "spawn", builtin_spawn);
+    lenv_add_builtin(e, "await", builtin_await);
+    lenv_add_builtin(e, "chan", builtin_chan);
+    lenv_add_builtin(e, "send", builtin_send);
+    lenv_add_builtin(e, "recv", builtin_recv);
+    lenv_add_builtin(e, "yield", builtin_yield);
+
+    // memoization
+    lenv_add_builtin(e, "memo", builtin_memo);
+    lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+
+    // mathematical functions
+    lenv_add_builtin(e, "+", builtin_add);
+    lenv_add_builtin(e, "-", builtin_sub);
+    lenv_add_builtin(e, "*", builtin_mul);
+    lenv_add_builtin(e, "/", builtin_div);
+    lenv_add_builtin(e, "%", builtin_mod);
+    lenv_add_builtin(e, "float", builtin_float);
+    lenv_add_builtin(e, "int", builtin_int);
+
+    // comparator functions
+    lenv_add_builtin(e, ">", builtin_gt);
+    lenv_add_builtin(e, "<", builtin_lt);
+    lenv_add_builtin(e, ">=", builtin_ge);
+    lenv_add_builtin(e, "<=", builtin_le);
+    lenv_add_builtin(e, "==", builtin_eq);
+    lenv_add_builtin(e, "!=", builtin_ne);
+    lenv_add_builtin(e, "if", builtin_if);
+
+    lenv_add_builtin(e, "load", builtin_load);
+    lenv_add_builtin(e, "load-stream", builtin_load_stream);
+    lenv_add_builtin(e, "dump", builtin_dump);
+    lenv_add_builtin(e, "print", builtin_print);
+    lenv_add_builtin(e, "error", builtin_error);
+    lenv_add_builtin(e, "alloc-stats", builtin_alloc_stats);
+    lenv_add_builtin(e, "gc", builtin_gc);
+    lenv_add_builtin(e, "gc-stats", builtin_gc_stats);
+}
+
+/**
+ * Evaluate lval
+ */
+lval* lval_eval(lenv* e, lval* v);
+lval* lval_call(lenv* e, lval* f, lval* a);
+lcode* lval_prepare(lenv* e, lval* body);
+lval* lcode_run(lenv* e, lcode* c);
+
+// set from the command line, calling functions with the tree-walker
+// rather than compiling them when false
+static int lvm_enabled = 1;
+
+// bind in n whatever e binds that n does not, so that lookups through n
+// find the same values whether or not e is its parent
+static void lenv_merge(lenv* n, lenv* e) {
+    for (int i = 0; i < e->count; i++) {
+        if (lenv_slot(n, e->syms[i]) < 0) { lenv_put(n, e->syms[i], e->vals[i]); }
+    }
+}
+
+// run function f, with all of its formals bound, called from env e
+lval* lval_run(lenv* e, lval* f) {
+    // frames that tail calls were made from but may still be looked
+    // through, released once the last call returns
+    lval* held = NULL;
+
+    // set up parent env
+    f->env->par = e;
+
+    while (1) {
+        // run the body's compiled code, or evaluate its optimized form,
+        // which is shared rather than copied
+        lval* x;
+        lcode* c = lval_prepare(f->env, f->body);
+        if (lvm_enabled) {
+            x = lcode_run(f->env, c);
+        } else {
+            ltail = 1;
+            lval* src = lcode_src(c) ? lcode_src(c) : f->body;
+            x = builtin_eval(f->env, lval_add(lval_sexpr(), lval_ref(src)));
+        }
+
+        if (x != LVAL_TAIL) {
+            lval_del(f);
+            if (held) { lval_del(held); }
+            return x;
+        }
+
+        // run the function of the tail call in place of f. Scoping is
+        // dynamic, so the new frame's parent should be the env the call was
+        // made from. When that is f's frame, which nothing else can see any
+        // more, its bindings are taken over by the new frame instead
+        lval* g = ltail_fun;
+        if (ltail_env == f->env) {
+            lenv_merge(g->env, f->env);
+            g->env->par = f->env->par;
+            lval_del(f);
+        } else {
+            g->env->par = ltail_env;
+            if (!held) { held = lval_sexpr(); }
+            lval_add(held, f);
+        }
+        f = g;
+    }
+}
+
+lval* lval_eval_sexpr(lenv* e, lval* v, int tail) {
+    // children are evaluated in place, which must not affect other owners
+    v = lval_own(v);
+
+    // evaluate children. The collector may run while a child is being
+    // evaluated, so its slot must not point at it in the meantime.
+    for (int i = 0; i < v->count; i++) {
+        lval* x = v->cell[i];
+        v->cell[i] = lval_num(0);
+        v->cell[i] = lval_eval(e, x);
+    }
+
+    // error checking
+    for (int i = 0; i < v->count; i++) {
+        if (lval_type(v->cell[i]) == LVAL_ERR) { return lval_take(v, i); }
+    }
+
+    // empty expression
+    if (v->count == 0) { return v; }
+    // single expression
+    if (v->count == 1) { return lval_take(v, 0); }
+
+    // ensure first element is function after evaluation
+    lval* f = lval_pop(v, 0);
+    if (lval_type(f) != LVAL_FUN) {
+        lval* err = lval_err("Incorrect type for first element. "
+                             "Got %s, expected %s.",
+                             ltype_name(lval_type(f)), ltype_name(LVAL_FUN));
+        lval_del(f);
+        lval_del(v);
+        return err;
+    }
+
+    // call function with arguments
+    ltail = tail;
+    return lval_call(e, f, v);
+}
+
+lval* lval_eval(lenv* e, lval* v) {
+    int tail = ltail_take();
+    lgc_maybe_collect();
+
+    // a resolved symbol names a slot of the frame, but the body may be
+    // evaluated in another env, so check the slot holds that symbol
+    if (lval_is_local(v)) {
+        int i = lsym_slot(v);
+        if (i < e->count && e->syms[i] == lsym_plain(v)) {
+            return lval_ref(e->vals[i]);
+        }
+        return lenv_get(e, v);
+    }
+    if (lval_type(v) == LVAL_SYM) {
+        lval* x = lenv_get(e, v);
+        lval_del(v);
+        return x;
+    }
+    if (lval_type(v) == LVAL_SEXPR) { return lval_eval_sexpr(e, v, tail); }
+    return v;
+}
+
+// call f with arguments a, consuming both
+lval* lval_call(lenv* e, lval* f, lval* a) {
+    int tail = ltail_take();
+
+    // if builtin, just call it. if and eval evaluate in tail position too
+    if (lval_is_builtin(f)) {
+        lbuiltin fn = lval_as_builtin(f);
+        if (fn == builtin_if || fn == builtin_eval) { ltail = tail; }
+        return fn(e, a);
+    }
+
+    // memos need the result to cache, so never make a tail call
+    if (f->type == LVAL_MEMO) { return lmemo_call(e, f, a); }
+
+    // binding arguments changes the function, so make sure this call has
+    // its own copy rather than the one bound in the environment. Only its
+    // frame is copied, and the formals are shared rather than taken apart
+    f = lval_own(f);
+    lval* formals = f->formals;
+
+    // record argument counts
+    int given = a->count;
+    int total = formals->count;
+
+    // bind each argument to the next formal, j
+    int j = 0;
+    for (int i = 0; i < a->count; i++) {
+        // if ran out of formal arguments to bind
+        if (j == formals->count) {
+            lval_del(f);
+            lval_del(a);
+            return lval_err("Function passed too many arguments."
+                            "Got %i, expected %i.",
+                            given, total);
+        }
+
+        lval* sym = formals->cell[j++];
+
+        // special case for variable number of arguments
+        if (lsym_plain(sym) == lsym_rest) {
+            // ensure "&" is followed by one other symbol
+            if (formals->count - j != 1) {
+                lval_del(f);
+                lval_del(a);
+                return lval_err("Function format invalid."
+                                "Symbol '&' not followed by single symbol");
+            }
+
+            // next formal should be bound to remaining arguments, which
+            // share the cells of the argument list
+            lval* rest = lval_slice(a, i, a->count - i);
+            lenv_put(f->env, formals->cell[j++], rest);
+            lval_del(rest);
+            break;
+        }
+
+        lenv_put(f->env, sym, a->cell[i]);
+    }
+
+    // argument list is now bound so can be cleaned up
+    lval_del(a);
+
+    // if '&' remains in formal list bind to empty list
+    if (j < formals->count && lsym_plain(formals->cell[j]) == lsym_rest) {
+        // check to make sure '&' is not passed invalidly
+        if (formals->count - j != 2) {
+            lval_del(f);
+            return lval_err("Function format invalid. Symbol '&' not "
+                            "followed by a singe symbol.");
+        }
+
+        // bind next symbol to empty list
+        lval* val = lval_qexpr();
+        lenv_put(f->env, formals->cell[j + 1], val);
+        lval_del(val);
+        j += 2;
+    }
+
+    // if all formals have been bound, evaluate, or leave that to the
+    // function making this call if it is a tail call
+    if (j == formals->count) {
+        if (tail) {
+            ltail_fun = f;
+            ltail_env = e;
+            return LVAL_TAIL;
+        }
+        return lval_run(e, f);
+    } else {
+        // otherwise return partially evaluated function, expecting the
+        // formals not yet bound
+        f->formals = lval_slice(formals, j, formals->count - j);
+        lval_del(formals);
+        return f;
+    }
+}
+
+/**
+ * Optimize lvals
+ *
+ * Before a function body is compiled it is optimized. Calls to pure
+ * builtins on literal arguments are folded into their results, and an if
+ * on a literal condition is replaced with the branch it takes. Calls to
+ * small functions that only call pure builtins, such as not, fst and snd,
+ * are replaced with their bodies. The body itself is left as written, and
+ * the optimized form is what its code is compiled from.
+ *
+ * Scoping is dynamic, so a fold can only rely on a symbol no frame has
+ * ever bound, whose global binding is the only one any lookup can find.
+ * Symbols that folds relied on are marked. Binding one of them again,
+ * with def, = or as a formal, bumps lopt_version, and bodies optimized
+ * before then are optimized again on their next call.
+ */
+
+// largest body, counted in symbols, values and lists, that gets inlined
+#define LOPT_INLINE_MAX 12
+
+// builtins with no effects, whose results depend only on their arguments
+static lbuiltin lopt_pure[] = {
+    builtin_list, builtin_head, builtin_tail, builtin_join, builtin_len,
+    builtin_nth, builtin_take, builtin_drop, builtin_sum, builtin_prod,
+    builtin_vec, builtin_hash_map, builtin_get, builtin_assoc,
+    builtin_dissoc, builtin_count, builtin_seq, builtin_keys, builtin_vals,
+    builtin_add, builtin_sub, builtin_mul, builtin_div, builtin_mod,
+    builtin_float, builtin_int, builtin_gt, builtin_lt, builtin_ge,
+    builtin_le, builtin_eq, builtin_ne
+};
+
+static int lopt_is_pure(lbuiltin fn) {
+    for (size_t i = 0; i < sizeof(lopt_pure) / sizeof(lopt_pure[0]); i++) {
+        if (lopt_pure[i] == fn) { return 1; }
+    }
+    return 0;
+}
+
+// values that evaluate to themselves
+static int lopt_is_literal(lval* v) {
+    switch (lval_type(v)) {
+        case LVAL_NUM: case LVAL_DBL: case LVAL_BIG: case LVAL_STR:
+        case LVAL_QEXPR: case LVAL_VEC: case LVAL_MAP:
+            return 1;
+    }
+    return 0;
+}
+
+// global value of symbol k, if a fold may rely on it, or NULL
+static lval* lopt_global(lenv* e, lval* k) {
+    if (!lval_is_sym(k) || lval_is_local(k) ||
+        (*lsym_flags_of(k) & LSYM_SHADOWED)) {
+        return NULL;
+    }
+    int i;
+    lenv* b = lenv_find(e, k, &i);
+    return b && b->top ? b->vals[i] : NULL;
+}
+
+// record that a fold relied on the binding of symbol k
+static void lopt_depend(lval* k) {
+    *lsym_flags_of(k) |= LSYM_FOLDED;
+}
+
+static lval* lopt_expr(lenv* e, lval* v);
+static lval* lopt_body(lenv* e, lval* q);
+
+// copy of list v with its elements optimized, or NULL if none change.
+// Lists are only copied along the paths that change, as in lval_resolve
+static lval* lopt_elems(lenv* e, lval* v) {
+    lval* x = NULL;
+    for (int i = 0; i < v->count; i++) {
+        lval* r = lopt_expr(e, v->cell[i]);
+        if (!r) { continue; }
+        if (!x) { x = lval_copy(v); }
+        lval_del(x->cell[i]);
+        x->cell[i] = r;
+    }
+    return x;
+}
+
+// expression evaluating to what list q does when evaluated as an
+// S-Expression
+static lval* lopt_as_expr(lval* q) {
+    if (q->count == 1) { return lval_ref(q->cell[0]); }
+    lval* x = lval_copy(q);
+    x->type = LVAL_SEXPR;
+    return x;
+}
 
-// new lenv struct
-struct lenv {
-    lenv* par;
-    int count;
-    char** syms;
-    lval** vals;
-};
+// (if c {then} {else}), with its branches optimized as the code they are,
+// or replaced with the branch it takes when c is a number
+static lval* lopt_if(lenv* e, lval* v) {
+    if (v->count != 4 || lval_type(v->cell[2]) != LVAL_QEXPR ||
+        lval_type(v->cell[3]) != LVAL_QEXPR) {
+        return NULL;
+    }
+    lopt_depend(v->cell[0]);
 
-lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
-    e->par = NULL;
-    e->count = 0;
-    e->syms = NULL;
-    e->vals = NULL;
-    return e;
+    if (lval_type(v->cell[1]) == LVAL_NUM) {
+        lval* b = v->cell[lval_as_num(v->cell[1]) ? 2 : 3];
+        lval* r = lopt_body(e, b);
+        lval* x = lopt_as_expr(r ? r : b);
+        if (r) { lval_del(r); }
+        return x;
+    }
+
+    lval* x = NULL;
+    for (int i = 2; i < 4; i++) {
+        lval* r = lopt_body(e, v->cell[i]);
+        if (!r) { continue; }
+        if (!x) {
+            // v may be a function body being optimized
+            x = lval_copy(v);
+            x->type = LVAL_SEXPR;
+        }
+        lval_del(x->cell[i]);
+        x->cell[i] = r;
+    }
+    return x;
 }
 
-void lenv_del(lenv* e) {
-    for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
-        free(e->vals[i]);
+// whether the elements of v, in f's body, only call pure builtins or eval
+// and refer to each of f's formals once, in order, before any call is
+// made. *next is the formal expected next, *calls the number of calls made
+// so far, *size the size of the body so far and *evals set if eval is
+// called. The builtins are marked as relied on
+static int lopt_can_inline(lenv* e, lval* v, lval* formals, int* next,
+                           int* calls, int* size, int* evals) {
+    for (int i = 0; i < v->count; i++) {
+        lval* x = v->cell[i];
+        if (++*size > LOPT_INLINE_MAX) { return 0; }
+        if (lval_is_sym(x)) {
+            int slot = lval_formal_slot(formals, lsym_plain(x));
+            if (slot >= 0) {
+                if (slot != *next || *calls) { return 0; }
+                (*next)++;
+                continue;
+            }
+            // others, like = and def, act on f's frame, which inlining
+            // takes away
+            lval* g = lopt_global(e, x);
+            if (!g || !lval_is_builtin(g)) { return 0; }
+            lbuiltin fn = lval_as_builtin(g);
+            if (fn == builtin_eval) {
+                *evals = 1;
+            } else if (!lopt_is_pure(fn)) {
+                return 0;
+            }
+            lopt_depend(x);
+            continue;
+        }
+        if (lval_type(x) == LVAL_SEXPR) {
+            if (!lopt_can_inline(e, x, formals, next, calls, size, evals)) {
+                return 0;
+            }
+            if (x->count > 1) { (*calls)++; }
+            continue;
+        }
+        // Q-Expressions may be evaluated later, in f's frame
+        if (lval_type(x) == LVAL_QEXPR && x->count) { return 0; }
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
+    return 1;
 }
 
-lenv* lenv_copy(lenv* e) {
-    lenv* n = malloc(sizeof(lenv));
-    n->par = e->par;
-    n->count = e->count;
-    n->syms = malloc(sizeof(char*) * n->count);
-    n->vals = malloc(sizeof(lval*) * n->count);
-    for (int i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+// whether v mentions any of formals, at any depth
+static int lopt_mentions(lval* v, lval* formals) {
+    if (lval_is_sym(v)) {
+        return lval_formal_slot(formals, lsym_plain(v)) >= 0;
     }
-    return n;
+    if (lval_type(v) != LVAL_SEXPR && lval_type(v) != LVAL_QEXPR) {
+        return 0;
+    }
+    for (int i = 0; i < v->count; i++) {
+        if (lopt_mentions(v->cell[i], formals)) { return 1; }
+    }
+    return 0;
 }
 
-// get value for symbol of k in lenv
-lval* lenv_get(lenv* e, lval* k) {
-    // iterate over items in the environment
-    for (int i = 0; i < e->count; i++) {
-        // if stored symbol matches symbol of k, return copy of value
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+// copy of v with each of formals replaced by the matching argument of
+// the call a
+static lval* lopt_subst(lval* v, lval* formals, lval* a) {
+    if (lval_is_sym(v)) {
+        int slot = lval_formal_slot(formals, lsym_plain(v));
+        return slot >= 0 ? lval_ref(a->cell[slot + 1]) : v;
+    }
+    if (lval_type(v) != LVAL_SEXPR) { return lval_ref(v); }
+    lval* x = lval_copy(v);
+    for (int i = 0; i < x->count; i++) {
+        lval_del(x->cell[i]);
+        x->cell[i] = lopt_subst(v->cell[i], formals, a);
+    }
+    return x;
+}
+
+// body of function f with the arguments of call v in place of its
+// formals, if f can be inlined
+static lval* lopt_inline(lenv* e, lval* v, lval* f) {
+    lval* formals = f->formals;
+    if (f->env->count || formals->count != v->count - 1) { return NULL; }
+    for (int i = 0; i < formals->count; i++) {
+        if (lsym_plain(formals->cell[i]) == lsym_rest) { return NULL; }
+    }
+    int next = 0, calls = 0, size = 0, evals = 0;
+    if (!lopt_can_inline(e, f->body, formals, &next, &calls, &size,
+                         &evals) ||
+        next != formals->count) {
+        return NULL;
+    }
+    // an eval in f's body would find f's formals bound in its frame. Only
+    // a literal list is known not to mention them before the call runs
+    if (evals) {
+        for (int i = 1; i < v->count; i++) {
+            if (lval_type(v->cell[i]) != LVAL_QEXPR ||
+                lopt_mentions(v->cell[i], formals)) {
+                return NULL;
+            }
         }
     }
-    // if no symbol k->sym in lenv, check parent env, otherwise error
-    if (e->par) {
-        return lenv_get(e->par, k);
-    } else {
-        return lval_err("Symbol '%s' not defined.", k->sym);
+
+    lopt_depend(v->cell[0]);
+    lval* body = lopt_as_expr(f->body);
+    lval* x = lopt_subst(body, formals, v);
+    lval_del(body);
+
+    // the arguments may now fold with the body
+    lval* r = lopt_expr(e, x);
+    if (r) {
+        lval_del(x);
+        x = r;
     }
+    return x;
 }
 
-// put new value v for symbol k into lenv
-void lenv_put(lenv* e, lval* k, lval* v) {
-    // iterate over items in environment to see if it already exists
-    for (int i = 0; i < e->count; i++) {
-        // change value for symbol if it exists
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
+// what call v can be replaced with, or NULL if nothing
+static lval* lopt_call(lenv* e, lval* v) {
+    if (v->count < 2) { return NULL; }
+
+    lval* f = lopt_global(e, v->cell[0]);
+    if (!f || lval_type(f) != LVAL_FUN) { return NULL; }
+    // inlining a memo would skip its cache
+    if (!lval_is_builtin(f)) {
+        return f->type == LVAL_MEMO ? NULL : lopt_inline(e, v, f);
+    }
+
+    lbuiltin fn = lval_as_builtin(f);
+    if (fn == builtin_if) { return lopt_if(e, v); }
+
+    // evaluating a Q-Expression given as it is, as fst and snd do when
+    // inlined on a literal list, is the same as evaluating its contents
+    if (fn == builtin_eval && v->count == 2 &&
+        lval_type(v->cell[1]) == LVAL_QEXPR) {
+        lopt_depend(v->cell[0]);
+        lval* x = lopt_as_expr(v->cell[1]);
+        lval* r = lopt_expr(e, x);
+        if (r) {
+            lval_del(x);
+            x = r;
         }
+        return x;
+    }
+    if (!lopt_is_pure(fn)) { return NULL; }
+    for (int i = 1; i < v->count; i++) {
+        if (!lopt_is_literal(v->cell[i])) { return NULL; }
+    }
+
+    // calls that fail are left to fail when they run
+    lval* a = lval_sexpr();
+    for (int i = 1; i < v->count; i++) { lval_add(a, lval_ref(v->cell[i])); }
+    lval* r = fn(e, a);
+    if (lval_type(r) == LVAL_ERR) {
+        lval_del(r);
+        return NULL;
     }
+    lopt_depend(v->cell[0]);
+    return r;
+}
 
-    // if no existing entry, allocate space for new variable
-    e->count++;
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
+// optimized copy of v, or NULL if nothing changes. Only S-Expressions are
+// code, so anything else is left alone
+static lval* lopt_expr(lenv* e, lval* v) {
+    if (lval_type(v) != LVAL_SEXPR) { return NULL; }
+    lval* x = lopt_elems(e, v);
+    lval* w = x ? x : v;
+
+    // a single literal evaluates to itself
+    if (w->count == 1 && lopt_is_literal(w->cell[0])) {
+        lval* r = lval_ref(w->cell[0]);
+        if (x) { lval_del(x); }
+        return r;
+    }
 
-    // copy symbol and lval into new locations
-    e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count - 1], k->sym);
-    e->vals[e->count - 1] = lval_copy(v);
+    lval* r = lopt_call(e, w);
+    if (!r) { return x; }
+    if (x) { lval_del(x); }
+    return r;
 }
 
-// put new value in global scope
-void lenv_def(lenv* e, lval* k, lval* v) {
-    // iterate until no parent
-    while (e->par) { e = e->par; }
-    lenv_put(e, k, v);
+// optimized copy of list q evaluated as an S-Expression, as a function
+// body or branch of an if is, or NULL if nothing changes
+static lval* lopt_body(lenv* e, lval* q) {
+    lval* x = lopt_elems(e, q);
+    lval* r = lopt_call(e, x ? x : q);
+    if (!r) { return x; }
+    if (x) { lval_del(x); }
+
+    // the body is the expression's elements, or the expression alone
+    if (lval_type(r) == LVAL_SEXPR) {
+        r = lval_own(r);
+        r->type = LVAL_QEXPR;
+        return r;
+    }
+    return lval_add(lval_qexpr(), r);
 }
 
 /**
- * builtin functions
+ * Compile lvals
+ *
+ * Function bodies are compiled on their first call into code for a stack
+ * machine, which is cached on the body and used for every call after.
+ * Each instruction is an opcode word followed by its operands.
+ *
+ *   CONST v          push a reference to v
+ *   EMPTY            push a new empty S-Expression
+ *   LOAD_LOCAL i k   push the value in slot i of the frame if it binds
+ *                    symbol k there, else look k up by name
+ *   LOAD_GLOBAL k c  look k up by name through the env chain, or take
+ *                    it straight from the global slot cached in c, which
+ *                    is three words: the env version, env and slot
+ *   CALL n           pop n values and evaluate them as an S-Expression
+ *   TAIL_CALL n      CALL n in tail position, returning its result or
+ *                    the pending tail call for lval_run to make
+ *   GUARD_IF t       jump to t unless the two values on top are the
+ *                    builtin if and a number, otherwise drop the if
+ *   JUMP_IF_FALSE t  pop a number and jump to t if it is zero
+ *   JUMP t           jump to t
+ *   RETURN           return the value on top
+ *
+ * Code is compiled from the optimized form of the body, which it owns, or
+ * from the body itself if nothing could be optimized. It only borrows the
+ * constants it pushes from that, which lives at least as long as the code.
+ * Anything that may change the body, such as lval_own, drops its code
+ * first.
  */
+enum { LOP_CONST, LOP_EMPTY, LOP_LOAD_LOCAL, LOP_LOAD_GLOBAL, LOP_CALL,
+       LOP_TAIL_CALL, LOP_GUARD_IF, LOP_JUMP_IF_FALSE, LOP_JUMP, LOP_RETURN };
+
+typedef union {
+    int op;       // opcode or integer operand
+    lval* v;      // constant or symbol operand
+    unsigned ver; // env version of a cached lookup
+    lenv* env;    // env of a cached lookup
+} lword;
+
+struct lcode {
+    lval* src;        // optimized form of the body, or NULL if it has none
+    unsigned version; // lopt_version src was optimized at, or 0 if it does
+                      // not rely on any bindings
+    int running;      // calls running the code
+    int dropped;      // dropped by its body while running
+    int count;        // number of words
+    int max_stack;    // most values the code has on the stack at once
+    lword words[];
+};
 
-lval* builtin_head(lenv* e, lval* a) {
-    LASSERT_NUM_ARGS("head", a, 1);
-    LASSERT_ARG_TYPE("head", a, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("head", a, 0);
+lval* lcode_src(lcode* c) {
+    return c->src;
+}
 
-    lval* v = lval_take(a, 0); // take the first arg (a qexpr)
-    while(v->count > 1) {
-        lval_del(lval_pop(v, 1)); // delete tail
+// free c without releasing its optimized form, which the collector
+// releases on its own
+void lcode_free(lcode* c) {
+    if (c) { lfree(c, sizeof(lcode) + sizeof(lword) * c->count); }
+}
+
+// drop code c from its body. Code a call is still running is freed once
+// the last such call returns
+void lcode_del(lcode* c) {
+    if (!c) { return; }
+    if (c->running) {
+        c->dropped = 1;
+        return;
     }
-    return v;
+    if (c->src) { lval_del(c->src); }
+    lcode_free(c);
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
-    LASSERT_NUM_ARGS("tail", a, 1);
-    LASSERT_ARG_TYPE("tail", a, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("tail", a, 0);
+// code being compiled
+typedef struct {
+    lword* words;
+    int count;
+    int cap;
+    int depth;     // values on the stack at the current word
+    int max_stack;
+} lcompiler;
+
+static int lcompile_emit(lcompiler* c, lword w) {
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 32;
+        c->words = realloc(c->words, sizeof(lword) * c->cap);
+    }
+    c->words[c->count] = w;
+    return c->count++;
+}
 
-    lval* v = lval_take(a, 0); // take the first arg (a qexpr)
-    lval_del(lval_pop(v, 0)); // delete head
-    return v;
+static int lcompile_op(lcompiler* c, int op) {
+    return lcompile_emit(c, (lword){ .op = op });
 }
 
-lval* builtin_list(lenv* e, lval* a) {
-    a->type = LVAL_QEXPR;
-    return a;
+static void lcompile_val(lcompiler* c, lval* v) {
+    lcompile_emit(c, (lword){ .v = v });
 }
 
-lval* lval_join(lval* x, lval* y) {
-    while(y->count) {
-        lval_add(x, lval_pop(y, 0));
-    }
-    lval_del(y);
-    return x;
+static void lcompile_push(lcompiler* c, int n) {
+    c->depth += n;
+    if (c->depth > c->max_stack) { c->max_stack = c->depth; }
 }
 
-lval* lval_eval(lenv* e, lval* v);
-lval* builtin_eval(lenv* e, lval* a) {
-    LASSERT_NUM_ARGS("eval", a, 1);
-    LASSERT_ARG_TYPE("eval", a, 0, LVAL_QEXPR);
+// point the jump operand at word i to the next word
+static void lcompile_patch(lcompiler* c, int i) {
+    c->words[i].op = c->count;
+}
 
-    lval* x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+static void lcompile_expr(lcompiler* c, lval* v, int tail);
+static void lcompile_list(lcompiler* c, lval* v, int tail);
+
+// an (if cond {then} {else}) form, which is compiled to jumps guarded by
+// a check that if still names the builtin when it runs
+static int lcompile_is_if(lval* v) {
+    return v->count == 4 && v->cell[0] == lsym_if &&
+           lval_type(v->cell[2]) == LVAL_QEXPR &&
+           lval_type(v->cell[3]) == LVAL_QEXPR;
 }
 
-lval* builtin_join(lenv* e, lval* a) {
-    for (int i = 0; i < a->count; i++) {
-        LASSERT_ARG_TYPE("join", a, i, LVAL_QEXPR);
+static void lcompile_if(lcompiler* c, lval* v, int tail) {
+    lcompile_expr(c, v->cell[0], 0);
+    lcompile_expr(c, v->cell[1], 0);
+    int depth = c->depth;
+
+    lcompile_op(c, LOP_GUARD_IF);
+    int generic = lcompile_op(c, 0);
+    lcompile_op(c, LOP_JUMP_IF_FALSE);
+    int otherwise = lcompile_op(c, 0);
+
+    // branches are evaluated as S-Expressions, as builtin_if does
+    c->depth = depth - 2;
+    lcompile_list(c, v->cell[2], tail);
+    int then_end = -1;
+    if (!tail) {
+        lcompile_op(c, LOP_JUMP);
+        then_end = lcompile_op(c, 0);
     }
 
-    lval* x = lval_pop(a, 0);
-
-    while(a->count) {
-        x = lval_join(x, lval_pop(a, 0));
+    lcompile_patch(c, otherwise);
+    c->depth = depth - 2;
+    lcompile_list(c, v->cell[3], tail);
+    int else_end = -1;
+    if (!tail) {
+        lcompile_op(c, LOP_JUMP);
+        else_end = lcompile_op(c, 0);
     }
 
-    lval_del(a);
-    return x;
+    // if the guard fails, call whatever if is with the branches as data
+    lcompile_patch(c, generic);
+    c->depth = depth;
+    lcompile_expr(c, v->cell[2], 0);
+    lcompile_expr(c, v->cell[3], 0);
+    lcompile_op(c, tail ? LOP_TAIL_CALL : LOP_CALL);
+    lcompile_op(c, 4);
+    c->depth = depth - 1;
+
+    if (!tail) {
+        lcompile_patch(c, then_end);
+        lcompile_patch(c, else_end);
+    }
 }
 
-lval* builtin_var(lenv* e, lval* a, char* func) {
-    LASSERT_ARG_TYPE(func, a, 0, LVAL_QEXPR);
+// compile the elements of v evaluated as an S-Expression
+static void lcompile_list(lcompiler* c, lval* v, int tail) {
+    if (v->count == 0) {
+        lcompile_op(c, LOP_EMPTY);
+        lcompile_push(c, 1);
+        if (tail) { lcompile_op(c, LOP_RETURN); }
+        return;
+    }
 
-    // first argument is symbol list
-    lval* syms = a->cell[0];
+    // a single expression evaluates to its own value
+    if (v->count == 1) {
+        lcompile_expr(c, v->cell[0], tail);
+        return;
+    }
 
-    // ensure all elements of first list are symbols
-    for (int i = 0; i < syms->count; i++) {
-        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-                "Function '%s' cannot define non-symbol. "
-                "Got %s, expected %s.",
-                func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+    if (lcompile_is_if(v)) {
+        lcompile_if(c, v, tail);
+        return;
     }
 
-    // check correct number of symbols and values
-    LASSERT(a, (syms->count == a->count - 1),
-            "Function '%s' cannot define incorrect number of values to "
-            "symbols. Got %i symbols and %i values.",
-            func, syms->count, a->count - 1);
+    for (int i = 0; i < v->count; i++) { lcompile_expr(c, v->cell[i], 0); }
+    lcompile_op(c, tail ? LOP_TAIL_CALL : LOP_CALL);
+    lcompile_op(c, v->count);
+    c->depth -= v->count - 1;
+}
 
-    // assign copies of values to symbols
-    for (int i = 0; i < syms->count; i++) {
-        // if 'def' define globally if 'put' define locally
-        if (strcmp("def", func) == 0) {
-            lenv_def(e, syms->cell[i], a->cell[i + 1]);
-        }
-        else if (strcmp("=", func) == 0){
-            lenv_put(e, syms->cell[i], a->cell[i + 1]);
-        }
+static void lcompile_expr(lcompiler* c, lval* v, int tail) {
+    if (lval_type(v) == LVAL_SEXPR) {
+        lcompile_list(c, v, tail);
+        return;
     }
 
-    lval_del(a);
-    return lval_sexpr();
+    if (lval_is_local(v)) {
+        lcompile_op(c, LOP_LOAD_LOCAL);
+        lcompile_op(c, lsym_slot(v));
+        lcompile_val(c, lsym_plain(v));
+    } else if (lval_is_sym(v)) {
+        lcompile_op(c, LOP_LOAD_GLOBAL);
+        lcompile_val(c, v);
+        lcompile_emit(c, (lword){ .ver = 0 });
+        lcompile_emit(c, (lword){ .env = NULL });
+        lcompile_op(c, 0);
+    } else {
+        // everything else evaluates to itself
+        lcompile_op(c, LOP_CONST);
+        lcompile_val(c, v);
+    }
+    lcompile_push(c, 1);
+    if (tail) { lcompile_op(c, LOP_RETURN); }
 }
 
-lval* builtin_def(lenv* e, lval* a) {
-    return builtin_var(e, a, "def");
+// compile function body, a Q-Expression evaluated as an S-Expression
+lcode* lcode_compile(lval* body) {
+    lcompiler c = { NULL, 0, 0, 0, 0 };
+    lcompile_list(&c, body, 1);
+
+    // code lives as long as the body, so goes in the body's heap
+    lheap* prev = lalloc_switch(lalloc_obj_heap(body));
+    lcode* code = lalloc(sizeof(lcode) + sizeof(lword) * c.count);
+    lalloc_switch(prev);
+
+    code->src = NULL;
+    code->version = 0;
+    code->running = 0;
+    code->dropped = 0;
+    code->count = c.count;
+    code->max_stack = c.max_stack;
+    memcpy(code->words, c.words, sizeof(lword) * c.count);
+    free(c.words);
+    return code;
 }
 
-lval* builtin_put(lenv* e, lval* a) {
-    return builtin_var(e, a, "=");
+// code for function body, compiled on the first call from its optimized
+// form, which is remade if the folds in it are out of date. e is the env
+// the body is about to run in
+lcode* lval_prepare(lenv* e, lval* body) {
+    lcode* c = body->code;
+    if (c && c->version && c->version != lopt_version) {
+        lcode_del(c);
+        body->code = c = NULL;
+    }
+    if (c) { return c; }
+
+    // the optimized form lives as long as the code, so in the body's heap
+    lheap* prev = lalloc_switch(lalloc_obj_heap(body));
+    lval* src = lopt_body(e, body);
+    lalloc_switch(prev);
+
+    c = lcode_compile(src ? src : body);
+    c->src = src;
+    c->version = src ? lopt_version : 0;
+    body->code = c;
+    return c;
 }
 
-lval* builtin_lambda(lenv* e, lval* a) {
-    LASSERT_NUM_ARGS("\\", a, 2);
-    LASSERT_ARG_TYPE("\\", a, 0, LVAL_QEXPR);
-    LASSERT_ARG_TYPE("\\", a, 1, LVAL_QEXPR);
-
-    // ensure all elements of first list are symbols
-    for (int i = 0; i < a->cell[0]->count; i++) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-                "Function '\' cannot define non-symbol. "
-                "Got %s, expected %s.",
-                ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
-    }
+/**
+ * Virtual machine
+ *
+ * Values are kept on one stack shared by every running function. A call
+ * runs nested code above the caller's values, which may move the stack,
+ * so it is always indexed through lvm_stack.
+ */
+static _Thread_local lval** lvm_stack = NULL;
+static _Thread_local int lvm_sp = 0;
+static _Thread_local int lvm_cap = 0;
+
+// free the value stack once this thread is done with it
+void lvm_release(void) {
+    free(lvm_stack);
+    lvm_stack = NULL;
+    lvm_sp = lvm_cap = 0;
+}
 
-    // pop args and return new lval_lambda
-    lval* formals = lval_pop(a, 0);
-    lval* body = lval_pop(a, 0);
-    lval_del(a);
+static inline void lvm_push(lval* v) { lvm_stack[lvm_sp++] = v; }
+static inline lval* lvm_pop(void) { return lvm_stack[--lvm_sp]; }
 
-    return lval_lambda(formals, body);
-}
+// evaluate the n values on top of the stack as an S-Expression, exactly
+// as lval_eval_sexpr does once the elements are evaluated
+static lval* lvm_apply(lenv* e, int n, int tail) {
+    lval** v = &lvm_stack[lvm_sp - n];
+    lvm_sp -= n;
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
-    // ensure all arguments are numbers
-    for (int i = 0; i < a->count; i++) {
-        if (a->cell[i]->type != LVAL_NUM) {
-            lval* err = lval_err("Function '%s' passed incorrect type for "
-                                 "argument %i. Got %s, expected %s.",
-                                 op, i,
-                                 ltype_name(a->cell[i]->type),
-                                 ltype_name(LVAL_NUM));
-            lval_del(a);
+    // error checking
+    for (int i = 0; i < n; i++) {
+        if (lval_type(v[i]) == LVAL_ERR) {
+            lval* err = v[i];
+            for (int j = 0; j < n; j++) { if (j != i) { lval_del(v[j]); } }
             return err;
         }
     }
 
-    // pop the first element
-    lval* x = lval_pop(a, 0);
+    // single expression
+    if (n == 1) { return v[0]; }
 
-    // if no arguments and sub the perform unary negation
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        x->num = -x->num;
-    }
-
-    // while there are still arguments remaining
-    while(a->count > 0) {
-        // pop the next element
-        lval* y = lval_pop(a, 0);
-        if (strcmp(op, "+") == 0) { x->num += y->num; }
-        if (strcmp(op, "-") == 0) { x->num -= y->num; }
-        if (strcmp(op, "*") == 0) { x->num *= y->num; }
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Function '/' caused division by zero.");
-                break;
+    // ensure first element is function
+    lval* f = v[0];
+    if (lval_type(f) != LVAL_FUN) {
+        lval* err = lval_err("Incorrect type for first element. "
+                             "Got %s, expected %s.",
+                             ltype_name(lval_type(f)), ltype_name(LVAL_FUN));
+        for (int i = 0; i < n; i++) { lval_del(v[i]); }
+        return err;
+    }
+
+    // the arguments take over the references held by the stack
+    lval* a = lval_sexpr();
+    a->count = n - 1;
+    a->cap = a->count;
+    a->cell = lalloc(sizeof(lval*) * a->count);
+    memcpy(a->cell, &v[1], sizeof(lval*) * a->count);
+
+    lgc_maybe_collect();
+    ltail = tail;
+    return lval_call(e, f, a);
+}
+
+#ifdef __GNUC__
+// dispatch straight from each instruction to the next
+#define LVM_DISPATCH  goto *lvm_labels[(ip++)->op];
+#define LVM_CASE(op)  lvm_##op:
+#define LVM_NEXT      goto *lvm_labels[(ip++)->op]
+#else
+#define LVM_DISPATCH  for (;;) switch ((ip++)->op)
+#define LVM_CASE(op)  case op:
+#define LVM_NEXT      continue
+#endif
+
+// run code c with e as its frame, returning the result
+lval* lvm_run(lenv* e, lcode* c) {
+#ifdef __GNUC__
+    static void* lvm_labels[] = {
+        &&lvm_LOP_CONST, &&lvm_LOP_EMPTY, &&lvm_LOP_LOAD_LOCAL,
+        &&lvm_LOP_LOAD_GLOBAL, &&lvm_LOP_CALL, &&lvm_LOP_TAIL_CALL,
+        &&lvm_LOP_GUARD_IF, &&lvm_LOP_JUMP_IF_FALSE, &&lvm_LOP_JUMP,
+        &&lvm_LOP_RETURN
+    };
+#endif
+
+    lgc_maybe_collect();
+
+    // make room for everything this code pushes
+    if (lvm_sp + c->max_stack > lvm_cap) {
+        lvm_cap = (lvm_sp + c->max_stack) * 2;
+        lvm_stack = realloc(lvm_stack, sizeof(lval*) * lvm_cap);
+    }
+
+    lword* ip = c->words;
+    LVM_DISPATCH {
+        LVM_CASE(LOP_CONST) {
+            lvm_push(lval_ref((ip++)->v));
+            LVM_NEXT;
+        }
+        LVM_CASE(LOP_EMPTY) {
+            lvm_push(lval_sexpr());
+            LVM_NEXT;
+        }
+        LVM_CASE(LOP_LOAD_LOCAL) {
+            int i = (ip++)->op;
+            lval* k = (ip++)->v;
+            if (i < e->count && e->syms[i] == k) {
+                lvm_push(lval_ref(e->vals[i]));
+            } else {
+                lvm_push(lenv_get(e, k));
             }
-            x->num /= y->num;
+            LVM_NEXT;
         }
-        if (strcmp(op, "%") == 0) {
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Function '%%' caused division by zero.");
-                break;
+        LVM_CASE(LOP_LOAD_GLOBAL) {
+            if (ip[1].ver == lenv_version) {
+                lvm_push(lval_ref(ip[2].env->vals[ip[3].op]));
+            } else {
+                lvm_push(lenv_get_cached(e, ip[0].v, &ip[1].ver, &ip[2].env,
+                                         &ip[3].op));
+            }
+            ip += 4;
+            LVM_NEXT;
+        }
+        LVM_CASE(LOP_CALL) {
+            int n = (ip++)->op;
+            lvm_push(lvm_apply(e, n, 0));
+            LVM_NEXT;
+        }
+        LVM_CASE(LOP_TAIL_CALL) {
+            int n = (ip++)->op;
+            return lvm_apply(e, n, 1);
+        }
+        LVM_CASE(LOP_GUARD_IF) {
+            int t = (ip++)->op;
+            lval* f = lvm_stack[lvm_sp - 2];
+            lval* cond = lvm_stack[lvm_sp - 1];
+            if (lval_is_builtin(f) && lval_as_builtin(f) == builtin_if &&
+                lval_type(cond) == LVAL_NUM) {
+                lvm_stack[lvm_sp - 2] = cond;
+                lvm_sp--;
+            } else {
+                ip = c->words + t;
             }
-            x->num = x->num % y->num;
+            LVM_NEXT;
+        }
+        LVM_CASE(LOP_JUMP_IF_FALSE) {
+            int t = (ip++)->op;
+            lval* cond = lvm_pop();
+            if (!lval_as_num(cond)) { ip = c->words + t; }
+            lval_del(cond);
+            LVM_NEXT;
+        }
+        LVM_CASE(LOP_JUMP) {
+            ip = c->words + ip->op;
+            LVM_NEXT;
+        }
+        LVM_CASE(LOP_RETURN) {
+            return lvm_pop();
         }
-        lval_del(y);
     }
-    lval_del(a);
-    return x;
+    return NULL;
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-    return builtin_op(e, a, "+");
+// run code c with e as its frame. The body c was compiled for may drop
+// it while it runs, in which case it is freed once the last run returns
+lval* lcode_run(lenv* e, lcode* c) {
+    c->running++;
+    lval* x = lvm_run(e, c);
+    if (--c->running == 0 && c->dropped) { lcode_del(c); }
+    return x;
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-    return builtin_op(e, a, "-");
+/**
+ * Tasks
+ *
+ * spawn calls a function as a task, a green thread with a C stack of its
+ * own, and returns a future that await turns into the result. Tasks hand
+ * values to each other over channels, each a bounded queue.
+ *
+ * Tasks are scheduled cooperatively on the thread that spawned them. One
+ * runs until it waits, on await, on a full or empty channel or in yield,
+ * and the next ready task is then switched to. Waiting while no task is
+ * ready would never end, so is a deadlock error instead.
+ *
+ * A task stays on the thread whose heaps hold its values, so the tasks of
+ * a thread share a core; pmap is what spreads work over several. Tasks
+ * allocate from the global heap only, as the form owning the arena may end
+ * while they wait. What tasks and channels hold is not followed by the
+ * collector, and is kept for as long as a handle to them is.
+ *
+ * Without ucontext, as on Windows, spawn makes the call straight away and
+ * waiting on a channel always deadlocks.
+ */
+// pages of a stack are only committed once touched, so reserving as much
+// as a thread's own stack costs nothing for tasks that stay shallow
+#define LTASK_STACK_SIZE (8 << 20)
+// stacks of finished tasks kept for the next ones
+#define LTASK_STACK_CACHE 16
+
+enum { LTASK_READY, LTASK_WAITING, LTASK_DONE };
+
+// tasks waiting on something, the longest waiting first
+typedef struct {
+    ltask* head;
+    ltask* tail;
+} ltask_list;
+
+struct ltask {
+    int refs;         // futures, plus one until the task is done
+    int state;
+    lenv* env;        // the global env, or a frame of its own in front of it
+    lval* fn;         // the call to make, until the task starts
+    lval* args;
+    lval* result;     // once done
+    ltask* next;      // in the run queue or a list of waiting tasks
+    ltask* prev;      // in a list of waiting tasks
+    ltask_list* list; // list of waiting tasks it is in, if any
+    ltask_list waiters; // tasks awaiting this one
+    char* stack;
+#ifndef _WIN32
+    ucontext_t ctx;
+#endif
+    // evaluator state of the task while another runs
+    lispy_vm* vm;
+    lheap* heap;
+    int arena_off;
+    int tail;
+    lval* tail_fun;
+    lenv* tail_env;
+    lval** vm_stack;
+    int vm_sp;
+    int vm_cap;
+};
+
+struct lchan {
+    int refs;
+    int cap;
+    int count;
+    int head;
+    lval** items;     // ring of cap values, the oldest at head
+    ltask_list senders;   // tasks waiting for room
+    ltask_list receivers; // tasks waiting for a value
+};
+
+// the thread's own stack, which runs top-level forms, and the task running
+static _Thread_local ltask ltask_main;
+static _Thread_local ltask* ltask_cur = NULL;
+static _Thread_local ltask* ltask_ready = NULL;
+static _Thread_local ltask* ltask_ready_end = NULL;
+// finished task, whose stack is only let go once switched off
+static _Thread_local ltask* ltask_dead = NULL;
+static _Thread_local char* ltask_stacks[LTASK_STACK_CACHE];
+static _Thread_local int ltask_nstacks = 0;
+
+ltask* ltask_ref(ltask* t) {
+    t->refs++;
+    return t;
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-    return builtin_op(e, a, "*");
+void ltask_unref(ltask* t) {
+    if (--t->refs > 0) { return; }
+    if (t->result) { lval_del(t->result); }
+    free(t);
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-    return builtin_op(e, a, "/");
+lchan* lchan_ref(lchan* c) {
+    c->refs++;
+    return c;
 }
 
-lval* builtin_mod(lenv* e, lval* a) {
-    return builtin_op(e, a, "%");
+void lchan_unref(lchan* c) {
+    if (--c->refs > 0) { return; }
+    for (int i = 0; i < c->count; i++) {
+        lval_del(c->items[(c->head + i) % c->cap]);
+    }
+    free(c->items);
+    free(c);
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-    LASSERT_NUM_ARGS(op, a, 2);
-    LASSERT_ARG_TYPE(op, a, 0, LVAL_NUM);
-    LASSERT_ARG_TYPE(op, a, 1, LVAL_NUM);
+static ltask* ltask_self(void) {
+    if (!ltask_cur) { ltask_cur = &ltask_main; }
+    return ltask_cur;
+}
 
-    int r = 0;
-    if (strcmp(op, ">") == 0) {
-        r = (a->cell[0]->num > a->cell[1]->num);
+static void ltask_wake(ltask* t) {
+    t->state = LTASK_READY;
+    t->next = NULL;
+    if (ltask_ready_end) {
+        ltask_ready_end->next = t;
+    } else {
+        ltask_ready = t;
     }
-    else if (strcmp(op, "<") == 0) {
-        r = (a->cell[0]->num < a->cell[1]->num);
+    ltask_ready_end = t;
+}
+
+// take t out of the list of waiting tasks it is in, if any
+static void ltask_list_remove(ltask* t) {
+    ltask_list* l = t->list;
+    if (!l) { return; }
+    if (t->prev) { t->prev->next = t->next; } else { l->head = t->next; }
+    if (t->next) { t->next->prev = t->prev; } else { l->tail = t->prev; }
+    t->list = NULL;
+    t->next = t->prev = NULL;
+}
+
+// move the longest waiting task in list l to the run queue. One value sent
+// or one slot freed can only let one task on, so waking the rest would
+// only have them check and wait again
+static void ltask_wake_one(ltask_list* l) {
+    ltask* t = l->head;
+    if (!t) { return; }
+    ltask_list_remove(t);
+    ltask_wake(t);
+}
+
+// move every task in list l to the run queue
+static void ltask_wake_all(ltask_list* l) {
+    while (l->head) { ltask_wake_one(l); }
+}
+
+static ltask* ltask_next(void) {
+    ltask* t = ltask_ready;
+    if (t) {
+        ltask_ready = t->next;
+        if (!ltask_ready) { ltask_ready_end = NULL; }
     }
-    else if (strcmp(op, ">=") == 0) {
-        r = (a->cell[0]->num >= a->cell[1]->num);
+    return t;
+}
+
+static void ltask_save(ltask* t) {
+    t->vm = lispy_cur;
+    t->heap = lheap_cur;
+    t->arena_off = lheap_arena_off;
+    t->tail = ltail;
+    t->tail_fun = ltail_fun;
+    t->tail_env = ltail_env;
+    t->vm_stack = lvm_stack;
+    t->vm_sp = lvm_sp;
+    t->vm_cap = lvm_cap;
+}
+
+static void ltask_load(ltask* t) {
+    lispy_cur = t->vm;
+    lheap_cur = t->heap;
+    lheap_arena_off = t->arena_off;
+    ltail = t->tail;
+    ltail_fun = t->tail_fun;
+    ltail_env = t->tail_env;
+    lvm_stack = t->vm_stack;
+    lvm_sp = t->vm_sp;
+    lvm_cap = t->vm_cap;
+    ltask_cur = t;
+    if (t->vm) { lenv_enter(t->vm->env); }
+}
+
+// env for a task spawned from e. Scoping is dynamic, so the task sees what
+// the frames of e bind, but those frames may be gone before it runs. The
+// bindings, inner frames hiding outer ones, are copied into a frame of the
+// task's own in front of the global env, kept as a collector root
+static lenv* ltask_env_new(lenv* e) {
+    lenv* g = e;
+    while (g->par) { g = g->par; }
+    if (e == g) { return g; }
+
+    lheap* prev = lalloc_switch(&lheap_global);
+    lenv* x = lenv_new();
+    x->par = g;
+    for (lenv* f = e; f != g; f = f->par) {
+        for (int i = 0; i < f->count; i++) {
+            if (lenv_slot(x, f->syms[i]) < 0) {
+                lenv_put(x, f->syms[i], f->vals[i]);
+            }
+        }
     }
-    else if (strcmp(op, "<=") == 0) {
-        r = (a->cell[0]->num <= a->cell[1]->num);
+    lalloc_switch(prev);
+    if (!lgc_add_root(x)) {
+        lenv_del(x);
+        return NULL;
     }
-
-    lval_del(a);
-    return lval_num(r);
+    return x;
 }
 
-lval* builtin_gt(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">");
+static void ltask_env_del(ltask* t) {
+    if (t->env && !t->env->top) {
+        lgc_remove_root(t->env);
+        lenv_del(t->env);
+    }
+    t->env = NULL;
 }
 
-lval* builtin_lt(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<");
+#ifndef _WIN32
+static char* ltask_stack_new(void) {
+    if (ltask_nstacks) { return ltask_stacks[--ltask_nstacks]; }
+    char* s = mmap(NULL, LTASK_STACK_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (s == MAP_FAILED) { return NULL; }
+    // stacks grow down, so overflowing one faults on its lowest page
+    mprotect(s, sysconf(_SC_PAGESIZE), PROT_NONE);
+    return s;
 }
 
-lval* builtin_ge(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">=");
+static void ltask_stack_free(char* s) {
+    if (ltask_nstacks < LTASK_STACK_CACHE) {
+        ltask_stacks[ltask_nstacks++] = s;
+    } else {
+        munmap(s, LTASK_STACK_SIZE);
+    }
 }
 
-lval* builtin_le(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<=");
+// let go of the task that finished before the last switch
+static void ltask_reap(void) {
+    ltask* t = ltask_dead;
+    if (!t) { return; }
+    ltask_dead = NULL;
+    ltask_stack_free(t->stack);
+    t->stack = NULL;
+    free(t->vm_stack);
+    t->vm_stack = NULL;
+    ltask_unref(t);
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-    LASSERT_NUM_ARGS(op, a, 2);
-    int r = 0;
-    if (strcmp(op, "==") == 0) {
-        r = lval_eq(a->cell[0], a->cell[1]);
-    } else if (strcmp(op, "!=") == 0) {
-        r = !lval_eq(a->cell[0], a->cell[1]);
-    }
-    lval_del(a);
-    return lval_num(r);
+// run t in place of the running task, until something switches back
+static void ltask_switch(ltask* t) {
+    ltask* self = ltask_cur;
+    ltask_save(self);
+    ltask_load(t);
+    swapcontext(&self->ctx, &t->ctx);
+    ltask_reap();
 }
 
-lval* builtin_eq(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "==");
+// first function on the stack of every task
+static void ltask_run(void) {
+    ltask_reap();
+    ltask* t = ltask_cur;
+    lval* fn = t->fn;
+    lval* args = t->args;
+    t->fn = t->args = NULL;
+    t->result = lval_call(t->env, fn, args);
+    ltask_env_del(t);
+    t->state = LTASK_DONE;
+    ltask_wake_all(&t->waiters);
+
+    // with nothing ready, the thread's own stack is left waiting, and
+    // finds the deadlock once it checks again what it waits for
+    ltask_save(t);
+    ltask_dead = t;
+    ltask* next = ltask_next();
+    ltask_load(next ? next : &ltask_main);
+    setcontext(&ltask_cur->ctx);
 }
 
-lval* builtin_ne(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "!=");
+static void ltask_list_add(ltask_list* l, ltask* t) {
+    t->list = l;
+    t->prev = l->tail;
+    t->next = NULL;
+    if (l->tail) { l->tail->next = t; } else { l->head = t; }
+    l->tail = t;
 }
 
-lval* builtin_if(lenv* e, lval* a) {
-    LASSERT_NUM_ARGS("if", a, 3);
-    LASSERT_ARG_TYPE("if", a, 0, LVAL_NUM);
-    LASSERT_ARG_TYPE("if", a, 1, LVAL_QEXPR);
-    LASSERT_ARG_TYPE("if", a, 2, LVAL_QEXPR);
+// wait in list, running ready tasks until one wakes the waiting task.
+// Returns 0 if no task is ready to run, which would be a deadlock
+static int ltask_wait(ltask_list* list) {
+    ltask* self = ltask_self();
+    ltask* t = ltask_next();
+    if (!t) { return 0; }
 
-    // mark both expressions as eval-able
-    lval* x;
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
+    self->state = LTASK_WAITING;
+    ltask_list_add(list, self);
+    ltask_switch(t);
 
-    // if condition is true, evaluate the first expression. Else, the second
-    if (a->cell[0]->num) {
-        x = lval_eval(e, lval_pop(a, 1));
-    } else {
-        x = lval_eval(e, lval_pop(a, 2));
-    }
-    lval_del(a);
-    return x;
+    // the thread's own stack may be switched back to without being woken
+    ltask_list_remove(self);
+    return 1;
 }
 
-lval* builtin_load(lenv* e, lval* a) {
-    LASSERT_NUM_ARGS("load", a, 1);
-    LASSERT_ARG_TYPE("load", a, 0, LVAL_STR);
+static void ltask_yield(void) {
+    ltask* self = ltask_self();
+    ltask* t = ltask_next();
+    if (!t) { return; }
+    ltask_wake(self);
+    ltask_switch(t);
+}
+#else
+static int ltask_wait(ltask_list* list) { return 0; }
+static void ltask_yield(void) {}
+#endif
 
-    mpc_result_t r;
-    if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-        // read
-        lval* expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
-
-        // eval
-        while (expr->count) {
-            lval* x = lval_eval(e, lval_pop(expr, 0));
-            if (x->type == LVAL_ERR) { lval_println(x); }
-            lval_del(x);
+// drop the tasks of vm that are ready to run, as they never can once it is
+// freed. Tasks of vm still waiting are left waiting
+void ltask_forget(lispy_vm* vm) {
+    ltask* t = ltask_ready;
+    ltask_ready = ltask_ready_end = NULL;
+    while (t) {
+        ltask* next = t->next;
+        if (t->vm != vm) {
+            ltask_wake(t);
+        } else {
+#ifndef _WIN32
+            ltask_stack_free(t->stack);
+#endif
+            free(t->vm_stack);
+            t->stack = NULL;
+            t->vm_stack = NULL;
+            if (t->fn) {
+                lval_del(t->fn);
+                lval_del(t->args);
+                t->fn = t->args = NULL;
+            }
+            ltask_env_del(t);
+            t->state = LTASK_DONE;
+            t->result = lval_err("Task dropped as its interpreter was freed.");
+            ltask_unref(t);
         }
+        t = next;
+    }
+}
 
-        // delete expr and arguments
-        lval_del(expr);
-        lval_del(a);
+// unmap the stacks kept for reuse once this thread is done with tasks
+void ltask_release(void) {
+#ifndef _WIN32
+    while (ltask_nstacks) { munmap(ltask_stacks[--ltask_nstacks], LTASK_STACK_SIZE); }
+#endif
+    ltask_cur = NULL;
+}
 
-        return lval_sexpr();
-    } else {
-        // get parse error as string
-        char* err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
+lval* builtin_spawn(lenv* e, lval* a) {
+    LASSERT(a, (a->count >= 1),
+            "Function 'spawn' passed no arguments. Expected a function.");
+    LASSERT_ARG_TYPE("spawn", a, 0, LVAL_FUN);
 
-        lval* err = lval_err("Could not load Library %s", err_msg);
-        free(err_msg);
+    ltask* t = calloc(1, sizeof(ltask));
+#ifdef _WIN32
+    t->refs = 1;
+    t->state = LTASK_DONE;
+    lval* fn = lval_pop(a, 0);
+    t->result = lval_promote(lval_call(e, fn, a), &lheap_global);
+#else
+    t->stack = ltask_stack_new();
+    t->env = t->stack ? ltask_env_new(e) : NULL;
+    if (!t->env) {
+        if (t->stack) { ltask_stack_free(t->stack); }
+        free(t);
         lval_del(a);
-
-        return err;
+        return lval_err("Function 'spawn' could not allocate a stack.");
     }
+    ltask_self();
+    // the task refers to these long after the spawning form is done
+    t->fn = lval_promote(lval_pop(a, 0), &lheap_global);
+    t->args = lval_promote(a, &lheap_global);
+    t->refs = 2;
+    t->vm = lispy_cur;
+    t->heap = &lheap_global;
+    t->arena_off = 1;
+    getcontext(&t->ctx);
+    t->ctx.uc_stack.ss_sp = t->stack;
+    t->ctx.uc_stack.ss_size = LTASK_STACK_SIZE;
+    t->ctx.uc_link = NULL;
+    makecontext(&t->ctx, ltask_run, 0);
+    ltask_wake(t);
+#endif
+
+    lval* v = lval_new(LVAL_FUTURE);
+    v->task = t;
+    return v;
 }
 
-lval* builtin_print(lenv* e, lval* a) {
-    for (int i = 0; i < a->count; i++) {
-        lval_print(a->cell[i]);
-        putchar(' ');
-    }
+lval* builtin_await(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("await", a, 1);
+    LASSERT_ARG_TYPE("await", a, 0, LVAL_FUTURE);
 
-    putchar('\n');
+    ltask* t = a->cell[0]->task;
+    while (t->state != LTASK_DONE) {
+        LASSERT(a, ltask_wait(&t->waiters),
+                "Function 'await' deadlocked. No task is ready to run.");
+    }
+    lval* x = lval_ref(t->result);
     lval_del(a);
-
-    return lval_sexpr();
+    return x;
 }
 
-lval* builtin_error(lenv* e, lval* a) {
-    LASSERT_NUM_ARGS("error", a, 1);
-    LASSERT_ARG_TYPE("error", a, 0, LVAL_STR);
-
-    lval* err = lval_err(a->cell[0]->str);
+lval* builtin_chan(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("chan", a, 1);
+    LASSERT_ARG_TYPE("chan", a, 0, LVAL_NUM);
+    long cap = lval_as_num(a->cell[0]);
+    LASSERT(a, (cap >= 1 && cap <= INT_MAX),
+            "Function 'chan' passed capacity %li. Expected at least 1.", cap);
+
+    lchan* c = calloc(1, sizeof(lchan));
+    c->refs = 1;
+    c->cap = cap;
+    c->items = malloc(sizeof(lval*) * cap);
     lval_del(a);
-    return err;
-}
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-    lval* k = lval_sym(name);
-    lval* v = lval_fun(func);
-    lenv_put(e, k, v);
-    lval_del(k);
-    lval_del(v);
+    lval* v = lval_new(LVAL_CHAN);
+    v->chan = c;
+    return v;
 }
 
-// adds builtin functions to environment
-void lenv_add_builtins(lenv* e) {
-    // variable functions
-    lenv_add_builtin(e, "\\",  builtin_lambda);
-    lenv_add_builtin(e, "def", builtin_def);
-    lenv_add_builtin(e, "=",   builtin_put);
+lval* builtin_send(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("send", a, 2);
+    LASSERT_ARG_TYPE("send", a, 0, LVAL_CHAN);
 
-    // list functions
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
+    lchan* c = a->cell[0]->chan;
+    while (c->count == c->cap) {
+        LASSERT(a, ltask_wait(&c->senders),
+                "Function 'send' deadlocked. No task is ready to run.");
+    }
+    // the channel may outlive the form that sent the value
+    lval* x = lval_promote(lval_ref(a->cell[1]), &lheap_global);
+    c->items[(c->head + c->count++) % c->cap] = x;
+    ltask_wake_one(&c->receivers);
+    lval_del(a);
+    return lval_sexpr();
+}
 
-    // mathematical functions
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
-    lenv_add_builtin(e, "%", builtin_mod);
+lval* builtin_recv(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("recv", a, 1);
+    LASSERT_ARG_TYPE("recv", a, 0, LVAL_CHAN);
 
-    // comparator functions
-    lenv_add_builtin(e, ">", builtin_gt);
-    lenv_add_builtin(e, "<", builtin_lt);
-    lenv_add_builtin(e, ">=", builtin_ge);
-    lenv_add_builtin(e, "<=", builtin_le);
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_ne);
-    lenv_add_builtin(e, "if", builtin_if);
+    lchan* c = a->cell[0]->chan;
+    while (c->count == 0) {
+        LASSERT(a, ltask_wait(&c->receivers),
+                "Function 'recv' deadlocked. No task is ready to run.");
+    }
+    lval* x = c->items[c->head];
+    c->head = (c->head + 1) % c->cap;
+    c->count--;
+    ltask_wake_one(&c->senders);
+    lval_del(a);
+    return x;
+}
 
-    lenv_add_builtin(e, "load", builtin_load);
-    lenv_add_builtin(e, "print", builtin_print);
-    lenv_add_builtin(e, "error", builtin_error);
+lval* builtin_yield(lenv* e, lval* a) {
+    ltask_yield();
+    lval_del(a);
+    return lval_sexpr();
 }
 
 /**
- * Evaluate lval
+ * Interpreters
+ *
+ * Each lispy_vm has a global environment of its own, so several can run
+ * side by side. One is used and freed on the thread that made it, where
+ * it shares that thread's heaps with any others made there; interpreters
+ * on different threads share only the symbol and builtin tables.
  */
-lval* lval_eval(lenv* e, lval* v);
-lval* lval_call(lenv* e, lval* f, lval* a);
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-    // evaluate children
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
-    }
-
-    // error checking
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
-    }
+// interpreters alive on this thread
+static _Thread_local int lispy_count = 0;
+
+// the mpc grammar of vm, set up on first use
+mpc_parser_t* lispy_grammar(lispy_vm* vm) {
+    if (vm->Lispy) { return vm->Lispy; }
+    vm->Number = mpc_new("number");
+    vm->Symbol = mpc_new("symbol");
+    vm->String = mpc_new("string");
+    vm->Comment = mpc_new("comment");
+    vm->Sexpr = mpc_new("sexpr");
+    vm->Qexpr = mpc_new("qexpr");
+    vm->Expr = mpc_new("expr");
+    vm->Lispy = mpc_new("lispy");
 
-    // empty expression
-    if (v->count == 0) { return v; }
-    // single expression
-    if (v->count == 1) { return lval_take(v, 0); }
+    mpca_lang(MPCA_LANG_DEFAULT,
+        "                                          \
+        number: /-?[0-9]+(\\.[0-9]+)?([eE][-+]?[0-9]+)?/; \
+        symbol: /[a-zA-Z0-9_+\\-*\\/%\\\\=<>!&]+/; \
+        string: /\"(\\\\.|[^\"])*\"/;              \
+        comment: /;[^\\r\\n]*/;                    \
+        sexpr:  '(' <expr>* ')';                   \
+        qexpr:  '{' <expr>* '}';                   \
+        expr:   <number> | <symbol> | <string> |   \
+                <comment> | <sexpr> | <qexpr>;     \
+        lispy:  /^/ <expr>* /$/;                   \
+        ", vm->Number, vm->Symbol, vm->String, vm->Comment, vm->Sexpr,
+        vm->Qexpr, vm->Expr, vm->Lispy
+    );
+    return vm->Lispy;
+}
 
-    // ensure first element is function after evaluation
-    lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval* err = lval_err("Incorrect type for first element. "
-                             "Got %s, expected %s.",
-                             ltype_name(f->type), ltype_name(LVAL_FUN));
-        lval_del(f);
-        lval_del(v);
+// every form of src as an S-Expression, read by whichever reader is in
+// use, or an error
+lval* lispy_read(lispy_vm* vm, const char* name, const char* src) {
+    if (!lread_use_mpc) { return lval_read_src(name, src, strlen(src)); }
+    mpc_result_t r;
+    if (!mpc_parse(name, src, lispy_grammar(vm), &r)) {
+        char* msg = mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+        lval* err = lval_err("%s", msg);
+        free(msg);
         return err;
     }
+    lval* x = lval_read(r.output);
+    mpc_ast_delete(r.output);
+    return x;
+}
 
-    // call function with arguments
-    lval* result = lval_call(e, f, v);
-    lval_del(f);
+// printed form of v as a string the caller frees
+char* lval_to_string(lval* v) {
+#ifdef _WIN32
+    FILE* f = tmpfile();
+    lval_fprint(f, v);
+    long len = ftell(f);
+    rewind(f);
+    char* buf = malloc(len + 1);
+    buf[fread(buf, 1, len, f)] = '\0';
+    fclose(f);
+    return buf;
+#else
+    char* buf = NULL;
+    size_t len = 0;
+    FILE* f = open_memstream(&buf, &len);
+    lval_fprint(f, v);
+    fclose(f);
+    return buf;
+#endif
+}
 
-    return result;
+lispy_vm* lispy_new(void) {
+    lalloc_init();
+    lsym_init();
+    lenv* e = lenv_new();
+    e->top = 1;
+    lenv_add_builtins(e);
+    if (!lgc_add_root(e)) {
+        lenv_del(e);
+        return NULL;
+    }
+    lispy_vm* vm = calloc(1, sizeof(lispy_vm));
+    vm->env = e;
+    lispy_count++;
+    return vm;
 }
 
-lval* lval_eval(lenv* e, lval* v) {
-    if (v->type == LVAL_SYM) {
-        lval* x = lenv_get(e, v);
-        lval_del(v);
-        return x;
+// the copy shares every value with vm, which is safe as values are copied
+// by lval_own before being changed. Memos are the exception, changing
+// their cache in place on every call, so each clone gets caches of its own
+lispy_vm* lispy_clone(lispy_vm* vm) {
+    lheap* prev = lalloc_switch(&lheap_global);
+    lenv* e = lenv_copy(vm->env);
+    e->top = 1;
+    for (int i = 0; i < e->count; i++) {
+        lval* v = e->vals[i];
+        if (!lval_is_imm(v) && v->type == LVAL_MEMO) {
+            e->vals[i] = lval_copy(v);
+            lval_del(v);
+        }
     }
-    if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
-    return v;
+    lalloc_switch(prev);
+    if (!lgc_add_root(e)) {
+        lenv_del(e);
+        return NULL;
+    }
+    lispy_vm* x = calloc(1, sizeof(lispy_vm));
+    x->env = e;
+    lispy_count++;
+    return x;
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
-    // if builtin, just call it
-    if (f->builtin) { return f->builtin(e, a); }
+char* lispy_eval_string(lispy_vm* vm, const char* src) {
+    lispy_vm* prev = lispy_cur;
+    lispy_cur = vm;
+    lenv_enter(vm->env);
+    free(vm->error);
+    vm->error = NULL;
+
+    lalloc_arena_begin();
+    // forms are evaluated in turn up to the first error. Each form's slot
+    // is emptied as it is taken
+    lval* x = lispy_read(vm, "<string>", src);
+    if (lval_type(x) != LVAL_ERR) {
+        lval* forms = x;
+        x = lval_sexpr();
+        for (int i = 0; i < forms->count && lval_type(x) != LVAL_ERR; i++) {
+            lval_del(x);
+            x = lval_eval(vm->env, forms->cell[i]);
+            forms->cell[i] = lval_num(0);
+        }
+        lval_del(forms);
+    }
+    char* out = NULL;
+    if (lval_type(x) == LVAL_ERR) {
+        // reader errors end in a newline, evaluation errors do not
+        size_t len = strcspn(x->err, "\n");
+        vm->error = malloc(len + 1);
+        memcpy(vm->error, x->err, len);
+        vm->error[len] = '\0';
+    } else {
+        out = lval_to_string(x);
+    }
+    lval_del(x);
+    lalloc_arena_end();
 
-    // record argument counts
-    int given = a->count;
-    int total = f->formals->count;
+    lispy_cur = prev;
+    return out;
+}
 
-    // while arguments still remain to be processed
-    while (a->count) {
-        // if ran out of formal arguments to bind
-        if (f->formals->count == 0) {
-            lval_del(a);
-            return lval_err("Function passed too many arguments."
-                            "Got %i, expected %i.",
-                            given, total);
-        }
+const char* lispy_error(lispy_vm* vm) {
+    return vm->error;
+}
 
-        // put copy of next symbol and argument into function's environment
-        lval* sym = lval_pop(f->formals, 0);
+void lispy_free(lispy_vm* vm) {
+    ltask_forget(vm);
+    // another env made at the same address must not pass for this one
+    if (lenv_top == vm->env) { lenv_top = NULL; }
+    lgc_remove_root(vm->env);
+    lenv_del(vm->env);
+    // whatever cycles are left through the env go with the next collection,
+    // rather than making freeing a clone cost a whole one
+    lgc_maybe_collect();
+    if (vm->Lispy) {
+        mpc_cleanup(8, vm->Number, vm->Symbol, vm->String, vm->Comment,
+                    vm->Qexpr, vm->Sexpr, vm->Expr, vm->Lispy);
+    }
+    free(vm->error);
+    free(vm);
+
+    // the last interpreter on a thread gives back all it has set up
+    if (--lispy_count == 0) {
+        lgc_release();
+        lvm_release();
+        ltask_release();
+        free(lsym_flags);
+        lsym_flags = NULL;
+        lsym_flags_cap = 0;
+        lalloc_release();
+    }
+}
 
-        // special case for variable number of arguments
-        if (strcmp(sym->sym, "&") == 0) {
-            // ensure "&" is followed by one other symbol
-            if (f->formals->count != 1) {
-                lval_del(a);
-                return lval_err("Function format invalid."
-                                "Symbol '&' not followed by single symbol");
-            }
+#ifndef LISPY_NO_MAIN
+/**
+ * Server
+ *
+ * --serve <path> keeps interpreters running behind a Unix domain socket,
+ * so jobs skip starting lispy and loading the prelude each time. Requests
+ * are frames, a 4-byte big-endian length followed by that many bytes of
+ * source. The forms of a request are evaluated in turn, and it is answered
+ * with a frame holding a status byte, 0 for a value or 1 for an error, and
+ * then the printed value or the error message.
+ *
+ * Each worker thread has an interpreter set up with the image and files
+ * given on the command line, and an epoll set of its own, in which it
+ * waits on the listening socket and on the connections it accepted.
+ * Connections to a worker share its global environment, unless --isolate
+ * gives each one a clone of it, so every connection starts from the state
+ * the command line set up. The worker's own interpreter is then never
+ * evaluated in, and only serves to clone.
+ */
+#define LSERVE_MAX_FRAME (64 << 20)
+#define LSERVE_EVENTS 64
+
+typedef struct {
+    const char* path;
+    int workers;      // 0 for one per processor
+    int isolate;
+    const char* image;
+    char** files;
+    int nfiles;
+    int listener;
+} lserve_config;
+
+#ifdef __linux__
+// wake a single worker for each connection waiting to be accepted
+#ifdef EPOLLEXCLUSIVE
+#define LSERVE_EXCLUSIVE EPOLLEXCLUSIVE
+#else
+#define LSERVE_EXCLUSIVE 0
+#endif
 
-            // next formal should be bound to remaining arguments
-            lval* nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
+typedef struct {
+    int fd;
+    lispy_vm* vm;
+    int own_vm;       // set up for this connection alone
+    int writing;      // waiting for room to send the rest of out
+    char* in;         // bytes received, up to the end of the last frame
+    size_t in_len;
+    size_t in_cap;
+    char* out;        // replies not yet sent, from out_pos
+    size_t out_len;
+    size_t out_pos;
+    size_t out_cap;
+} lconn;
+
+// interpreter set up as the command line asks, or NULL
+static lispy_vm* lserve_vm(lserve_config* cfg) {
+    lispy_vm* vm = lispy_new();
+    if (!vm) { return NULL; }
+    lispy_vm* prev = lispy_cur;
+    lispy_cur = vm;
+    lenv_enter(vm->env);
+    if (cfg->image) {
+        lval* err = lenv_restore(vm->env, cfg->image);
+        if (err) { lval_println(err); lval_del(err); }
+    }
+    for (int i = 0; i < cfg->nfiles; i++) {
+        lval* x = builtin_load(vm->env,
+                               lval_add(lval_sexpr(), lval_str(cfg->files[i])));
+        if (lval_type(x) == LVAL_ERR) { lval_println(x); }
+        lval_del(x);
+    }
+    lispy_cur = prev;
+    return vm;
+}
 
-            lval_del(sym);
-            lval_del(nsym);
-            break;
-        }
+static void lconn_reserve(char** buf, size_t* cap, size_t need) {
+    if (need <= *cap) { return; }
+    size_t n = *cap ? *cap : 4096;
+    while (n < need) { n *= 2; }
+    *buf = realloc(*buf, n);
+    *cap = n;
+}
 
-        lval* val = lval_pop(a, 0);
-        lenv_put(f->env, sym, val);
+static void lconn_reply(lconn* c, int status, const char* msg) {
+    size_t len = strlen(msg) + 1;
+    lconn_reserve(&c->out, &c->out_cap, c->out_len + 4 + len);
+    unsigned char* p = (unsigned char*)c->out + c->out_len;
+    p[0] = len >> 24;
+    p[1] = len >> 16;
+    p[2] = len >> 8;
+    p[3] = len;
+    p[4] = status;
+    memcpy(p + 5, msg, len - 1);
+    c->out_len += 4 + len;
+}
 
-        lval_del(sym);
-        lval_del(val);
+// evaluate every complete frame received on c, returning 0 if one is too
+// large to accept
+static int lconn_eval_frames(lconn* c) {
+    size_t pos = 0;
+    while (c->in_len - pos >= 4) {
+        unsigned char* p = (unsigned char*)c->in + pos;
+        uint32_t len = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+                       (uint32_t)p[2] << 8 | p[3];
+        if (len > LSERVE_MAX_FRAME) { return 0; }
+        if (c->in_len - pos - 4 < len) { break; }
+
+        char* src = malloc(len + 1);
+        memcpy(src, p + 4, len);
+        src[len] = '\0';
+        char* out = lispy_eval_string(c->vm, src);
+        if (out) {
+            lconn_reply(c, 0, out);
+            free(out);
+        } else {
+            lconn_reply(c, 1, lispy_error(c->vm));
+        }
+        free(src);
+        pos += 4 + len;
     }
+    // anything printed shows up as the requests are answered
+    if (pos) { fflush(stdout); }
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    return 1;
+}
 
-    // argument list is now bound so can be cleaned up
-    lval_del(a);
+// read what c has sent, answering each frame as it is completed. Returns 0
+// once the client has hung up or broken the protocol
+static int lconn_read(lconn* c) {
+    for (;;) {
+        lconn_reserve(&c->in, &c->in_cap, c->in_len + 65536);
+        ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+        if (n == 0) { return 0; }
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->in_len += n;
+        if (!lconn_eval_frames(c)) { return 0; }
+    }
+}
 
-    // if '&' remains in formal list bind to empty list
-    if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
-        // check to make sure '&' is not passed invalidly
-        if (f->formals->count != 2) {
-            return lval_err("Function format invalid. Symbol '&' not "
-                            "followed by a singe symbol.");
+// send as much of the queued replies as the socket takes, returning 0 if
+// the connection has failed
+static int lconn_flush(lconn* c) {
+    while (c->out_pos < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
         }
+        c->out_pos += n;
+    }
+    c->out_pos = c->out_len = 0;
+    return 1;
+}
 
-        // pop and delete '&' symbol
-        lval_del(lval_pop(f->formals, 0));
+// wait for room to send on c only while replies are queued
+static int lconn_watch(int ep, lconn* c) {
+    int writing = c->out_len > 0;
+    if (writing == c->writing) { return 1; }
+    c->writing = writing;
+    struct epoll_event ev = { .events = EPOLLIN | (writing ? EPOLLOUT : 0),
+                              .data.ptr = c };
+    return epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev) == 0;
+}
 
-        // pop next symbol and create empty list
-        lval* sym = lval_pop(f->formals, 0);
-        lval* val = lval_qexpr();
+static void lconn_close(lconn* c) {
+    close(c->fd);
+    if (c->own_vm) { lispy_free(c->vm); }
+    free(c->in);
+    free(c->out);
+    free(c);
+}
 
-        // bind to environment and delete
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
-        lval_del(val);
+// take one waiting connection, leaving any others to the next worker woken
+static void lserve_accept(lserve_config* cfg, int ep, lispy_vm* base) {
+    int fd = accept(cfg->listener, NULL, NULL);
+    if (fd < 0) { return; }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    lconn* c = calloc(1, sizeof(lconn));
+    c->fd = fd;
+    c->vm = base;
+    if (cfg->isolate) {
+        c->vm = lispy_clone(base);
+        c->own_vm = c->vm != NULL;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (!c->vm || epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        lconn_close(c);
+    }
+}
 
+static void* lserve_worker(void* p) {
+    lserve_config* cfg = p;
+    lispy_vm* base = lserve_vm(cfg);
+    if (!base) { return NULL; }
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN | LSERVE_EXCLUSIVE,
+                              .data.ptr = NULL };
+    if (ep < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, cfg->listener, &ev) != 0) {
+        perror("epoll");
+        return NULL;
     }
 
-    // if all formals have been bound, evaluate
-    if (f->formals->count == 0) {
-        // set up parent env
-        f->env->par = e;
+    struct epoll_event evs[LSERVE_EVENTS];
+    for (;;) {
+        int n = epoll_wait(ep, evs, LSERVE_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            lconn* c = evs[i].data.ptr;
+            if (!c) {
+                lserve_accept(cfg, ep, base);
+                continue;
+            }
+            // replies to what was read before a hang up are still sent
+            int open = 1;
+            if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                open = lconn_read(c);
+            }
+            if (!lconn_flush(c) || !open || !lconn_watch(ep, c)) {
+                lconn_close(c);
+            }
+        }
+    }
+    return NULL;
+}
 
-        // evaluate the body
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        // otherwise return partially evaluated function
-        return lval_copy(f);
+// serve on cfg->path until killed, returning only if that fails to start
+int lserve(lserve_config* cfg) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(cfg->path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long\n", cfg->path);
+        return 1;
     }
+    strcpy(addr.sun_path, cfg->path);
+
+    // a socket left behind by an earlier server is replaced
+    struct stat st;
+    if (stat(cfg->path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(cfg->path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        perror(cfg->path);
+        return 1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    cfg->listener = fd;
+
+    int workers = cfg->workers;
+    if (workers < 1) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = n > 0 ? n : 1;
+    }
+    // this thread is the last worker
+    for (int i = 1; i < workers; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, lserve_worker, cfg) != 0) { break; }
+        pthread_detach(t);
+    }
+    lserve_worker(cfg);
+    return 1;
+}
+#else
+int lserve(lserve_config* cfg) {
+    fputs("--serve needs epoll, so is only supported on Linux\n", stderr);
+    return 1;
 }
+#endif
 
 int main(int argc, char *argv[]) {
-    // set up parsers
-    Number = mpc_new("number");
-    Symbol = mpc_new("symbol");
-    String = mpc_new("string");
-    Comment = mpc_new("comment");
-    Sexpr = mpc_new("sexpr");
-    Qexpr = mpc_new("qexpr");
-    Expr = mpc_new("expr");
-    Lispy = mpc_new("lispy");
-
-    mpca_lang(MPCA_LANG_DEFAULT,
-        "                                          \
-        number: /-?[0-9]+/;                        \
-        symbol: /[a-zA-Z0-9_+\\-*\\/%\\\\=<>!&]+/; \
-        string: /\"(\\\\.|[^\"])*\"/;              \
-        comment: /;[^\\r\\n]*/;                    \
-        sexpr:  '(' <expr>* ')';                   \
-        qexpr:  '{' <expr>* '}';                   \
-        expr:   <number> | <symbol> | <string> |   \
-                <comment> | <sexpr> | <qexpr>;     \
-        lispy:  /^/ <expr>* /$/;                   \
-        ", Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy
-    );
+    // set up interpreter
+    lispy_vm* vm = lispy_new();
+    lispy_cur = vm;
+    lenv* e = vm->env;
+
+    lserve_config serve = { NULL, 0, 0, NULL, NULL, 0, -1 };
+
+    // flags come before the files to load
+    int first = 1;
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+        if (strcmp(argv[first], "--no-vm") == 0) {
+            lvm_enabled = 0;
+        } else if (strcmp(argv[first], "--mpc") == 0) {
+            lread_use_mpc = 1;
+        } else if (strcmp(argv[first], "--image") == 0 && first + 1 < argc) {
+            // restore the environment saved by dump
+            serve.image = argv[++first];
+            lval* err = lenv_restore(e, serve.image);
+            if (err) {
+                lval_println(err);
+                return 1;
+            }
+        } else if (strcmp(argv[first], "--serve") == 0 && first + 1 < argc) {
+            serve.path = argv[++first];
+        } else if (strcmp(argv[first], "--workers") == 0 && first + 1 < argc) {
+            serve.workers = atoi(argv[++first]);
+        } else if (strcmp(argv[first], "--isolate") == 0) {
+            serve.isolate = 1;
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[first]);
+            return 1;
+        }
+    }
 
-    // set up environment
-    lenv* e = lenv_new();
-    lenv_add_builtins(e);
+    // the files set up every interpreter of the server instead
+    if (serve.path) {
+        serve.files = argv + first;
+        serve.nfiles = argc - first;
+        lispy_free(vm);
+        return lserve(&serve);
+    }
 
-    if (argc >= 2) {
-        for (int i = 1; i < argc; i++) {
+    if (first < argc) {
+        for (int i = first; i < argc; i++) {
+            // "-" streams a script from stdin
             lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
-            lval* x = builtin_load(e, args);
-            if (x->type == LVAL_ERR) { lval_println(x); }
+            lval* x = strcmp(argv[i], "-") == 0
+                ? builtin_load_stream(e, args)
+                : builtin_load(e, args);
+            if (lval_type(x) == LVAL_ERR) { lval_println(x); }
             lval_del(x);
         }
     } else {
@@ -1099,29 +7557,28 @@ int main(int argc, char *argv[]) {
         while(1) {
             // output to prompt and get input
             char* input = readline("Lispy> ");
+            if (!input) { break; }
 
             // add input to history
             add_history(input);
 
-            mpc_result_t r;
-            if(mpc_parse("<stdin>", input, Lispy, &r)) {
-                /*mpc_ast_print(r.output);*/
-                lval* x = lval_eval(e, lval_read(r.output));
-                lval_println(x);
+            lalloc_arena_begin();
+            lval* x = lispy_read(vm, "<stdin>", input);
+            if (lval_type(x) == LVAL_ERR) {
+                fputs(x->err, stdout);
                 lval_del(x);
-                mpc_ast_delete(r.output);
             } else {
-                mpc_err_print(r.error);
-                mpc_err_delete(r.error);
+                x = lval_eval(e, x);
+                lval_println(x);
+                lval_del(x);
             }
+            lalloc_arena_end();
 
             free(input);
         }
     }
 
-    // undefine and delete parsers
-    mpc_cleanup(8, Number, Symbol, String, Comment, Qexpr, Sexpr, Expr, Lispy);
-
-    lenv_del(e);
+    lispy_free(vm);
     return 0;
 }
+#endif
@@ -0,0 +1,32 @@
+/**
+ * # Embedding
+ * cc -std=c11 -Wall -pthread -DLISPY_NO_MAIN -c lispy.c
+ *
+ * Each interpreter has a global environment of its own. An interpreter is
+ * used and freed on the thread that made it, and any number of threads may
+ * run interpreters of their own at the same time.
+ */
+#ifndef LISPY_H
+#define LISPY_H
+
+typedef struct lispy_vm lispy_vm;
+
+// new interpreter with the builtins defined, or NULL if out of memory
+lispy_vm* lispy_new(void);
+
+// new interpreter whose global environment starts out as vm's is now,
+// sharing its values until either one changes them. An interpreter set up
+// once, say by loading the prelude, and then only cloned gives each clone
+// a clean environment in microseconds. vm must be on this thread
+lispy_vm* lispy_clone(lispy_vm* vm);
+
+// evaluate each form in src in turn, returning the printed value of the
+// last as a string the caller frees, or NULL on error
+char* lispy_eval_string(lispy_vm* vm, const char* src);
+
+// message of the last failed lispy_eval_string, or NULL
+const char* lispy_error(lispy_vm* vm);
+
+void lispy_free(lispy_vm* vm);
+
+#endif